@@ -231,6 +231,29 @@ priv AST *parse_list(Parser *p)
 	return ast_alloc(p->arena, (AST) { AST_LIST, .AST_LIST = lst });
 }
 
+// Keys and values go in one list, alternating
+priv AST *parse_map(Parser *p)
+{
+	u64	previous_offset = p->arena->used;
+	ASTList	*lst = astlist(p->arena);
+	if (p->next_token.type == TK_RBRACE) // empty map
+		return (next_token(p), ast_alloc(p->arena, (AST) { AST_MAP, .AST_MAP = lst }));
+	do {
+		next_token(p);
+		AST *key = parse_expression(p, LOWEST);
+		if (!key || !expect_peek(p, TK_COLON))
+			return (arena_pop_to(p->arena, previous_offset), NULL);
+		next_token(p);
+		AST *value = parse_expression(p, LOWEST);
+		if (!value)
+			return (arena_pop_to(p->arena, previous_offset), NULL);
+		astpush(lst, key), astpush(lst, value);
+	} while (p->next_token.type == TK_COMMA && (next_token(p), true));
+	if (!expect_peek(p, TK_RBRACE))
+		return (arena_pop_to(p->arena, previous_offset), NULL);
+	return ast_alloc(p->arena, (AST) { AST_MAP, .AST_MAP = lst });
+}
+
 priv ASTList *parse_many(Parser *p, TokenType end_type)
 {
 	u64	previous_offset = p->arena->used;
@@ -421,6 +444,7 @@ priv PrefixParser PREFIX_PARSERS(TokenType type)
 		case TK_STRING: return &parse_string;
 		case TK_IDENT: return &parse_ident;
 		case TK_LBRACKET: return &parse_list;
+		case TK_LBRACE: return &parse_map;
 		case TK_FN: return &parse_function;
 		case TK_TRUE: case TK_FALSE: return &parse_bool;
 		case TK_BANG: case TK_MINUS: return &parse_prefix_expression;
@@ -478,8 +502,10 @@ priv Precedence PRECEDENCE(TokenType type)
 AST *ast_alloc(Arena *a, AST node)
 {
 	AST	*ptr = arena_alloc(a, sizeof(AST));
-	if (node.type == AST_IDENT) // XXX where is it better to alloc (parse_string now allocs)
-		node.AST_STR = str_dup(a, node.AST_STR);
+	if (node.type == AST_IDENT) { // XXX where is it better to alloc (parse_string now allocs)
+		node.AST_IDENT.name = str_dup(a, node.AST_IDENT.name);
+		node.AST_IDENT.cache = (IdentCache) {0};
+	}
 	if (node.type == AST_VAL)
 		node.AST_VAL.name = str_dup(a, node.AST_VAL.name);
 	if (node.type == AST_VAR)
@@ -488,6 +514,18 @@ AST *ast_alloc(Arena *a, AST node)
 	return ptr;
 }
 
+// `x = f(x, ...)`: a call whose result replaces its first argument
+bool ast_self_call(struct AST_ASSIGN *node)
+{
+	if (node->left->type != AST_IDENT || node->right->type != AST_CALL)
+		return false;
+	struct AST_CALL *call = &node->right->AST_CALL;
+	if (call->function->type != AST_IDENT || !call->args->len)
+		return false;
+	AST *first = call->args->head->ast;
+	return (first->type == AST_IDENT && str_eq(first->AST_STR, node->left->AST_STR));
+}
+
 ASTList *astlist(Arena *a)
 {
 	ASTList *l = arena_alloc(a, sizeof(ASTList));
@@ -577,12 +615,19 @@ String ast_str(Arena *a, AST *node)
 		case AST_VAR:
 			return str_fmt(a, "|%.*s=%.*s|", fmt(node->AST_VAR.name), fmt(ast_str(a, node->AST_VAR.value)));
 		case AST_RETURN:
-			return str_fmt(a, "|return %.*s|", ast_str(a, node->AST_RETURN.value));
+			return str_fmt(a, "|return %.*s|", fmt(ast_str(a, node->AST_RETURN.value)));
 		case AST_ASSIGN:
 			return str_fmt(a, "|%.*s = %.*s|", fmt(ast_str(a, node->AST_ASSIGN.left)), fmt(ast_str(a, node->AST_ASSIGN.right)));
 		case AST_PROGRAM:
 		case AST_LIST:
 			return astlist_str(a, node->AST_LIST);
+		case AST_MAP: {
+			String res = str("");
+			for (ASTNode *key = node->AST_MAP->head; key && key->next; key = key->next->next)
+				res = str_fmt(a, "%.*s%s%.*s: %.*s", fmt(res), (key == node->AST_MAP->head) ? "" : ", ",
+						fmt(ast_str(a, key->ast)), fmt(ast_str(a, key->next->ast)));
+			return str_fmt(a, "{%.*s}", fmt(res));
+		}
 		case AST_FN:
 			return str_concat(a, astlist_str(a, node->AST_FN.params), astlist_str(a, node->AST_FN.body));
 		case AST_PREFIX:
@@ -605,6 +650,8 @@ String ast_str(Arena *a, AST *node)
 					fmt(astlist_str(a, node->AST_CALL.args)));
 		case AST_INDEX:
 			return str_fmt(a, "(%.*s[%.*s])", fmt(ast_str(a, node->AST_INDEX.left)), fmt(ast_str(a, node->AST_INDEX.index)));
+		case AST_INVARIANT:
+			return str_fmt(a, "(hoisted %.*s)", fmt(ast_str(a, node->AST_INVARIANT.value)));
 	}
 	return (NEVER(1), str(""));
 }
@@ -645,9 +692,9 @@ String	asttype_str(ASTType type)
 		str("AST_VAL"), str("AST_VAR"), str("AST_ASSIGN"), str("AST_WHILE"),
 		str("AST_RETURN"), str("AST_IDENT"), str("AST_INT"), 
 		str("AST_BOOL"), str("AST_BOOL"), str("AST_STR"), 
-		str("AST_LIST"), str("AST_FN"), str("AST_PREFIX"), 
+		str("AST_LIST"), str("AST_MAP"), str("AST_FN"), str("AST_PREFIX"), 
 		str("AST_INFIX"), str("AST_COND"), str("AST_CALL"), 
-		str("AST_INDEX"), str("AST_PROGRAM")
+		str("AST_INDEX"), str("AST_INVARIANT"), str("AST_PROGRAM")
 	};
 	if (NEVER(type < 0 || type > arrlen(typenames)))
 		return str("Unkown ast type");
@@ -11,11 +11,14 @@
 #define DECOMMIT_MIN MB(32)
 // HEADERS
 priv void *reserve_virtual_memory(u64 size);
-priv void commit_memory(void *block, u64 size);
+priv bool commit_memory(void *block, u64 size);
+priv void decommit_memory(void *block, u64 size);
 priv int free_virtual_memory(void *ptr, size_t size);
 // ~ARENA
 
-Arena	*arena(u64 cap)
+thread_global jmp_buf *arena_full = NULL;
+
+priv Arena *arena_commit_first(u64 cap, bool whole)
 {
 	// Align
 	u64	commit_min = PAGE_SIZE;
@@ -23,10 +26,15 @@ Arena	*arena(u64 cap)
 	cap -= cap % commit_min;
 	// Reserve
 	void *block = reserve_virtual_memory(cap);
-	// Initial Commit
-	u64 init_commit = PAGE_SIZE;
+	// Initial Commit, before anything is written so the mapping can still merge
+	u64 init_commit = (whole) ? cap : PAGE_SIZE;
 	if (init_commit < sizeof(Arena)) exit(1);
-	commit_memory(block, init_commit);
+	if (!commit_memory(block, init_commit)) { // Over the commit limit
+		free_virtual_memory(block, cap);
+		if (arena_full)
+			longjmp(*arena_full, 1);
+		dprintf(2, "!PANIC: Could not commit memory\n"), exit(1);
+	}
 
 	Arena *a = block;
 	a->buf = a;
@@ -36,8 +44,31 @@ Arena	*arena(u64 cap)
 	return a;
 }
 
+Arena	*arena(u64 cap)
+{
+	return arena_commit_first(cap, false);
+}
+
+// Committed whole at once: a single mapping, which the kernel merges with neighbours
+// committed the same way, where a partly committed arena takes two
+Arena	*arena_committed(u64 cap)
+{
+	return arena_commit_first(cap, true);
+}
+
+// Arenas running out of space on this thread longjmp to env instead of exiting, until
+// the previous env, which is returned, is put back
+jmp_buf *arena_catch(jmp_buf *env)
+{
+	jmp_buf *previous = arena_full;
+	arena_full = env;
+	return previous;
+}
+
 void *arena_alloc(Arena *a, u64 size)
 {
+	if ((a->used + size) > a->cap && arena_full)
+		longjmp(*arena_full, 1);
 	if (NEVER(((a->used + size) > a->cap))) {
 		dprintf(2, "!PANIC: Arena %p ran out of space\n", a);
 		arena_stats(a, __FILE__, __LINE__);
@@ -58,7 +89,12 @@ void *arena_alloc(Arena *a, u64 size)
 		u64 commit = a->used - a->commited;
 		commit += PAGE_SIZE - 1;
 		commit -= commit % PAGE_SIZE;
-		commit_memory(block + a->commited, commit);
+		if (!commit_memory(block + a->commited, commit)) { // Over the commit limit
+			a->used -= size + padding;
+			if (arena_full)
+				longjmp(*arena_full, 1);
+			dprintf(2, "!PANIC: Could not commit memory for arena %p\n", a), exit(1);
+		}
 		a->commited += commit;
 	}
 
@@ -83,6 +119,11 @@ void arena_free(Arena **a)
 	(*a) = NULL;
 }
 
+bool arena_owns(Arena *a, void *ptr)
+{
+	return ((u8 *)ptr >= (u8 *)a && (u8 *)ptr < (u8 *)a + a->used);
+}
+
 void arena_pop_to(Arena *a, u64 pos)
 {
 	u64 min = sizeof(Arena);
@@ -95,7 +136,7 @@ void arena_pop_to(Arena *a, u64 pos)
 	if (commit_aligned_pos + DECOMMIT_MIN <= a->commited) {
 		u8 *block = (u8 *) a;
 		u64 decommit_size = a->commited - commit_aligned_pos;
-		free_virtual_memory(block + a->used, decommit_size);
+		decommit_memory(block + commit_aligned_pos, decommit_size);
 		a->commited -= decommit_size;
 	}
 }
@@ -119,15 +160,22 @@ void	arena_stats(Arena *a, char *file, i32 line)
 priv void *reserve_virtual_memory(u64 size)
 {
 	void *buf = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (NEVER(!buf)) {
+	if (NEVER(buf == MAP_FAILED)) {
 		dprintf(2, "!PANIC: Could not reserve memory\n"), exit(1);
 	} 
 	return buf;
 }
 
-priv void commit_memory(void *block, u64 size)
+priv bool commit_memory(void *block, u64 size)
+{
+	return mprotect(block, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+// Back to reserved, which also gives the commit charge back
+priv void decommit_memory(void *block, u64 size)
 {
-	mprotect(block, size, PROT_READ | PROT_WRITE);
+	madvise(block, size, MADV_DONTNEED);
+	mprotect(block, size, PROT_NONE);
 }
 
 priv int free_virtual_memory(void *ptr, size_t size)
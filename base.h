@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
 #define BASE_H
 
 # define arrlen(arr) ((sizeof(arr) / sizeof(arr[0])))
@@ -16,6 +17,7 @@
 # define GB(x) (((u64)x) * 1024 * 1024 * 1024)
 
 # define global static
+# define thread_global static _Thread_local // One per thread, for state of an evaluation
 # define priv static
 
 typedef uint8_t u8;
@@ -60,12 +62,15 @@ typedef struct StrList {
 #define fmt(s) (u32)(s).len, (s).buf
 
 Arena	*arena(u64 cap);
+Arena	*arena_committed(u64 cap);
 void 	arena_reset(Arena *a);
 void 	arena_pop_to(Arena *a, u64 pos);
 void 	arena_free(Arena **a);
 void 	*arena_alloc(Arena *a, u64 size);
 void 	*arena_alloc_zero(Arena *a, u64 size);
 void	arena_stats(Arena *a, char *file, i32 line);
+bool	arena_owns(Arena *a, void *ptr);
+jmp_buf	*arena_catch(jmp_buf *env);
 
 void 	str_print(String s);
 String	str_dup(Arena *a, String s);
@@ -1,8 +1,8 @@
 #!/usr/bin/env bash
 ### 
-cflags="-Wall -Werror -Wimplicit-fallthrough -Wno-unused-value -Wunused-function"
+cflags="-Wall -Werror -Wimplicit-fallthrough -Wno-unused-value -Wunused-function -pthread"
 dev="-g3 -fsanitize=address"
-src="base.c lexer.c ast.c evaluator.c"
+src="base.c lexer.c ast.c evaluator.c jit.c transpiler.c optimizer.c"
 exit_on_fail=""
 args="$cflags $src"
 cc=gcc
@@ -28,6 +28,11 @@ compile_tests_evaluator()
 	$cc $args $exit_on_fail tests/evaluator_tests.c tests/test_utils.c -o tests/evaluator_tests.out;
 }
 
+compile_bench()
+{
+	$cc $args tests/namespace_bench.c -o tests/namespace_bench.out;
+}
+
 compile_demo()
 {
 	$cc $args main.c -o demo.out
@@ -84,12 +89,19 @@ case $1 in
 	t|test) 
 		compile;
 		test_launcher ${@:2};;
+	b|bench)
+		compile_bench;
+		[[ $? -eq 0 ]] && ./tests/namespace_bench.out;;
 	demo)
 		compile_demo;
 		[[ $? -eq 0 ]] && ./demo.out;;
 	r|run)
 		compile;
 		[[ $? -eq 0 ]] && ./toyscript ${@:2};;
+	n|native)
+		compile;
+		[[ $? -eq 0 ]] && ./toyscript --emit-c $2 > ${2%.toy}.c \
+			&& $cc $args -I. ${2%.toy}.c -o ${2%.toy};;
 	"")
 		compile;;
 	*)
@@ -3,17 +3,14 @@ class Namespace:
         self.val = val
     def to_string(self):
         res = "NS{"
-        pairs = self.val['values']
-        i = 0
-        found = 0
-        while (i < int(self.val['cap'])) and (found < int(self.val['len'])):
-            if pairs[i]:
-                found += 1
-                res += String(pairs[i]['key']).to_string()
-                # res += ": "
-                # res += Elem(pairs[i]['elem']).to_string()
-                if found < int(self.val['len']): res += " "
-            i += 1
+        length = int(self.val['len'])
+        cap = int(self.val['cap'])
+        if cap == 0:
+            binds = [self.val['binds'][i] for i in range(length)]
+        else:
+            slots = self.val['slots']
+            binds = [slots[i]['bind'].dereference() for i in range(cap) if slots[i]['bind']]
+        res += " ".join(String(b['key']).to_string() for b in binds)
         res += "}"
         if self.val['parent']:
             res += "<-%s" % Namespace(self.val['parent'].dereference()).to_string()
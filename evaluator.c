@@ -1,37 +1,86 @@
+#define _GNU_SOURCE // pthread_getattr_np
 #include "base.h"
 #include "toyscript.h"
 #include <stdio.h>
+#include <ucontext.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define IMMUTABLE 0
 #define MUTABLE 1
+#define FRAME_SIZE MB(1)
+#define FRAME_POOL_MAX 4096
+#define STACK_SEGMENT_SIZE MB(64)
+#define HOLDS_SIZE GB(1)
+#define STACK_RED_ZONE KB(256)
+#define MAX_DEPTH_DEFAULT UINT32_MAX // Bounded by the memory budget instead
+#define CALL_LEVEL_COST KB(8) // A frame's first page and the native stack of a call, with headroom
+#define JIT_HOT_CALLS 16
+#define JIT_FRAME_SIZE 512 // Generous bound on the native stack used per compiled call
+#define SCRATCH_SIZE GB(1)
+#define SCRATCH_MAX 64
+#define LOOP_BLOCK_SIZE GB(1)
 priv Namespace *ns_inner(Arena *a, Namespace *parent, u32 cap); 
-priv Bind *ns_get(Namespace *ns, String key);
+priv Bind *ns_lookup(Namespace *ns, String key, u32 key_hash);
+priv Bind *ns_find(Namespace *ns, String key, u32 key_hash, Namespace **owner);
+priv u32 hash(String key);
 priv int ns_put(Namespace *ns, String key, Element elem, bool is_mutable); 
-priv int ns_update(Namespace *ns, String key, Element elem);
+priv int ns_set(Namespace *ns, String key, u32 key_hash, Element elem, bool is_mutable, bool copy_key);
+priv void ns_update(Namespace *ns, Bind *target, Element elem);
+priv Element bind_read(Bind *b);
 priv Namespace *ns_copy(Arena *a, Namespace *ns);
 
 priv ElemList *elemlist(Arena *a);
 priv ElemList *elemlist_copy(Arena *a, ElemList *lst);
 priv void elempush(ElemList *lst, Element el);
+priv Element *elemlist_at(ElemList *lst, u32 i);
+typedef struct ListIter { ElemNode *node; u32 at; u32 left; } ListIter;
+priv ListIter elemlist_iter(ElemList *lst);
+priv Element *elemlist_next(ListIter *it);
 ElemArray *elemarray(Arena *a, u32 len);
+priv void elemarray_reserve(ElemArray *arr, u32 cap);
+priv ElemArray *elemarray_slice(Arena *a, ElemArray *arr, u32 begin, u32 end);
+priv void elemarray_unshare(ElemArray *arr);
+priv Element disown(Element elem);
+priv bool owns(Bind *b, ElemArray *arr);
 priv ElemArray *elemarray_copy(Arena *a, ElemArray *arr);
-
-priv Element BUILTINS(String name);
+priv ElemMap *elemmap_copy(Arena *a, ElemMap *m);
+priv Element map_from_items(Arena *a, Element *items, u32 len);
+priv ElemVector *elemvector(Arena *a, ElemVector v);
+priv ElemVector vec_push(ElemVector *v, Element el);
+priv ElemVector vec_pop(ElemVector *v);
+priv ElemVector vec_set(ElemVector *v, u32 i, Element el);
+Element *elemvector_at(ElemVector *v, u32 i);
+
+priv Element BUILTINS(String name, u32 key_hash);
+priv Native *builtin_native(String name, u32 key_hash);
+priv Element builtin_elem(Native *native);
+priv void builtins_insert(BuiltinTable *t, Native *native);
+priv Element builtin_call(Arena *a, Namespace *ns, Element fn, ElemArray *args);
 
 priv Element error(String msg);
+priv void job_close(void);
 priv Element *elem_alloc(Arena *a, Element elem);
 priv Element elem_copy(Arena *a, Element elem);
+priv Element elem_store(Arena *a, Element elem);
 ASTList *astlist_copy(Arena *a, ASTList *lst);
 
 priv Element eval_program(Arena *a, Namespace *ns, AST *node);
+priv Element eval_while(Arena *a, Namespace *ns, struct AST_WHILE *node);
+priv Element eval_while_expression(Arena *a, Namespace *ns, AST *node);
+priv Element eval_invariant(Arena *a, Namespace *ns, struct AST_INVARIANT *inv);
+priv Element eval_call_expression(Arena *a, Namespace *ns, AST *node);
 priv Element eval_prefix_expression(Arena *a, String op, Element right);
 priv Element eval_infix_expression(Arena *a, Element left, String op, Element right);
-priv Element eval_identifier(Arena *a, Namespace *ns, String name);
-priv Element eval_mutable_identifier(Arena *a, Namespace *ns, String name);
+priv Element eval_identifier_cached(Arena *a, Namespace *ns, struct AST_IDENT *ident);
+priv Element eval_identifier_shared(Arena *a, Namespace *ns, struct AST_IDENT *ident);
+priv Element eval_mutable_identifier(Arena *a, Namespace *ns, String name, Bind **target, Namespace **owner);
 
 priv Element eval_array(Arena *a, Namespace *ns, ASTList *lst) ;
 priv ElemArray *elemarray_from_ast(Arena *a, Namespace *ns, ASTList *lst);
 priv Element eval_list(Arena *a, Namespace *ns, ASTList *lst);
+priv Element eval_map(Arena *a, Namespace *ns, ASTList *lst);
 priv ElemList *elemlist_from_ast(Arena *a, Namespace *ns, ASTList *lst);
 
 priv Element eval_assignement(Arena *a, Namespace *ns, struct AST_ASSIGN node);
@@ -40,11 +89,33 @@ priv bool is_truthy(Element e);
 priv Element eval_block(Arena *a, Namespace *ns, ASTList *list);
 priv Element eval_index_expression(Arena *a, Namespace *ns, Element left, Element index);
 priv Element eval_cond_expression(Arena *a, Namespace *ns, AST *node);
-priv Element eval_call(Arena *a, Namespace *ns, Element callee, ElemArray *args);
+priv Element eval_call(Arena *a, Arena *frame, Namespace *ns, Element callee, ElemArray *args);
+priv Element eval_infix_node(Arena *a, struct AST_INFIX *node, Element left, Element right);
+priv Element eval_index_node(Arena *a, Namespace *ns, struct AST_INDEX *node, Element left, Element index);
+priv Element eval_call_node(Arena *a, Arena *frame, Namespace *ns, struct AST_CALL *node, Element fn, ElemArray *args);
+
+priv Arena *frame_acquire(void);
+priv void frame_release(Arena *frame);
+priv Arena *scratch_acquire(Arena *a);
+priv Element scratch_release(Arena *a, Arena *scratch, Element res);
+priv Arena *block_acquire(Arena *a, Arena *scratch);
+priv void block_release(Arena *a, Arena *scratch, Arena *block);
+priv Element promote(Arena *a, Element elem);
+priv bool interrupted(void);
+
+thread_global bool specialize = false;
+thread_global bool jit = false;
+thread_global bool jit_fallback = false;
+thread_global bool in_worker = false; // The AST and its caches are shared with other threads
+thread_global bool pool_owner = false; // A job of this thread's runs on the pool
+thread_global Interp *running = NULL; // Interpreter evaluating on this thread, if any
+thread_global JitState jit_local = {0}; // For eval called outside of an interpreter
+thread_global u64 ns_serial = 0; // For namespaces created outside of an interpreter
+thread_global u64 loop_runs = 0; // For loops run outside of an interpreter
 
 Element	eval(Arena *a, Namespace *ns, AST *node)
 {
-	if (!node) return (Element) { ERR, .ERR = str("Program has errors") };
+	if (!node) return error(str("Program has errors"));
 	switch (node->type) {
 		case AST_PROGRAM:
 			return eval_program(a, ns, node);
@@ -54,9 +125,7 @@ Element	eval(Arena *a, Namespace *ns, AST *node)
 				return (Element) { NIL };
 			Element value = eval(a, ns, node->AST_VAL.value);
 			if (value.type == ERR) return value;
-			if(ns_put(ns, node->AST_VAL.name, value, IMMUTABLE) == -1)
-				return (Element) { ERR, .ERR = str("Immutable variable already bound") };
-			return value;
+			return rt_val(a, ns, node->AST_VAL.name, value);
 		} break;
 		case AST_VAR: {
 			if (NEVER(!node->AST_VAR.value))
@@ -67,15 +136,14 @@ Element	eval(Arena *a, Namespace *ns, AST *node)
 			else
 				value = eval(a, ns, node->AST_VAR.value);
 			if (value.type == ERR) return value;
-			ns_put(ns, node->AST_VAR.name, value, MUTABLE);
-			return value;
+			return rt_var(a, ns, node->AST_VAR.name, value);
 		} break;
 		case AST_RETURN: {
 			if (NEVER(!node->AST_RETURN.value))
 				return (Element) { NIL };
 			Element value = eval(a, ns, node->AST_RETURN.value);
 			if (value.type == ERR) return value;
-			return (Element) { RETURN, .RETURN = { elem_alloc(a, value) }};
+			return rt_return(a, value);
 		} break;
 		case AST_ASSIGN: {
 			if (NEVER(!node->AST_ASSIGN.left || !node->AST_ASSIGN.right)) 
@@ -84,20 +152,24 @@ Element	eval(Arena *a, Namespace *ns, AST *node)
 		} break;
 		// EXPRESSIONS
 		case AST_IDENT:
-			return eval_identifier(a, ns, node->AST_STR);
+			return eval_identifier_cached(a, ns, &node->AST_IDENT);
 		case AST_LIST: {
 			return eval_array(a, ns, node->AST_LIST);
 		} break;
+		case AST_MAP:
+			return eval_map(a, ns, node->AST_MAP);
 		case AST_FN: {
-			ASTList *params = node->AST_FN.params;
-			ASTList *body = node->AST_FN.body;
-			return (Element) { FUNCTION, .FUNCTION = { params, body, ns } };
+			Function *fn = arena_alloc(a, sizeof(Function));
+			*fn = (Function) { node->AST_FN.params, node->AST_FN.body, ns };
+			return (Element) { FUNCTION, .FUNCTION = fn };
 		} break;
 		case AST_INDEX: {
 			Element left = eval(a, ns, node->AST_INDEX.left);	
 			if (left.type == ERR) return left;
 			Element index = eval(a, ns, node->AST_INDEX.index);
 			if (index.type == ERR) return index;
+			if (specialize)
+				return eval_index_node(a, ns, &node->AST_INDEX, left, index);
 			return eval_index_expression(a, ns, left, index);
 		}
 		case AST_PREFIX: {
@@ -110,36 +182,18 @@ Element	eval(Arena *a, Namespace *ns, AST *node)
 			if (left.type == ERR) return left;
 			Element right = eval(a, ns, node->AST_INFIX.right);
 			if (right.type == ERR) return right;
+			if (specialize)
+				return eval_infix_node(a, &node->AST_INFIX, left, right);
 			return eval_infix_expression(a, left, node->AST_INFIX.op, right);
 		}
 		case AST_COND: 
 			return eval_cond_expression(a, ns, node);
-		case AST_CALL: {
-			Element fn = eval(a, ns, node->AST_CALL.function);
-			if (fn.type == ERR) return fn;
-			Namespace *func_namespace = (fn.type == FUNCTION) ? fn.FUNCTION.namespace : ns;
-			Arena *arg_arena = arena(MB(1));
-			ElemArray *args = elemarray_from_ast(arg_arena, ns, node->AST_CALL.args);
-			if (args->len == 1 && args->items[0].type == ERR)
-				return args->items[0];
-			Element result = eval_call(a, func_namespace, fn, args);
-			arena_free(&arg_arena);
-			return result;
-		}
-		case AST_WHILE: {
-			Element condition = eval(a, ns, node->AST_WHILE.condition);
-			if (condition.type == ERR) return condition;
-			Arena *block_arena = arena(MB(1));
-			Namespace *block_ns = ns_inner(block_arena, ns, 16);
-			while (is_truthy(condition)) {
-				Element block = eval_block(a, block_ns, node->AST_WHILE.body);
-				if (block.type == ERR) return (arena_free(&block_arena), block);
-				condition = eval(a, ns, node->AST_WHILE.condition);
-				if (condition.type == ERR) return (arena_free(&block_arena), condition);
-			}
-			arena_free(&block_arena);
-			return (Element) { NIL };
-		}
+		case AST_CALL:
+			return eval_call_expression(a, ns, node);
+		case AST_WHILE:
+			return eval_while_expression(a, ns, node);
+		case AST_INVARIANT:
+			return eval_invariant(a, ns, &node->AST_INVARIANT);
 		// LITERALS
 		case AST_NULL:
 			return (Element) { NIL };
@@ -148,11 +202,79 @@ Element	eval(Arena *a, Namespace *ns, AST *node)
 		case AST_BOOL:
 			return (Element) { BOOL, .BOOL = node->AST_BOOL.value  };
 		case AST_STR:
-			return (Element) { STR, .STR = node->AST_STR };
+			return elem_from_str(STR, node->AST_STR);
 	}
 	return (Element) { NIL };
 }
 
+// Kept out of eval, whose frame is paid for at every level of recursion
+priv Element eval_call_expression(Arena *a, Namespace *ns, AST *node)
+{
+	AST *callee = node->AST_CALL.function;
+	Element fn = (callee->type == AST_IDENT)
+		? eval_identifier_cached(a, ns, &callee->AST_IDENT)
+		: eval(a, ns, callee);
+	if (fn.type == ERR) return fn;
+	Namespace *func_namespace = (fn.type == FUNCTION) ? fn.FUNCTION->namespace : ns;
+	Arena *frame = frame_acquire();
+	ElemArray *args = elemarray_from_ast(frame, ns, node->AST_CALL.args);
+	if (args->len == 1 && args->items[0].type == ERR) {
+		Element err = elem_copy(a, args->items[0]);
+		return (frame_release(frame), err);
+	}
+	Element result = (specialize)
+		? eval_call_node(a, frame, func_namespace, &node->AST_CALL, fn, args)
+		: eval_call(a, frame, func_namespace, fn, args);
+	frame_release(frame);
+	return result;
+}
+
+priv Element eval_while_expression(Arena *a, Namespace *ns, AST *node)
+{
+	if (in_worker)
+		return eval_while(a, ns, &node->AST_WHILE);
+	// A run id per execution lets hoisted expressions tell their cached value is stale
+	u64 run = node->AST_WHILE.run;
+	node->AST_WHILE.run = (running) ? ++running->loop_runs : ++loop_runs;
+	Element res = eval_while(a, ns, &node->AST_WHILE);
+	node->AST_WHILE.run = run;
+	return res;
+}
+
+priv Element eval_invariant(Arena *a, Namespace *ns, struct AST_INVARIANT *inv)
+{
+	if (in_worker)
+		return eval(a, ns, inv->value);
+	u64 run = inv->loop->AST_WHILE.run;
+	if (inv->run == run)
+		return (inv->is_int) ? (Element) { INT, .INT = inv->cached } : (Element) { BOOL, .BOOL = inv->cached };
+	Element value = eval(a, ns, inv->value);
+	if (value.type == INT || value.type == BOOL) {
+		inv->run = run;
+		inv->is_int = (value.type == INT);
+		inv->cached = (value.type == INT) ? value.INT : value.BOOL;
+	}
+	return value;
+}
+
+priv Element eval_while(Arena *a, Namespace *ns, struct AST_WHILE *node)
+{
+	Arena *scratch = scratch_acquire(a);
+	Element condition = eval(scratch, ns, node->condition);
+	if (condition.type == ERR) return scratch_release(a, scratch, condition);
+	Arena *block_arena = block_acquire(a, scratch);
+	Namespace *block_ns = ns_inner(block_arena, ns, 0);
+	while (is_truthy(condition)) {
+		Element block = (interrupted()) ? error(str("Interrupted")) : eval_block(scratch, block_ns, node->body);
+		if (block.type == ERR) return (block_release(a, scratch, block_arena), scratch_release(a, scratch, block));
+		if (scratch != a) arena_reset(scratch);
+		condition = eval(scratch, ns, node->condition);
+		if (condition.type == ERR) return (block_release(a, scratch, block_arena), scratch_release(a, scratch, condition));
+	}
+	block_release(a, scratch, block_arena);
+	return scratch_release(a, scratch, (Element) { NIL });
+}
+
 priv Element eval_program(Arena *a, Namespace *ns, AST *node)
 {
 	if (NEVER(node->type != AST_PROGRAM))
@@ -189,22 +311,76 @@ priv Element eval_block(Arena *a, Namespace *ns, ASTList *list)
 	return res;
 }
 
-priv Element eval_identifier(Arena *a, Namespace *ns, String name)
+// Identifiers cache what they resolved to. Bindings are never removed from a live
+// namespace, so the cached bind is still the one a lookup finds as long as its
+// namespace is in scope and none in between binds the name too, and a cached builtin
+// as long as no namespace in scope does. Only those whose name mask has the bit of
+// the hash are looked up.
+priv bool ident_cache_valid(Namespace *ns, struct AST_IDENT *ident)
+{
+	IdentCache *cache = &ident->cache;
+	u64 bit = NS_NAME_BIT(cache->hash);
+	for (; ns; ns = ns->parent) {
+		if (ns == cache->owner && ns->serial == cache->serial)
+			return true;
+		if ((ns->names & bit) && ns_lookup(ns, ident->name, cache->hash))
+			return false;
+	}
+	return cache->builtin != NULL;
+}
+
+priv Element eval_identifier_cached(Arena *a, Namespace *ns, struct AST_IDENT *ident)
+{
+	IdentCache *cache = &ident->cache;
+	if (in_worker) // Other threads read the cache too, it's only filled outside of them
+		return eval_identifier_shared(a, ns, ident);
+	if (!cache->hashed) {
+		cache->hash = hash(ident->name);
+		cache->hashed = true;
+	}
+	if ((cache->bind || cache->builtin) && ident_cache_valid(ns, ident))
+		return (cache->bind) ? bind_read(cache->bind) : builtin_elem(cache->builtin);
+
+	Namespace *owner = NULL;
+	Bind *res = ns_find(ns, ident->name, cache->hash, &owner);
+	if (res) {
+		*cache = (IdentCache) { cache->hash, true, owner, owner->serial, res, NULL };
+		return bind_read(res);
+	}
+	Native *builtin = builtin_native(ident->name, cache->hash);
+	if (builtin) {
+		*cache = (IdentCache) { cache->hash, true, NULL, 0, NULL, builtin };
+		return builtin_elem(builtin);
+	}
+	return error(str_fmt(a, "Name not found: %.*s", fmt(ident->name)));
+}
+
+// Uses the cache as long as it's valid but leaves it as is
+priv Element eval_identifier_shared(Arena *a, Namespace *ns, struct AST_IDENT *ident)
 {
-	Bind *res = ns_get(ns, name);
-	if (res) return res->element;
-	Element builtin = BUILTINS(name);
-	if (builtin.type == BUILTIN) return builtin;
-	return error(str_fmt(a, "Name not found: %.*s", fmt(name)));
+	IdentCache *cache = &ident->cache;
+	if (cache->hashed && (cache->bind || cache->builtin) && ident_cache_valid(ns, ident))
+		return (cache->bind) ? bind_read(cache->bind) : builtin_elem(cache->builtin);
+	u32 key_hash = (cache->hashed) ? cache->hash : hash(ident->name);
+	Namespace *owner = NULL;
+	Bind *res = ns_find(ns, ident->name, key_hash, &owner);
+	if (res)
+		return bind_read(res);
+	Element builtin = BUILTINS(ident->name, key_hash);
+	if (builtin.type == BUILTIN)
+		return builtin;
+	return error(str_fmt(a, "Name not found: %.*s", fmt(ident->name)));
 }
 
-priv Element eval_mutable_identifier(Arena *a, Namespace *ns, String name)
+// Resolves the binding an assignment writes to once, for the check and the update
+priv Element eval_mutable_identifier(Arena *a, Namespace *ns, String name, Bind **target, Namespace **owner)
 {
-	Bind *res = ns_get(ns, name);
+	Bind *res = ns_find(ns, name, hash(name), owner);
 	if (!res)
 		return error(str_fmt(a, "Name not found: %.*s", fmt(name)));
 	if (!res->mutable)
 		return error(str_fmt(a, "%.*s binding is not mutable", fmt(name)));
+	*target = res;
 	return (res->element);
 }
 
@@ -216,6 +392,8 @@ priv Element eval_array(Arena *a, Namespace *ns, ASTList *lst)
 	ElemArray *res = elemarray_from_ast(a, ns, lst);
 	if (res->len == 1 && res->items[0].type == ERR)
 		return res->items[0];
+	for (u32 i = 0; i < res->len; i++)
+		disown(res->items[i]);
 	return (Element) { ARRAY, .ARRAY = res };
 }
 
@@ -225,13 +403,24 @@ priv Element eval_list(Arena *a, Namespace *ns, ASTList *lst)
 	if(NEVER(!lst))
 		return (Element) { NIL };
 	ElemList *res = elemlist_from_ast(a, ns, lst);
-	if (res->len == 1 && res->head->element.type == ERR)
-		return res->head->element;
+	if (res->len == 1 && elemlist_at(res, 0)->type == ERR)
+		return *elemlist_at(res, 0);
 	return (Element) { LIST, .LIST = res };
 }
 
+priv Element eval_map(Arena *a, Namespace *ns, ASTList *lst)
+{
+	if(NEVER(!lst))
+		return (Element) { NIL };
+	ElemArray *items = elemarray_from_ast(a, ns, lst);
+	if (items->len == 1 && items->items[0].type == ERR)
+		return items->items[0];
+	return map_from_items(a, items->items, lst->len / 2);
+}
+
 priv Element eval_array_index(Arena *a, Element left, Element index);
 priv Element eval_list_index(Arena *a, Element left, Element index);
+priv Element eval_map_index(Arena *a, Element left, Element index);
 priv Element eval_index_expression(Arena *a, Namespace *ns, Element left, Element index)
 {
 	if (left.type == ARRAY && index.type == INT)
@@ -240,6 +429,15 @@ priv Element eval_index_expression(Arena *a, Namespace *ns, Element left, Elemen
 	if (left.type == LIST && index.type == INT)
 		return eval_list_index(a, left, index);
 
+	if (left.type == MAP)
+		return eval_map_index(a, left, index);
+
+	if (left.type == VECTOR && index.type == INT) {
+		if (index.INT < 0 || index.INT >= left.VECTOR->len)
+			return (Element) { NIL };
+		return *elemvector_at(left.VECTOR, index.INT);
+	}
+
 	return error(str_fmt(a, "No index operation implemented for: %.*s",
 				fmt(type_str(left.type))));
 }
@@ -257,10 +455,19 @@ priv Element eval_list_index(Arena *a, Element left, Element index)
 	i64	id = index.INT;
 	if (id < 0 || id >= left.LIST->len)
 		return (Element) { NIL };
-	ElemNode *tmp = left.LIST->head;
-	for (int i = 0; i < id; i++)
-		tmp = tmp->next;
-	return tmp->element;
+	return *elemlist_at(left.LIST, id);
+}
+
+priv bool map_hash(Element key, u32 *res);
+priv MapEntry *map_lookup(ElemMap *m, Element key, u32 key_hash);
+priv Element map_key_error(Arena *a, Element key);
+priv Element eval_map_index(Arena *a, Element left, Element index)
+{
+	u32 key_hash;
+	if (!map_hash(index, &key_hash))
+		return map_key_error(a, index);
+	MapEntry *entry = map_lookup(left.MAP, index, key_hash);
+	return (entry) ? entry->value : (Element) { NIL };
 }
 
 priv bool is_truthy(Element e)
@@ -275,7 +482,7 @@ priv bool is_truthy(Element e)
 		case BOOL:
 			return e.BOOL;
 		case STR:
-			return (!str_eq(e.STR, str("")));
+			return (e.len != 0);
 		default:
 			return true;
 	}
@@ -295,42 +502,357 @@ priv Element eval_cond_expression(Arena *a, Namespace *ns, AST *node)
 	}
 }
 
-priv Element eval_function_call(Arena *a, Namespace *ns, struct FUNCTION fn, ElemArray *args);
-priv Element eval_call(Arena *a, Namespace *ns, Element fn, ElemArray *args)
+priv Element eval_function_call(Arena *a, Arena *frame, Namespace *ns, Function *fn, ElemArray *args);
+priv Element eval_call(Arena *a, Arena *frame, Namespace *ns, Element fn, ElemArray *args)
 {
 	if (fn.type == FUNCTION)
-		return eval_function_call(a, ns, fn.FUNCTION, args);
+		return eval_function_call(a, frame, ns, fn.FUNCTION, args);
 	if (fn.type == BUILTIN)
-		return fn.BUILTIN(a, ns, args);
+		return builtin_call(a, ns, fn, args);
 	return error(str_fmt(a, "Not a callable element: %.*s", to_string(a, fn)));
 }
 
-priv Element eval_function_call(Arena *a, Namespace *ns, struct FUNCTION fn, ElemArray *args)
+// ~CALL STACK
+// Every call gets its arena from a pool of released frames instead of mapping a new one,
+// and the native stack is extended with heap segments when it runs low, so recursion
+// depth is only bounded by max_depth, and by as many levels as half the memory holds.
+typedef struct StackSegment {
+	ucontext_t	caller;
+	ucontext_t	callee;
+	Arena		*stack;
+	Arena		*a;
+	Arena		*frame;
+	Namespace	*ns;
+	Function	*fn;
+	ElemArray	*args;
+	Element		result;
+} StackSegment;
+
+thread_global u32 call_depth = 0;
+thread_global u32 max_depth = MAX_DEPTH_DEFAULT;
+thread_global char *stack_limit = NULL;
+thread_global StackSegment *segment_pending = NULL;
+thread_global Arena *frame_pool = NULL;
+
+void eval_max_depth(u32 depth)
+{
+	max_depth = depth;
+}
+
+global u32 memory_depth = 0;
+global pthread_once_t memory_depth_once = PTHREAD_ONCE_INIT;
+
+// Half of the physical memory, or of the cgroup's limit when lower
+priv void memory_depth_init(void)
+{
+	u64 budget = (u64)sysconf(_SC_PHYS_PAGES) * (u64)sysconf(_SC_PAGESIZE);
+	FILE *f = fopen("/sys/fs/cgroup/memory.max", "r");
+	unsigned long limit = 0;
+	if (f && fscanf(f, "%lu", &limit) == 1 && limit)
+		budget = MIN(budget, limit);
+	if (f) fclose(f);
+	memory_depth = MIN(budget / 2 / CALL_LEVEL_COST, UINT32_MAX);
+}
+
+priv u32 depth_limit(void)
+{
+	pthread_once(&memory_depth_once, memory_depth_init);
+	return MIN(max_depth, memory_depth);
+}
+
+// What the calls in progress hold outside of the arenas they return into: their frames,
+// the stack segments they run on and the arrays lent to them, latest last. An arena
+// running out of space longjmps past their releases, eval_restore gives them back then.
+typedef enum HoldKind { HOLD_FRAME, HOLD_SEGMENT, HOLD_LENT } HoldKind;
+
+typedef struct Hold {
+	HoldKind	kind;
+	void		*ptr;
+} Hold;
+
+thread_global Arena *holds = NULL;
+
+priv void hold(HoldKind kind, void *ptr)
+{
+	if (!holds) holds = arena(HOLDS_SIZE);
+	Hold *h = arena_alloc(holds, sizeof(Hold));
+	*h = (Hold) { kind, ptr };
+}
+
+// Holds are released in the reverse order they were taken
+priv void unhold(void *ptr)
+{
+	Hold *top = (Hold *)((u8 *)holds + holds->used) - 1;
+	NEVER(top->ptr != ptr);
+	arena_pop_to(holds, holds->used - sizeof(Hold));
+}
+
+priv u64 holds_mark(void)
 {
-	if (fn.params->len != args->len) 
+	return (holds) ? holds->used : sizeof(Arena);
+}
+
+priv Arena *frame_acquire(void)
+{
+	Arena *frame = NULL;
+	if (!frame_pool || frame_pool->used <= sizeof(Arena))
+		frame = arena_committed(FRAME_SIZE); // Thousands of them live stay few mappings
+	else {
+		u64 top = frame_pool->used - sizeof(Arena *);
+		frame = *(Arena **)((u8 *)frame_pool + top);
+		arena_pop_to(frame_pool, top);
+	}
+	hold(HOLD_FRAME, frame);
+	return frame;
+}
+
+priv void frame_pool_put(Arena *frame)
+{
+	if (!frame_pool) frame_pool = arena(KB(4) + FRAME_POOL_MAX * sizeof(Arena *));
+	if (frame_pool->used + sizeof(Arena *) > frame_pool->cap)
+		return arena_free(&frame);
+	arena_reset(frame);
+	Arena **slot = arena_alloc(frame_pool, sizeof(Arena *));
+	*slot = frame;
+}
+
+priv void frame_release(Arena *frame)
+{
+	unhold(frame);
+	frame_pool_put(frame);
+}
+
+// Gives back what was held since mark, latest first so lent arrays are still there
+priv void holds_unwind(u64 mark)
+{
+	if (!holds)
+		return ;
+	while (holds->used > mark) {
+		Hold *top = (Hold *)((u8 *)holds + holds->used) - 1;
+		if (top->kind == HOLD_FRAME)
+			frame_pool_put(top->ptr);
+		else if (top->kind == HOLD_SEGMENT) {
+			Arena *stack = top->ptr;
+			arena_free(&stack);
+		} else
+			((ElemArray *)top->ptr)->lent--;
+		holds->used -= sizeof(Hold);
+	}
+	arena_pop_to(holds, holds->used);
+}
+
+// ~LOOP SCRATCH
+// Loop conditions and bodies evaluate into a scratch arena reset after every iteration.
+// Values outliving an iteration are copied out by whatever stores them (assignments,
+// push), except for val and var bindings and index assignments, which promote the part
+// of the value living in a scratch arena. Loops nested deeper than SCRATCH_MAX, through
+// recursion, evaluate into their caller's arena as before.
+thread_global Arena *scratch_pool[SCRATCH_MAX] = {0};
+thread_global u32 scratch_depth = 0;
+thread_global Arena *scratch_home = NULL; // Arena given to the outermost loop, outlives every scratch
+
+priv Arena *scratch_acquire(Arena *a)
+{
+	if (scratch_depth >= SCRATCH_MAX)
+		return a;
+	if (!scratch_pool[scratch_depth])
+		scratch_pool[scratch_depth] = arena(SCRATCH_SIZE);
+	if (scratch_depth == 0)
+		scratch_home = a;
+	return scratch_pool[scratch_depth++];
+}
+
+priv Element scratch_release(Arena *a, Arena *scratch, Element res)
+{
+	if (scratch == a)
+		return res;
+	res = promote(a, res);
+	arena_reset(scratch);
+	if (--scratch_depth == 0)
+		scratch_home = NULL;
+	return res;
+}
+
+// A loop's block namespace lives in the pooled arena matching its scratch, or in a frame
+// when the loop evaluates into its caller's arena
+thread_global Arena *block_pool[SCRATCH_MAX] = {0};
+
+priv Arena *block_acquire(Arena *a, Arena *scratch)
+{
+	if (scratch == a)
+		return frame_acquire();
+	if (!block_pool[scratch_depth - 1])
+		block_pool[scratch_depth - 1] = arena(LOOP_BLOCK_SIZE);
+	return block_pool[scratch_depth - 1];
+}
+
+priv void block_release(Arena *a, Arena *scratch, Arena *block)
+{
+	if (scratch == a)
+		return frame_release(block);
+	arena_reset(block);
+}
+
+priv bool in_scratch(void *ptr)
+{
+	for (u32 i = 0; i < scratch_depth; i++)
+		if (arena_owns(scratch_pool[i], ptr)) return true;
+	return false;
+}
+
+// Containers outside of a scratch arena never point into one, so only what's in it is copied
+priv Element promote(Arena *a, Element elem)
+{
+	if (scratch_depth == 0)
+		return elem;
+	switch (elem.type) {
+		case STR: case ERR:
+			return in_scratch(elem.STR) ? elem_copy(a, elem) : elem;
+		case LIST:
+			return in_scratch(elem.LIST) ? elem_copy(a, elem) : elem;
+		case MAP: // Entries live in the map's arena
+			return in_scratch(elem.MAP) ? elem_copy(a, elem) : elem;
+		case VECTOR:
+			return in_scratch(elem.VECTOR) ? elem_copy(a, elem) : elem;
+		case RETURN:
+			return in_scratch(elem.RETURN.value) ? elem_copy(a, elem) : elem;
+		case FUNCTION: {
+			Function *fn = elem.FUNCTION;
+			if (in_scratch(fn->namespace))
+				return elem_copy(a, elem);
+			if (in_scratch(fn)) {
+				elem.FUNCTION = arena_alloc(a, sizeof(Function));
+				*elem.FUNCTION = *fn;
+			}
+			return elem;
+		}
+		case ARRAY: {
+			ElemArray *arr = elem.ARRAY;
+			if (!in_scratch(arr) && !in_scratch(arr->items))
+				return elem;
+			elem.ARRAY = elemarray(a, arr->len);
+			for (u32 i = 0; i < arr->len; i++)
+				elem.ARRAY->items[i] = promote(a, arr->items[i]);
+			return elem;
+		}
+		default:
+			return elem;
+	}
+}
+
+// Half of the stack left below sp, from the thread's attributes or else the rlimit
+priv char *stack_limit_thread(char *sp)
+{
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		void *base = NULL;
+		size_t size = 0;
+		bool known = (pthread_attr_getstack(&attr, &base, &size) == 0);
+		pthread_attr_destroy(&attr);
+		if (known && sp > (char *)base && sp < (char *)base + size)
+			return sp - (sp - (char *)base) / 2;
+	}
+	struct rlimit rl = {0};
+	u64 budget = MB(8);
+	if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		budget = rl.rlim_cur;
+	return sp - (budget / 2);
+}
+
+priv Element eval_function_body(Arena *a, Arena *frame, Namespace *ns, Function *fn, ElemArray *args);
+priv void segment_entry(void)
+{
+	StackSegment *s = segment_pending;
+	s->result = eval_function_body(s->a, s->frame, s->ns, s->fn, s->args);
+}
+
+priv Element eval_on_segment(Arena *a, Arena *frame, Namespace *ns, Function *fn, ElemArray *args)
+{
+	StackSegment s = { .a = a, .frame = frame, .ns = ns, .fn = fn, .args = args };
+	s.stack = arena(STACK_SEGMENT_SIZE);
+	hold(HOLD_SEGMENT, s.stack);
+	u64 size = STACK_SEGMENT_SIZE - KB(4);
+	char *base = arena_alloc(s.stack, size);
+	char *previous_limit = stack_limit;
+
+	getcontext(&s.callee);
+	s.callee.uc_stack.ss_sp = base;
+	s.callee.uc_stack.ss_size = size;
+	s.callee.uc_link = &s.caller;
+	makecontext(&s.callee, segment_entry, 0);
+	stack_limit = base + STACK_RED_ZONE;
+	segment_pending = &s;
+	bool previous_fallback = jit_fallback;
+	jit_fallback = false; // A fresh segment has room for compiled code again
+	swapcontext(&s.caller, &s.callee);
+	jit_fallback = previous_fallback;
+	stack_limit = previous_limit;
+	unhold(s.stack);
+	arena_free(&s.stack);
+	return s.result;
+}
+
+priv Element eval_function_call(Arena *a, Arena *frame, Namespace *ns, Function *fn, ElemArray *args)
+{
+	if (interrupted())
+		return error(str("Interrupted"));
+	u32 limit = depth_limit();
+	if (call_depth >= limit)
+		return error((limit == max_depth)
+				? str_fmt(a, "Stack overflow: maximum call depth of %u exceeded", max_depth)
+				: str_fmt(a, "Stack overflow: call depth of %u exceeds the memory budget", limit));
+	char sp;
+	if (!stack_limit)
+		stack_limit = stack_limit_thread(&sp);
+	if (jit && !fn->jit && ++fn->calls >= JIT_HOT_CALLS)
+		fn->jit = jit_compile((running) ? &running->jit_state : &jit_local, fn);
+	bool fallback = jit_fallback;
+	if (jit && fn->jit && !jit_fallback) {
+		i64 budget = MIN((i64)(limit - call_depth), (&sp - (stack_limit + STACK_RED_ZONE)) / JIT_FRAME_SIZE);
+		Element res;
+		if (jit_call(fn->jit, args, budget, &res))
+			return res;
+		jit_fallback = true; // Compiled code bailed out: interpret this whole call tree
+	}
+	call_depth++;
+	Element res = (&sp < stack_limit + STACK_RED_ZONE)
+		? eval_on_segment(a, frame, ns, fn, args)
+		: eval_function_body(a, frame, ns, fn, args);
+	call_depth--;
+	jit_fallback = fallback;
+	return res;
+}
+
+priv Element eval_function_body(Arena *a, Arena *frame, Namespace *ns, Function *fn, ElemArray *args)
+{
+	if (fn->params->len != args->len) 
 		return error(str_fmt(a, "Invalid number of arguments: Got %lu, expected %lu",
-					args->len, fn.params->len));
+					args->len, fn->params->len));
 
-	Arena	*call_arena = arena(MB(1));
-	Namespace *call_ns = ns_inner(call_arena, ns, 16);
+	Namespace *call_ns = ns_inner(frame, ns, args->len);
 
-	ASTNode *params_node = fn.params->head;
+	// Parameter names belong to the function, which outlives the call
+	ASTNode *params_node = fn->params->head;
 	for (int i = 0; i < args->len; i++) {
 		if (NEVER(!params_node))
-			return (arena_free(&call_arena), (Element) { NIL });
-		ns_put(call_ns, params_node->ast->AST_STR, args->items[i], MUTABLE);
+			return (Element) { NIL };
+		String name = params_node->ast->AST_STR;
+		// The caller's binding gets the array back once the call returns, unless anything
+		// kept it (a closure, a var) and disowned it. Until then neither side writes to it.
+		Bind *owner = (args->items[i].type == ARRAY) ? args->items[i].ARRAY->owner : NULL;
+		ns_set(call_ns, name, hash(name), args->items[i], MUTABLE, false);
+		if (args->items[i].type == ARRAY) {
+			args->items[i].ARRAY->owner = owner, args->items[i].ARRAY->lent++;
+			hold(HOLD_LENT, args->items[i].ARRAY);
+		}
 		params_node = params_node->next;
 	}
 
-	Element res = eval_block(call_arena, call_ns, fn.body);
-	if (res.type == RETURN) {
-		Element return_value = elem_copy(a, (*res.RETURN.value));
-		arena_free(&call_arena);
-		return return_value;
-	}
-	Element *copy = elem_alloc(a, res);
-	arena_free(&call_arena);
-	return (*copy);
+	Element res = (fn->native) ? fn->native(frame, call_ns) : eval_block(frame, call_ns, fn->body);
+	res = elem_copy(a, (res.type == RETURN) ? *res.RETURN.value : res);
+	for (u32 i = args->len; i-- > 0;)
+		if (args->items[i].type == ARRAY) args->items[i].ARRAY->lent--, unhold(args->items[i].ARRAY);
+	return res;
 }
 
 priv Element eval_bang(Arena *a, Element right);
@@ -368,62 +890,125 @@ priv Element eval_bang(Arena *a, Element right)
 	}
 }
 
-priv Element eval_assignement_to_index(Arena *a, Namespace *ns, struct AST_INDEX index, AST *right);
+priv Element assign_to_ident(Arena *a, Namespace *owner, Bind *target, Element left, Element right);
+priv bool is_in_place(Element fn, u32 argc);
+priv Element assign_in_place(Namespace *owner, Bind *target, BuiltinFunction fn, ElemArray *args);
+priv void map_set(ElemMap *m, Element key, u32 key_hash, Element value);
+priv Element assign_to_index(Arena *a, bool bound, Element left, Element index, Element new_val);
 priv Element eval_assignement(Arena *a, Namespace *ns, struct AST_ASSIGN node)
 {
 	if (node.left->type == AST_IDENT) {
-		Element left = eval_mutable_identifier(a, ns, node.left->AST_STR);
+		Bind *target = NULL;
+		Namespace *owner = NULL;
+		Element left = eval_mutable_identifier(a, ns, node.left->AST_STR, &target, &owner);
 		if (left.type == ERR)
 			return left;
+		if (left.type == ARRAY && ast_self_call(&node)) {
+			struct AST_CALL *call = &node.right->AST_CALL;
+			Element fn = eval_identifier_cached(a, ns, &call->function->AST_IDENT);
+			if (is_in_place(fn, call->args->len)) {
+				ElemArray *args = elemarray_from_ast(a, ns, call->args);
+				if (args->len == 1 && args->items[0].type == ERR)
+					return left;
+				return assign_in_place(owner, target, fn.BUILTIN, args);
+			}
+		}
 		Element right = eval(a, ns, node.right);
 		if (right.type == ERR)
-			return left;
-		if (right.type != left.type)
-			return error(str_fmt(a, "Can't assign type %.*s of type %.*s to variable of type %.*s",
-						fmt(type_str(right.type)), fmt(node.left->AST_STR), fmt(type_str(left.type))));
-		ns_update(ns, node.left->AST_STR, right);
-		return right;		
+			return bind_read(target);
+		return assign_to_ident(a, owner, target, left, right);
 	}
 
 	if (node.left->type == AST_INDEX) {
-		return eval_assignement_to_index(a, ns, node.left->AST_INDEX, node.right);
+		struct AST_INDEX index = node.left->AST_INDEX;
+		Element new_val = eval(a, ns, node.right);
+		if (new_val.type == ERR)
+			return new_val;
+		Element right = eval(a, ns, index.index);
+		bool bound = (index.left->type == AST_IDENT);
+		Element left = (bound) ? eval(a, ns, index.left) : (Element) { NIL };
+		return assign_to_index(a, bound, left, right, new_val);
 	}
 	return error(str_fmt(a, "Can't assign to type %.*s", type_str(node.left->type)));
 }
 
-priv Element eval_assignement_to_index(Arena *a, Namespace *ns, struct AST_INDEX index, AST *new_val_ast)
+priv Element assign_to_ident(Arena *a, Namespace *owner, Bind *target, Element left, Element right)
+{
+	if (right.type != left.type)
+		return error(str_fmt(a, "Can't assign type %.*s of type %.*s to variable of type %.*s",
+					fmt(type_str(right.type)), fmt(target->key), fmt(type_str(left.type))));
+	ns_update(owner, target, right);
+	return right;		
+}
+
+priv Element builtin_pop(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_push(Arena *a, Namespace *ns, ElemArray *args);
+priv bool is_in_place(Element fn, u32 argc)
+{
+	if (fn.type != BUILTIN)
+		return false;
+	return (fn.BUILTIN == &builtin_push && argc == 2) || (fn.BUILTIN == &builtin_pop && argc == 1);
+}
+
+// Takes a private copy of the array the first time, as the assignment would have
+priv Element assign_in_place(Namespace *owner, Bind *target, BuiltinFunction fn, ElemArray *args)
+{
+	ElemArray *arr = target->element.ARRAY;
+	u32 len = (fn == &builtin_push) ? arr->len + 1 : (arr->len) ? arr->len - 1 : 0;
+	if (!owns(target, arr)) {
+		ElemArray *res = elemarray(owner->arena, MAX(arr->cap, len));
+		for (u32 i = 0; i < MIN(arr->len, len); i++)
+			res->items[i] = elem_copy(owner->arena, arr->items[i]);
+		res->len = MIN(arr->len, len);
+		res->owner = target;
+		target->element.ARRAY = arr = res;
+	}
+	if (arr->shared) // A slice may see past the end after a pop
+		elemarray_unshare(arr);
+	if (fn == &builtin_push) {
+		if (arr->len == arr->cap)
+			elemarray_reserve(arr, arr->cap * 2);
+		arr->items[arr->len] = elem_store(arr->arena, args->items[1]);
+	}
+	arr->len = len;
+	return target->element;
+}
+
+priv Element assign_to_index(Arena *a, bool bound, Element left, Element right, Element new_val)
 {
-	Element new_val = eval(a, ns, new_val_ast);
-	if (new_val.type == ERR)
+	if (!bound)
+		return error(str("Trying to assign to a non-bound value"));
+	if (right.type == ERR)
+		return right;
+	if (left.type == ARRAY) {
+		if (right.type != INT)
+			return error(str("Index should be an INT for ARRAY indexing"));
+		if (right.INT < 0 || right.INT >= left.ARRAY->len)
+			return error(str_fmt(a, "Out of bounds assignment: max index is %d, attempted to access %d", 
+						(left.ARRAY->len - 1), right.INT));
+		if (left.ARRAY->shared)
+			elemarray_unshare(left.ARRAY);
+		// Stored where the array lives, it may outlive the run or loop that made the value
+		return left.ARRAY->items[right.INT] = elem_store(left.ARRAY->arena, new_val);
+	}
+	if (left.type == LIST) {
+		if (right.type != INT)
+			return error(str("Index should be an INT for LIST indexing"));
+		if (right.INT < 0 || right.INT >= left.LIST->len)
+			return error(str_fmt(a, "Out of bounds assignment: max index is %d, attempted to access %d", 
+						(left.LIST->len - 1), right.INT));
+		return *elemlist_at(left.LIST, right.INT) = elem_store(left.LIST->arena, new_val);
+	}
+	if (left.type == MAP) {
+		u32 key_hash;
+		if (!map_hash(right, &key_hash))
+			return map_key_error(a, right);
+		map_set(left.MAP, right, key_hash, new_val);
 		return new_val;
-	Element right = eval(a, ns, index.index);
-	if (index.left->type == AST_IDENT) {
-		// Eval Ident
-		Element left = eval(a, ns, index.left);
-		if (left.type == ARRAY) {
-			if (right.type != INT)
-				return error(str("Index should be an INT for ARRAY indexing"));
-			if (right.INT < 0 || right.INT >= left.ARRAY->len)
-				return error(str_fmt(a, "Out of bounds assignment: max index is %d, attempted to access %d", 
-							(left.ARRAY->len - 1), right.INT));
-			left.ARRAY->items[right.INT] = new_val;
-			return new_val;
-		}
-		if (left.type == LIST) {
-			if (right.type != INT)
-				return error(str("Index should be an INT for LIST indexing"));
-			if (right.INT < 0 || right.INT >= left.LIST->len)
-				return error(str_fmt(a, "Out of bounds assignment: max index is %d, attempted to access %d", 
-							(left.LIST->len - 1), right.INT));
-			ElemNode *tmp = left.LIST->head;
-			for (int i = 0; i < right.INT; i++)
-				tmp = tmp->next;
-			tmp->element = new_val;
-			return new_val;
-		}
-		return error(str("Not an indexable item."));
 	}
-	return error(str("Trying to assign to a non-bound value"));
+	if (left.type == VECTOR)
+		return error(str("Can't assign to an index of a VECTOR, use set"));
+	return error(str("Not an indexable item."));
 }
 priv Element builtin_concat(Arena *a, Namespace *ns, ElemArray *args);
 priv Element eval_infix_int(Arena *a, i64 left, String op, i64 right);
@@ -436,7 +1021,7 @@ priv Element eval_infix_expression(Arena *a, Element left, String op, Element ri
 	if (left.type == INT && right.type == INT)
 		return eval_infix_int(a, left.INT, op, right.INT);
 	if (left.type == STR && right.type == STR)
-		return eval_infix_str(a, left.STR, op, right.STR);
+		return eval_infix_str(a, elem_str(left), op, elem_str(right));
 	if (left.type == BOOL && right.type == BOOL) {
 		if (str_eq(op, str("=="))) 
 			return (Element) { BOOL, .BOOL = (left.BOOL == right.BOOL) };
@@ -483,8 +1068,11 @@ priv Element eval_infix_int(Arena *a, i64 left, String op, i64 right)
 
 priv Element eval_infix_str(Arena *a, String left, String op, String right)
 {
-	if (str_eq(op, str("+")))
-		return (Element) { STR, .STR = str_concat(a, left, right) };
+	if (str_eq(op, str("+"))) {
+		if ((u64)left.len + right.len > UINT32_MAX) // Past what a string's len can hold
+			return error(str_fmt(a, "String too long: %lu bytes, at most %u", (u64)left.len + right.len, UINT32_MAX));
+		return elem_from_str(STR, str_concat(a, left, right));
+	}
 
 	if (str_eq(op, str("==")))
 		return (Element) { BOOL, .BOOL = str_eq(left, right) };
@@ -496,170 +1084,756 @@ priv Element eval_infix_str(Arena *a, String left, String op, String right)
 				fmt(type_str(STR)), fmt(op), fmt(type_str(STR)))); 
 }
 
-priv Element error(String msg)
+void eval_jit(bool enabled)
 {
-	return (Element) { ERR, .ERR = msg };
+	jit = enabled;
 }
 
-// ~BUILTINs
-priv Element builtin_len(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_print(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_type(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_push(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_cdr(Arena *a, Namespace *ns, ElemArray *args);
-priv Element builtin_slurp(Arena *a, Namespace *ns, ElemArray *args);
-priv Element BUILTINS(String name)
-{
-	if (str_eq(str("print"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_print };
-	if (str_eq(str("len"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_len };
-	if (str_eq(str("type"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_type };
-	if (str_eq(str("push"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_push };
-	if (str_eq(str("car"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_car };
-	if (str_eq(str("cdr"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_cdr };
-	if (str_eq(str("concat"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_concat };
-	if (str_eq(str("slurp"), name))
-		return (Element) { BUILTIN, .BUILTIN = &builtin_slurp };
-	return (Element) { NIL };	
-}
-priv Element elemlist_concat(Arena *a, ElemList *left, ElemList *right);
-priv Element elemarray_concat(Arena *a, ElemArray *left, ElemArray *right);
-priv Element builtin_concat(Arena *a, Namespace *ns, ElemArray *args)
+// ~RUNTIME
+// Entry points of programs translated to C by emit_c: each one finishes the matching
+// eval case once the generated code has evaluated the operands.
+Element rt_ident(Arena *a, Namespace *ns, struct AST_IDENT *ident)
 {
-	if (args->len != 2)
-		return error(str_fmt(a, "Wrong number of args for concat: got %lu, expected 2", args->len));
-	Element arg0 = args->items[0];
-	if (arg0.type == ERR)
-		return arg0;
-	Element arg1 = args->items[1];
-	if (arg1.type == ERR)
-		return arg1;
-	if (arg0.type == ARRAY) {
-		if (ALWAYS(arg1.type == ARRAY))
-			return elemarray_concat(a, arg0.ARRAY, arg1.ARRAY);
-	}
-	if (arg0.type == LIST) {
-		if (ALWAYS(arg1.type == LIST))
-			return elemlist_concat(a, arg0.LIST, arg1.LIST);
-	}
-	// IF STR
-	return error(str_fmt(a, "Wrong types for concat got %.*s and %.*s",
-				fmt(type_str(arg0.type)), fmt(type_str(arg1.type))));
+	return eval_identifier_cached(a, ns, ident);
 }
 
-priv Element elemlist_concat(Arena *a, ElemList *left, ElemList *right)
+Element rt_val(Arena *a, Namespace *ns, String name, Element value)
 {
-	if (!left || !left->head)
-		return (Element) { LIST, .LIST = right };
-	if (!right || !right->head)
-		return (Element) { LIST, .LIST = left };
-	ElemNode *tmp = left->head;
-	while (tmp->next) tmp = tmp->next; // Find last
-	tmp->next = right->head;
-	left->len += right->len;
-	return (Element) { LIST, .LIST = left};
+	value = promote(ns->arena, value);
+	if (ns_put(ns, name, value, IMMUTABLE) == -1)
+		return error(str("Immutable variable already bound"));
+	return value;
 }
-priv Element elemarray_concat(Arena *a, ElemArray *left, ElemArray *right)
+
+Element rt_var(Arena *a, Namespace *ns, String name, Element value)
 {
-	ElemArray *new = elemarray(a, left->len + right->len);
-	int j = 0;
-	for (int i = 0; i < left->len; i++) {
-		new->items[j] = left->items[i];
-		j++;
-	}
-	for (int i = 0; i < right->len; i++) {
-		new->items[j] = right->items[i];
-		j++;
-	}
-	return (Element) { ARRAY, .ARRAY = new };
+	value = promote(ns->arena, value);
+	ns_put(ns, name, value, MUTABLE);
+	return value;
 }
 
-priv Element read_file_to_elem(Arena *a, char *filename);
-priv Element builtin_slurp(Arena *a, Namespace *ns, ElemArray *args)
+Element rt_return(Arena *a, Element value)
 {
-	if (args->len != 1)
-		return error(str_fmt(a, "Wrong number of args for slurp: got %lu, expected 1", args->len));
-	Element arg0 = args->items[0];
-	if (arg0.type == ERR)
-		return arg0;
-	if (arg0.type != STR)
-		return error(str_fmt(a, "Called slurp with the wrong type (%.*s), expected STR",
-					fmt(type_str(arg0.type))));
-	Element file = read_file_to_elem(a, str_dupc(a, arg0.STR));
-	return file;
+	return (Element) { RETURN, .RETURN = { elem_alloc(a, value) }};
 }
 
-priv Element read_file_to_elem(Arena *a, char *filename)
+Element rt_assign(Arena *a, Namespace *ns, String name, NativeBlock right)
 {
-	String s = {0};
-	FILE *f = fopen(filename, "r");
-	if (!f) 
-		return error(str_fmt(a, "File '%s' not found", filename));
-	fseek(f, 0, SEEK_END);
-	u32 len = (u32) ftell(f);
-	fseek(f, 0, SEEK_SET);
-	s.buf = arena_alloc(a, len);
-	s.len = len;
-	fread(s.buf, sizeof(u8), len, f);
-	fclose(f);
-	return (Element) { STR, .STR = s };
+	Bind *target = NULL;
+	Namespace *owner = NULL;
+	Element left = eval_mutable_identifier(a, ns, name, &target, &owner);
+	if (left.type == ERR)
+		return left;
+	Element value = right(a, ns);
+	if (value.type == ERR)
+		return left;
+	return assign_to_ident(a, owner, target, left, value);
 }
 
-priv Element builtin_cdr(Arena *a, Namespace *ns, ElemArray *args)
+// rt_assign of `x = f(x, ...)`, with the arguments on their own for in place updates
+Element rt_assign_call(Arena *a, Namespace *ns, String name, struct AST_IDENT *callee, u32 argc, NativeItems args, NativeBlock right)
 {
-	if (args->len != 1)
-		return error(str_fmt(a, "Wrong number of args for car: got %lu, expected 1", args->len));
-	Element arg0 = args->items[0];
-	if (arg0.type == ERR)
-		return arg0;
-
-	if (arg0.type == LIST) {
-		ElemNode *cdr = arg0.LIST->head;
-		if (!cdr || !cdr->next)
-			return (Element) { NIL };
-		ElemList *lst = elemlist(a);
-		lst->len = (arg0.LIST->len == 0) ? 0 : arg0.LIST->len - 1;
-		lst->head = cdr->next;
-		return (Element) { LIST, .LIST = lst };
-	}
-	if (arg0.type == ARRAY) {
-		if (arg0.ARRAY->len < 2)
-			return (Element) { NIL };
-		ElemArray *arr = elemarray(a, arg0.ARRAY->len - 1);
-		for (int i = 1; i < arg0.ARRAY->len; i++)
-			arr->items[i - 1] = arg0.ARRAY->items[i];
-		return (Element) { ARRAY, .ARRAY = arr };
-	}
-	if (arg0.type == STR) {
-		if (arg0.STR.len < 1) 
-			return (Element) { STR, .STR = str("") };
-		return (Element) { STR, .STR = str_slice(arg0.STR, 1, arg0.STR.len) };
+	Bind *target = NULL;
+	Namespace *owner = NULL;
+	Element left = eval_mutable_identifier(a, ns, name, &target, &owner);
+	if (left.type == ERR)
+		return left;
+	Element fn = (left.type == ARRAY) ? rt_ident(a, ns, callee) : (Element) { NIL };
+	if (!is_in_place(fn, argc)) {
+		Element value = right(a, ns);
+		if (value.type == ERR)
+			return left;
+		return assign_to_ident(a, owner, target, left, value);
 	}
-	if (arg0.type == NIL)  
-		return arg0;
-	return error(str_fmt(a, "Wrong type for car got %*s",
-				fmt(type_str(arg0.type))));
+	ElemArray *items = elemarray(a, argc);
+	if (args(a, ns, items->items).type == ERR)
+		return left;
+	return assign_in_place(owner, target, fn.BUILTIN, items);
 }
 
-priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args)
+Element rt_assign_index(Arena *a, bool bound, Element left, Element index, Element value)
 {
-	if (args->len != 1)
-		return error(str_fmt(a, "Wrong number of args for car: got %lu, expected 1", args->len));
-	Element arg0 = args->items[0];
-	if (arg0.type == ERR)
-		return arg0;
+	return assign_to_index(a, bound, left, index, value);
+}
 
-	if (arg0.type == LIST) {
-		if (arg0.LIST->head)
-			return arg0.LIST->head->element;
-		else
+Element rt_error(String msg)
+{
+	return error(msg);
+}
+
+Element rt_array(Arena *a, Namespace *ns, u32 len, NativeItems items)
+{
+	u64	previous_offset = a->used;
+	ElemArray *arr = elemarray(a, len);
+	Element err = items(a, ns, arr->items);
+	if (err.type == ERR)
+		return (arena_pop_to(a, previous_offset), err);
+	for (u32 i = 0; i < len; i++)
+		disown(arr->items[i]);
+	return (Element) { ARRAY, .ARRAY = arr };
+}
+
+Element rt_list(Arena *a, Namespace *ns, u32 len, NativeItems items)
+{
+	Element arr = rt_array(a, ns, len, items);
+	if (arr.type == ERR)
+		return arr;
+	ElemList *lst = elemlist(a);
+	for (u32 i = 0; i < len; i++)
+		elempush(lst, arr.ARRAY->items[i]);
+	return (Element) { LIST, .LIST = lst };
+}
+
+Element rt_map(Arena *a, Namespace *ns, u32 len, NativeItems items)
+{
+	Element pairs = rt_array(a, ns, len * 2, items);
+	if (pairs.type == ERR)
+		return pairs;
+	return map_from_items(a, pairs.ARRAY->items, len);
+}
+
+Element rt_fn(Arena *a, Namespace *ns, ASTList *params, NativeBlock body)
+{
+	Function *fn = arena_alloc_zero(a, sizeof(Function));
+	*fn = (Function) { .params = params, .namespace = ns, .native = body };
+	return (Element) { FUNCTION, .FUNCTION = fn };
+}
+
+Element rt_index(Arena *a, Namespace *ns, Element left, Element index)
+{
+	return eval_index_expression(a, ns, left, index);
+}
+
+Element rt_prefix(Arena *a, String op, Element right)
+{
+	return eval_prefix_expression(a, op, right);
+}
+
+Element rt_infix(Arena *a, Element left, String op, Element right)
+{
+	return eval_infix_expression(a, left, op, right);
+}
+
+bool rt_truthy(Element e)
+{
+	return is_truthy(e);
+}
+
+Element rt_call(Arena *a, Namespace *ns, Element fn, u32 argc, NativeItems items)
+{
+	Namespace *func_namespace = (fn.type == FUNCTION) ? fn.FUNCTION->namespace : ns;
+	Arena *frame = frame_acquire();
+	ElemArray *args = elemarray(frame, argc);
+	Element err = items(frame, ns, args->items);
+	if (err.type == ERR) {
+		err = elem_copy(a, err);
+		return (frame_release(frame), err);
+	}
+	Element result = eval_call(a, frame, func_namespace, fn, args);
+	frame_release(frame);
+	return result;
+}
+
+Element rt_while(Arena *a, Namespace *ns, NativeBlock condition, NativeBlock body)
+{
+	Arena *scratch = scratch_acquire(a);
+	Element cond = condition(scratch, ns);
+	if (cond.type == ERR) return scratch_release(a, scratch, cond);
+	Arena *block_arena = block_acquire(a, scratch);
+	Namespace *block_ns = ns_inner(block_arena, ns, 0);
+	while (is_truthy(cond)) {
+		Element block = (interrupted()) ? error(str("Interrupted")) : body(scratch, block_ns);
+		if (block.type == ERR) return (block_release(a, scratch, block_arena), scratch_release(a, scratch, block));
+		if (scratch != a) arena_reset(scratch);
+		cond = condition(scratch, ns);
+		if (cond.type == ERR) return (block_release(a, scratch, block_arena), scratch_release(a, scratch, cond));
+	}
+	block_release(a, scratch, block_arena);
+	return scratch_release(a, scratch, (Element) { NIL });
+}
+
+int rt_main(NativeBlock program)
+{
+	Arena *program_arena = arena(GB(1));
+	Arena *bindings_arena = arena(GB(1));
+	Namespace *bindings = ns_create(bindings_arena, 16);
+	Element exit_elem = program(program_arena, bindings);
+	if (exit_elem.type == ERR) {
+		str_print(elem_str(exit_elem)), str_print(str("\n"));
+		return 1;
+	}
+	return (exit_elem.type == INT) ? (i32)exit_elem.INT : 0;
+}
+
+// ~INTERP
+#define INTERP_ARENA GB(4)
+
+// What evaluating was doing on this thread, put back when an interpreter returns to its
+// caller, even from the middle of a call tree when an arena ran out of space
+typedef struct EvalState {
+	Interp	*running;
+	u32		call_depth;
+	u32		max_depth;
+	u32		scratch_depth;
+	Arena	*scratch_home;
+	char	*stack_limit;
+	StackSegment *segment;
+	u64		holds;
+	bool	specialize;
+	bool	jit;
+	bool	jit_fallback;
+} EvalState;
+
+priv EvalState eval_state(void)
+{
+	char sp;
+	if (!stack_limit) // Looked up once per thread, it's not cheap on the main one
+		stack_limit = stack_limit_thread(&sp);
+	return (EvalState) { running, call_depth, max_depth, scratch_depth, scratch_home, stack_limit,
+		segment_pending, holds_mark(), specialize, jit, jit_fallback };
+}
+
+priv void eval_restore(EvalState *s)
+{
+	holds_unwind(s->holds);
+	for (u32 i = s->scratch_depth; i < scratch_depth; i++) {
+		arena_reset(scratch_pool[i]);
+		if (block_pool[i]) arena_reset(block_pool[i]);
+	}
+	running = s->running, call_depth = s->call_depth, max_depth = s->max_depth;
+	scratch_depth = s->scratch_depth, scratch_home = s->scratch_home, stack_limit = s->stack_limit;
+	segment_pending = s->segment, specialize = s->specialize, jit = s->jit, jit_fallback = s->jit_fallback;
+}
+
+Interp *interp(void)
+{
+	return interp_with(NULL, 0);
+}
+
+// Scripts evaluated by the interpreter can call natives like builtins, which they
+// replace when they have the same name
+Interp *interp_with(Native *natives, u32 len)
+{
+	Arena *a = arena(INTERP_ARENA);
+	Interp *it = arena_alloc_zero(a, sizeof(Interp));
+	it->arena = a;
+	it->bindings = arena(INTERP_ARENA);
+	it->ns = ns_create(it->bindings, 16);
+	it->run = arena(INTERP_ARENA);
+	it->output = arena(INTERP_ARENA);
+	it->out_fd = -1;
+	it->max_depth = MAX_DEPTH_DEFAULT;
+	it->optimize = true;
+	it->inlining = true;
+	if (len) {
+		it->natives.cap = 8;
+		while (it->natives.cap < len * 2) it->natives.cap *= 2;
+		it->natives.slots = arena_alloc_zero(a, it->natives.cap * sizeof(BuiltinSlot));
+		Native *copies = arena_alloc(a, len * sizeof(Native));
+		for (u32 i = 0; i < len; i++) {
+			copies[i] = (Native) { str_dup(a, natives[i].name), natives[i].fn, natives[i].arity };
+			builtins_insert(&it->natives, &copies[i]);
+		}
+	}
+	return it;
+}
+
+void interp_free(Interp **it)
+{
+	Interp *tmp = *it;
+	jit_free(&tmp->jit_state);
+	if (tmp->vectors)
+		arena_free(&tmp->vectors);
+	arena_free(&tmp->output);
+	arena_free(&tmp->run);
+	arena_free(&tmp->bindings);
+	Arena *home = tmp->arena; // Where tmp lives
+	arena_free(&home);
+	*it = NULL;
+}
+
+priv void script_compile(Interp *it, Script *script, String src)
+{
+	Parser *p = parser(it->arena, lexer(it->arena, src));
+	script->program = parse_program(p);
+	script->error = (Element) { NIL };
+	if (p->errors) {
+		String msg = str("Parser has errors.");
+		for (StrNode *tmp = p->errors->head; tmp; tmp = tmp->next)
+			msg = str_concat(it->arena, msg, str_concat(it->arena, str("\n"), tmp->string));
+		script->error = error(msg);
+	} else if (script->program && it->optimize)
+		script->program = ast_optimize(it->arena, script->program);
+}
+
+// Compiles src into script when there's one, then evaluates the script in ns with a
+// unless ns is NULL, with the interpreter's settings in place of the thread's. An arena
+// running out of space ends it with an error instead of the process.
+priv Element interp_enter(Interp *it, Script *script, String src, Namespace *ns, Arena *a)
+{
+	EvalState state = eval_state();
+	running = it, max_depth = it->max_depth, specialize = it->specialize, jit = it->jit, jit_fallback = false;
+	it->interrupted = false;
+	it->in_run = (a == it->run);
+	bool inlining = optimize_inline(it->inlining);
+	if (it->out_fd < 0)
+		arena_reset(it->output), it->printed = strlist(it->output);
+	jmp_buf env;
+	jmp_buf *previous = arena_catch(&env);
+	Element res;
+	if (setjmp(env) == 0) {
+		if (src.buf)
+			script_compile(it, script, src);
+		res = script->error;
+		if (res.type != ERR && ns)
+			res = eval(a, ns, script->program);
+	} else {
+		if (pool_owner)
+			job_close();
+		res = error(str("Out of memory: an arena ran out of space"));
+	}
+	arena_catch(previous);
+	optimize_inline(inlining);
+	it->in_run = false;
+	if (!ns || a != it->run)
+		jit_checkpoint(&it->jit_state);
+	eval_restore(&state);
+	return res;
+}
+
+// Lexes, parses and evaluates src in the interpreter's global namespace, which keeps
+// what it binds for the next call
+Element interp_eval(Interp *it, String src)
+{
+	Script script = {0};
+	return interp_enter(it, &script, src, it->ns, it->arena);
+}
+
+// Parses and optimizes src once for interp_run. Parser errors are kept in the script.
+Script *interp_compile(Interp *it, String src)
+{
+	Script *script = arena_alloc_zero(it->arena, sizeof(Script));
+	Element res = interp_enter(it, script, src, NULL, NULL);
+	if (res.type == ERR)
+		script->error = res;
+	return script;
+}
+
+// Evaluates script in a namespace of its own under the global one, where args are
+// bound as vals. What the run allocates, its result included, lives until interp_reset.
+Element interp_run(Interp *it, Script *script, ScriptArg *args, u32 len)
+{
+	if (script->error.type == ERR)
+		return script->error;
+	Namespace *ns = ns_inner(it->run, it->ns, len);
+	for (u32 i = 0; i < len; i++)
+		ns_put(ns, args[i].name, args[i].value, IMMUTABLE);
+	return interp_enter(it, script, (String) { NULL, 0 }, ns, it->run);
+}
+
+// Makes what the interpreter evaluates end with an error at its next call or loop
+// iteration, compiled code included. Only sets flags, so it's fine in a signal handler.
+void interp_interrupt(Interp *it)
+{
+	it->interrupted = true;
+	it->jit_state.budget = INT64_MIN / 2; // Compiled calls bail out back to the interpreter
+}
+
+priv bool interrupted(void)
+{
+	return running && running->interrupted;
+}
+
+// Drops everything runs allocated at once, and the code the JIT compiled for them
+void interp_reset(Interp *it)
+{
+	jit_rewind(&it->jit_state); // Clears the jit of functions that still live in the run arena
+	arena_reset(it->run);
+}
+
+// What print wrote during the last interp_eval or interp_run, valid until the next one
+String interp_output(Interp *it)
+{
+	if (!it->printed)
+		return (String) { NULL, 0 };
+	u64 len = 0;
+	for (StrNode *tmp = it->printed->head; tmp; tmp = tmp->next)
+		len += tmp->string.len;
+	char *buf = arena_alloc(it->output, len);
+	len = 0;
+	for (StrNode *tmp = it->printed->head; tmp; tmp = tmp->next)
+		memcpy(buf + len, tmp->string.buf, tmp->string.len), len += tmp->string.len;
+	return (String) { buf, len };
+}
+
+// ~SPECIALIZATION
+// Infix, index and call nodes remember the operand types of their first evaluation
+// and take a fast path while they keep seeing them. A type miss demotes the node to
+// the generic path for good.
+void eval_specialize(bool enabled)
+{
+	specialize = enabled;
+}
+
+priv InfixOp infix_opcode(String op)
+{
+	String ops[] = {
+		str(""), str("+"), str("-"), str("*"), str("/"),
+		str("%"), str("=="), str("!="), str(">"), str("<")
+	};
+	for (int i = OP_ADD; i < arrlen(ops); i++)
+		if (str_eq(op, ops[i])) return i;
+	return OP_NONE;
+}
+
+priv Element eval_infix_node(Arena *a, struct AST_INFIX *node, Element left, Element right)
+{
+	if (node->spec == SPEC_NONE) {
+		node->opcode = infix_opcode(node->op);
+		bool ints = (left.type == INT && right.type == INT);
+		node->spec = (ints && node->opcode != OP_NONE) ? SPEC_INT : SPEC_GENERIC;
+	}
+	if (node->spec == SPEC_INT) {
+		if (left.type == INT && right.type == INT) {
+			i64 l = left.INT, r = right.INT;
+			switch (node->opcode) {
+				case OP_ADD: return (Element) { INT, .INT = l + r };
+				case OP_SUB: return (Element) { INT, .INT = l - r };
+				case OP_MUL: return (Element) { INT, .INT = l * r };
+				case OP_DIV: return (Element) { INT, .INT = l / r };
+				case OP_MOD: return (Element) { INT, .INT = l % r };
+				case OP_EQ: return (Element) { BOOL, .BOOL = (l == r) };
+				case OP_NOT_EQ: return (Element) { BOOL, .BOOL = (l != r) };
+				case OP_GT: return (Element) { BOOL, .BOOL = (l > r) };
+				case OP_LT: return (Element) { BOOL, .BOOL = (l < r) };
+				case OP_NONE: break;
+			}
+		}
+		node->spec = SPEC_GENERIC;
+	}
+	return eval_infix_expression(a, left, node->op, right);
+}
+
+priv Element eval_index_node(Arena *a, Namespace *ns, struct AST_INDEX *node, Element left, Element index)
+{
+	if (node->spec == SPEC_NONE)
+		node->spec = (left.type == ARRAY && index.type == INT) ? SPEC_ARRAY : SPEC_GENERIC;
+	if (node->spec == SPEC_ARRAY) {
+		if (left.type == ARRAY && index.type == INT) {
+			if (index.INT < 0 || index.INT >= left.ARRAY->len)
+				return (Element) { NIL };
+			return left.ARRAY->items[index.INT];
+		}
+		node->spec = SPEC_GENERIC;
+	}
+	return eval_index_expression(a, ns, left, index);
+}
+
+priv Element eval_call_node(Arena *a, Arena *frame, Namespace *ns, struct AST_CALL *node, Element fn, ElemArray *args)
+{
+	if (node->spec == SPEC_NONE)
+		node->spec = (fn.type == FUNCTION) ? SPEC_FUNCTION
+			: (fn.type == BUILTIN) ? SPEC_BUILTIN : SPEC_GENERIC;
+	if (node->spec == SPEC_FUNCTION && fn.type == FUNCTION)
+		return eval_function_call(a, frame, ns, fn.FUNCTION, args);
+	if (node->spec == SPEC_BUILTIN && fn.type == BUILTIN)
+		return builtin_call(a, ns, fn, args);
+	node->spec = SPEC_GENERIC;
+	return eval_call(a, frame, ns, fn, args);
+}
+
+priv Element error(String msg)
+{
+	return elem_from_str(ERR, msg);
+}
+
+// ~BUILTINs
+priv Element builtin_len(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_print(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_type(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_push(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_cdr(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_slurp(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_keys(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_values(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_has(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_del(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_reserve(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_slice(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_vector(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_set(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_map(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_filter(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_reduce(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_each(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_any(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_all(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_range(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_pmap(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_pfilter(Arena *a, Namespace *ns, ElemArray *args);
+priv Element builtin_preduce(Arena *a, Namespace *ns, ElemArray *args);
+#define BUILTIN_SLOTS 64
+
+// Core builtins check their arguments themselves
+global Native core_builtins[] = {
+	{ str("print"), &builtin_print, -1 },
+	{ str("len"), &builtin_len, -1 },
+	{ str("type"), &builtin_type, -1 },
+	{ str("push"), &builtin_push, -1 },
+	{ str("pop"), &builtin_pop, -1 },
+	{ str("reserve"), &builtin_reserve, -1 },
+	{ str("slice"), &builtin_slice, -1 },
+	{ str("car"), &builtin_car, -1 },
+	{ str("cdr"), &builtin_cdr, -1 },
+	{ str("concat"), &builtin_concat, -1 },
+	{ str("slurp"), &builtin_slurp, -1 },
+	{ str("keys"), &builtin_keys, -1 },
+	{ str("values"), &builtin_values, -1 },
+	{ str("has"), &builtin_has, -1 },
+	{ str("del"), &builtin_del, -1 },
+	{ str("vector"), &builtin_vector, -1 },
+	{ str("set"), &builtin_set, -1 },
+	{ str("map"), &builtin_map, -1 },
+	{ str("filter"), &builtin_filter, -1 },
+	{ str("reduce"), &builtin_reduce, -1 },
+	{ str("each"), &builtin_each, -1 },
+	{ str("any"), &builtin_any, -1 },
+	{ str("all"), &builtin_all, -1 },
+	{ str("range"), &builtin_range, -1 },
+	{ str("pmap"), &builtin_pmap, -1 },
+	{ str("pfilter"), &builtin_pfilter, -1 },
+	{ str("preduce"), &builtin_preduce, -1 },
+};
+global BuiltinSlot core_slots[BUILTIN_SLOTS] = {0};
+global BuiltinTable core_table = { BUILTIN_SLOTS, core_slots };
+global pthread_once_t core_once = PTHREAD_ONCE_INIT;
+
+// Registering a name again replaces the function
+priv void builtins_insert(BuiltinTable *t, Native *native)
+{
+	u32 key_hash = hash(native->name);
+	u32 i = key_hash & (t->cap - 1);
+	while (t->slots[i].native && !(t->slots[i].hash == key_hash && str_eq(t->slots[i].native->name, native->name)))
+		i = (i + 1) & (t->cap - 1);
+	t->slots[i] = (BuiltinSlot) { key_hash, native };
+}
+
+priv Native *builtins_find(BuiltinTable *t, String name, u32 key_hash)
+{
+	if (!t->cap)
+		return NULL;
+	for (u32 i = key_hash & (t->cap - 1); t->slots[i].native; i = (i + 1) & (t->cap - 1))
+		if (t->slots[i].hash == key_hash && str_eq(t->slots[i].native->name, name))
+			return t->slots[i].native;
+	return NULL;
+}
+
+priv void core_builtins_init(void)
+{
+	for (u32 i = 0; i < arrlen(core_builtins); i++)
+		builtins_insert(&core_table, &core_builtins[i]);
+}
+
+// len holds the arity plus one, 0 when the function checks its arguments itself
+priv Element builtin_elem(Native *native)
+{
+	return (Element) { BUILTIN, .len = (native->arity < 0) ? 0 : native->arity + 1, .BUILTIN = native->fn };
+}
+
+// The running interpreter's natives, then the core builtins
+priv Native *builtin_native(String name, u32 key_hash)
+{
+	pthread_once(&core_once, &core_builtins_init);
+	Native *native = (running) ? builtins_find(&running->natives, name, key_hash) : NULL;
+	return (native) ? native : builtins_find(&core_table, name, key_hash);
+}
+
+// Whether the running interpreter has a native taking the place of a core builtin
+bool builtin_replaced(String name)
+{
+	return running && builtins_find(&running->natives, name, hash(name));
+}
+
+priv bool builtin_core(BuiltinFunction fn)
+{
+	for (u32 i = 0; i < arrlen(core_builtins); i++)
+		if (core_builtins[i].fn == fn) return true;
+	return false;
+}
+
+priv Element BUILTINS(String name, u32 key_hash)
+{
+	Native *native = builtin_native(name, key_hash);
+	return (native) ? builtin_elem(native) : (Element) { NIL };
+}
+
+priv Element builtin_call(Arena *a, Namespace *ns, Element fn, ElemArray *args)
+{
+	if (fn.len && args->len != fn.len - 1)
+		return error(str_fmt(a, "Wrong number of args: got %lu, expected %u", args->len, fn.len - 1));
+	return fn.BUILTIN(a, ns, args);
+}
+priv Element elemlist_concat(Arena *a, ElemList *left, ElemList *right);
+priv Element elemarray_concat(Arena *a, ElemArray *left, ElemArray *right);
+priv Element builtin_concat(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for concat: got %lu, expected 2", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+	Element arg1 = args->items[1];
+	if (arg1.type == ERR)
+		return arg1;
+	if (arg0.type == ARRAY) {
+		if (ALWAYS(arg1.type == ARRAY))
+			return elemarray_concat(a, arg0.ARRAY, arg1.ARRAY);
+	}
+	if (arg0.type == LIST) {
+		if (ALWAYS(arg1.type == LIST))
+			return elemlist_concat(a, arg0.LIST, arg1.LIST);
+	}
+	// IF STR
+	return error(str_fmt(a, "Wrong types for concat got %.*s and %.*s",
+				fmt(type_str(arg0.type)), fmt(type_str(arg1.type))));
+}
+
+priv void elemlist_unshare(ElemList *l);
+priv ElemNode *elemnode(Arena *a, u32 cap);
+// Links right's nodes after left's tail, which is sealed so nothing else appends to it.
+// Only right's first node is copied, when right starts inside of it. Nodes that may not
+// live as long as left's, like a list made in a loop's scratch arena, are copied.
+priv Element elemlist_concat(Arena *a, ElemList *left, ElemList *right)
+{
+	if (!left || !left->len)
+		return (Element) { LIST, .LIST = right };
+	if (!right || !right->len)
+		return (Element) { LIST, .LIST = left };
+	if (!arena_owns(left->arena, right->head) || !arena_owns(left->arena, right->tail)) {
+		u32 len = right->len; // right may be left
+		ListIter it = elemlist_iter(right);
+		for (u32 i = 0; i < len; i++)
+			elempush(left, *elemlist_next(&it));
+		return (Element) { LIST, .LIST = left };
+	}
+	if (left->tail_end != left->tail->len || (left->tail->next && left->tail->len == left->tail->cap))
+		elemlist_unshare(left);
+	left->tail->cap = left->tail->len;
+	ElemNode *first = right->head;
+	u32 tail_end = right->tail_end;
+	if (right->start) {
+		u32 end = (first == right->tail) ? right->tail_end : first->len;
+		first = elemnode(left->arena, end - right->start);
+		memcpy(first->items, right->head->items + right->start, (end - right->start) * sizeof(Element));
+		first->len = end - right->start;
+		first->next = (right->head == right->tail) ? NULL : right->head->next;
+		if (right->head == right->tail)
+			tail_end = first->len;
+	}
+	left->tail->next = first;
+	left->tail = (right->head == right->tail) ? first : right->tail;
+	left->tail_end = tail_end;
+	left->len += right->len;
+	return (Element) { LIST, .LIST = left};
+}
+priv Element elemarray_concat(Arena *a, ElemArray *left, ElemArray *right)
+{
+	ElemArray *new = elemarray(a, left->len + right->len);
+	int j = 0;
+	for (int i = 0; i < left->len; i++) {
+		new->items[j] = left->items[i];
+		j++;
+	}
+	for (int i = 0; i < right->len; i++) {
+		new->items[j] = right->items[i];
+		j++;
+	}
+	return (Element) { ARRAY, .ARRAY = new };
+}
+
+priv Element read_file_to_elem(Arena *a, char *filename);
+priv Element builtin_slurp(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 1)
+		return error(str_fmt(a, "Wrong number of args for slurp: got %lu, expected 1", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+	if (arg0.type != STR)
+		return error(str_fmt(a, "Called slurp with the wrong type (%.*s), expected STR",
+					fmt(type_str(arg0.type))));
+	Element file = read_file_to_elem(a, str_dupc(a, elem_str(arg0)));
+	return file;
+}
+
+priv Element read_file_to_elem(Arena *a, char *filename)
+{
+	String s = {0};
+	FILE *f = fopen(filename, "r");
+	if (!f) 
+		return error(str_fmt(a, "File '%s' not found", filename));
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size < 0 || size > UINT32_MAX) {
+		fclose(f);
+		return error(str_fmt(a, "File '%s' too long: %ld bytes, at most %u", filename, size, UINT32_MAX));
+	}
+	u32 len = (u32)size;
+	fseek(f, 0, SEEK_SET);
+	s.buf = arena_alloc(a, len);
+	s.len = len;
+	fread(s.buf, sizeof(u8), len, f);
+	fclose(f);
+	return elem_from_str(STR, s);
+}
+
+priv Element builtin_cdr(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 1)
+		return error(str_fmt(a, "Wrong number of args for car: got %lu, expected 1", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+
+	if (arg0.type == LIST) {
+		if (arg0.LIST->len < 2)
+			return (Element) { NIL };
+		ElemList *lst = elemlist(a);
+		*lst = (ElemList) { a, arg0.LIST->head, arg0.LIST->tail, arg0.LIST->len - 1,
+			arg0.LIST->start + 1, arg0.LIST->tail_end };
+		if (lst->start == lst->head->len)
+			lst->head = lst->head->next, lst->start = 0;
+		return (Element) { LIST, .LIST = lst };
+	}
+	if (arg0.type == ARRAY) {
+		if (arg0.ARRAY->len < 2)
+			return (Element) { NIL };
+		return (Element) { ARRAY, .ARRAY = elemarray_slice(a, arg0.ARRAY, 1, arg0.ARRAY->len) };
+	}
+	if (arg0.type == STR) {
+		if (arg0.len < 1) 
+			return elem_from_str(STR, str(""));
+		return elem_from_str(STR, str_slice(elem_str(arg0), 1, arg0.len));
+	}
+	if (arg0.type == NIL)  
+		return arg0;
+	return error(str_fmt(a, "Wrong type for car got %*s",
+				fmt(type_str(arg0.type))));
+}
+
+priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 1)
+		return error(str_fmt(a, "Wrong number of args for car: got %lu, expected 1", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+
+	if (arg0.type == LIST) {
+		if (arg0.LIST->len)
+			return *elemlist_at(arg0.LIST, 0);
+		else
 			return (Element) { NIL };
 	}
 	if (arg0.type == ARRAY) {
@@ -667,10 +1841,15 @@ priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args)
 			return (Element) { NIL };
 		return arg0.ARRAY->items[0];
 	}
+	if (arg0.type == VECTOR) {
+		if (arg0.VECTOR->len < 1)
+			return (Element) { NIL };
+		return *elemvector_at(arg0.VECTOR, 0);
+	}
 	if (arg0.type == STR) {
-		if (arg0.STR.len < 1) 
-			return (Element) { STR, .STR = str("") };
-		return (Element) { STR, .STR = str_slice(arg0.STR, 0, 1) };
+		if (arg0.len < 1) 
+			return elem_from_str(STR, str(""));
+		return elem_from_str(STR, str_slice(elem_str(arg0), 0, 1));
 	}
 	if (arg0.type == NIL)  
 		return arg0;
@@ -678,30 +1857,1004 @@ priv Element builtin_car(Arena *a, Namespace *ns, ElemArray *args)
 				fmt(type_str(arg0.type))));
 }
 
-priv Element builtin_push(Arena *a, Namespace *ns, ElemArray *args)
+priv Element builtin_push(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for push: got %lu, expected 2", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+	Element arg1 = args->items[1];
+	if (arg1.type == ERR)
+		return arg1;
+	if (arg0.type == LIST) {
+		elempush(arg0.LIST, arg1);
+		return arg0;
+	}
+	if (arg0.type == ARRAY) {
+		u32 a0_len = arg0.ARRAY->len;
+		ElemArray *res = elemarray(a, (a0_len + 1));
+		for (int i = 0; i < a0_len; i++)
+			res->items[i] = arg0.ARRAY->items[i];
+		res->items[a0_len] = disown(arg1);
+		return (Element) { ARRAY, .ARRAY = res };
+	}
+	if (arg0.type == VECTOR)
+		return (Element) { VECTOR, .VECTOR = elemvector(a, vec_push(arg0.VECTOR, arg1)) };
+	return error(str_fmt(a, "Wrong type for push got %.*s and %.*s",
+				fmt(type_str(arg0.type)), fmt(type_str(arg1.type))));
+}
+
+// A new array without the last item, or the same one updated in place by `x = pop(x)`
+priv Element builtin_pop(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 1)
+		return error(str_fmt(a, "Wrong number of args for pop: got %lu, expected 1", args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+	if (arg0.type == VECTOR)
+		return (Element) { VECTOR, .VECTOR = elemvector(a, vec_pop(arg0.VECTOR)) };
+	if (arg0.type != ARRAY)
+		return error(str_fmt(a, "Wrong type for pop got %.*s", fmt(type_str(arg0.type))));
+	u32 len = (arg0.ARRAY->len) ? arg0.ARRAY->len - 1 : 0;
+	ElemArray *res = elemarray(a, len);
+	for (u32 i = 0; i < len; i++)
+		res->items[i] = arg0.ARRAY->items[i];
+	return (Element) { ARRAY, .ARRAY = res };
+}
+
+// ~HIGHER ORDER BUILTINS
+// The function is called in a single frame for the whole loop, rewound after every item.
+// Results that are only tested land in the frame too; the others are copied to a.
+typedef struct Seq {
+	Element	coll;
+	u32	at;
+	ListIter list;
+} Seq;
+
+typedef struct Callback {
+	Element	fn;
+	Namespace *ns;
+	Arena	*frame;
+	ElemArray *args;
+	u64	mark;
+} Callback;
+
+priv bool seq_open(Element coll, Seq *s)
+{
+	*s = (Seq) { coll };
+	if (coll.type == LIST)
+		s->list = elemlist_iter(coll.LIST);
+	return (coll.type == ARRAY || coll.type == LIST || coll.type == VECTOR);
+}
+
+priv u32 seq_len(Seq *s)
+{
+	switch (s->coll.type) {
+		case ARRAY: return s->coll.ARRAY->len;
+		case LIST: return s->coll.LIST->len;
+		case VECTOR: return s->coll.VECTOR->len;
+		default: return 0;
+	}
+}
+
+priv Element *seq_next(Seq *s)
+{
+	if (s->coll.type == LIST)
+		return elemlist_next(&s->list);
+	if (s->at >= seq_len(s))
+		return NULL;
+	if (s->coll.type == VECTOR)
+		return elemvector_at(s->coll.VECTOR, s->at++);
+	return &s->coll.ARRAY->items[s->at++];
+}
+
+// Checks the collection and function arguments of a higher order builtin named name
+priv Element callback_check(Arena *a, String name, ElemArray *args, Seq *s)
+{
+	for (u32 i = 0; i < args->len; i++)
+		if (args->items[i].type == ERR) return args->items[i];
+	Element fn = args->items[1];
+	if (!seq_open(args->items[0], s) || (fn.type != FUNCTION && fn.type != BUILTIN))
+		return error(str_fmt(a, "Wrong types for %.*s got %.*s and %.*s, expected ARRAY, LIST or VECTOR and a function",
+					fmt(name), fmt(type_str(args->items[0].type)), fmt(type_str(fn.type))));
+	return (Element) { NIL };
+}
+
+priv Element callback_open(Arena *a, Namespace *ns, String name, ElemArray *args, u32 argc, Seq *s, Callback *cb)
+{
+	Element err = callback_check(a, name, args, s);
+	if (err.type == ERR)
+		return err;
+	Element fn = args->items[1];
+	Arena *frame = frame_acquire();
+	Namespace *fn_ns = (fn.type == FUNCTION) ? fn.FUNCTION->namespace : ns;
+	*cb = (Callback) { fn, fn_ns, frame, elemarray(frame, argc) };
+	cb->mark = frame->used;
+	return (Element) { NIL };
+}
+
+// Calls the function on the arguments in cb->args, with the result copied to into
+priv Element callback_call(Arena *a, Arena *into, Callback *cb)
+{
+	Element res = eval_call(into, cb->frame, cb->ns, cb->fn, cb->args);
+	if (res.type == ERR && into != a)
+		res = elem_copy(a, res);
+	return res;
+}
+
+priv void callback_rewind(Callback *cb)
+{
+	arena_pop_to(cb->frame, cb->mark);
+}
+
+priv Element callback_close(Callback *cb, Element res)
+{
+	frame_release(cb->frame);
+	return res;
+}
+
+// An ARRAY of fn(item) for every item
+priv Element builtin_map(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for map: got %lu, expected 2", args->len));
+	Seq s;
+	Callback cb;
+	Element err = callback_open(a, ns, str("map"), args, 1, &s, &cb);
+	if (err.type == ERR)
+		return err;
+	ElemArray *res = elemarray(a, seq_len(&s));
+	u32 i = 0;
+	for (Element *item; (item = seq_next(&s)); callback_rewind(&cb)) {
+		cb.args->items[0] = *item;
+		Element tmp = callback_call(a, a, &cb);
+		if (tmp.type == ERR)
+			return callback_close(&cb, tmp);
+		res->items[i++] = disown(tmp);
+	}
+	return callback_close(&cb, (Element) { ARRAY, .ARRAY = res });
+}
+
+// An ARRAY of the items for which fn(item) is truthy
+priv Element builtin_filter(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for filter: got %lu, expected 2", args->len));
+	Seq s;
+	Callback cb;
+	Element err = callback_open(a, ns, str("filter"), args, 1, &s, &cb);
+	if (err.type == ERR)
+		return err;
+	ElemArray *res = elemarray(a, seq_len(&s));
+	res->len = 0;
+	for (Element *item; (item = seq_next(&s)); callback_rewind(&cb)) {
+		cb.args->items[0] = *item;
+		Element tmp = callback_call(a, cb.frame, &cb);
+		if (tmp.type == ERR)
+			return callback_close(&cb, tmp);
+		if (is_truthy(tmp))
+			res->items[res->len++] = disown(*item);
+	}
+	return callback_close(&cb, (Element) { ARRAY, .ARRAY = res });
+}
+
+// fn(fn(fn(init, item0), item1), ...)
+priv Element builtin_reduce(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 3)
+		return error(str_fmt(a, "Wrong number of args for reduce: got %lu, expected 3", args->len));
+	Seq s;
+	Callback cb;
+	Element err = callback_open(a, ns, str("reduce"), args, 2, &s, &cb);
+	if (err.type == ERR)
+		return err;
+	Element acc = args->items[2];
+	for (Element *item; (item = seq_next(&s)); callback_rewind(&cb)) {
+		cb.args->items[0] = acc;
+		cb.args->items[1] = *item;
+		acc = callback_call(a, a, &cb);
+		if (acc.type == ERR)
+			break;
+	}
+	return callback_close(&cb, acc);
+}
+
+// Calls fn(item) on every item for its effects
+priv Element builtin_each(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for each: got %lu, expected 2", args->len));
+	Seq s;
+	Callback cb;
+	Element err = callback_open(a, ns, str("each"), args, 1, &s, &cb);
+	if (err.type == ERR)
+		return err;
+	for (Element *item; (item = seq_next(&s)); callback_rewind(&cb)) {
+		cb.args->items[0] = *item;
+		Element tmp = callback_call(a, cb.frame, &cb);
+		if (tmp.type == ERR)
+			return callback_close(&cb, tmp);
+	}
+	return callback_close(&cb, (Element) { NIL });
+}
+
+// Whether fn(item) is as truthy as want for some item, stopping at the first one
+priv Element seq_find(Arena *a, Namespace *ns, String name, ElemArray *args, bool want)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for %.*s: got %lu, expected 2", fmt(name), args->len));
+	Seq s;
+	Callback cb;
+	Element err = callback_open(a, ns, name, args, 1, &s, &cb);
+	if (err.type == ERR)
+		return err;
+	for (Element *item; (item = seq_next(&s)); callback_rewind(&cb)) {
+		cb.args->items[0] = *item;
+		Element tmp = callback_call(a, cb.frame, &cb);
+		if (tmp.type == ERR)
+			return callback_close(&cb, tmp);
+		if (is_truthy(tmp) == want)
+			return callback_close(&cb, (Element) { BOOL, .BOOL = true });
+	}
+	return callback_close(&cb, (Element) { BOOL, .BOOL = false });
+}
+
+priv Element builtin_any(Arena *a, Namespace *ns, ElemArray *args)
+{
+	return seq_find(a, ns, str("any"), args, true);
+}
+
+priv Element builtin_all(Arena *a, Namespace *ns, ElemArray *args)
+{
+	Element res = seq_find(a, ns, str("all"), args, false);
+	return (res.type == BOOL) ? (Element) { BOOL, .BOOL = !res.BOOL } : res;
+}
+
+// An ARRAY of the INTs from begin (0 when left out) up to end, excluded
+priv Element builtin_range(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 1 && args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for range: got %lu, expected 1 or 2", args->len));
+	Element begin = (args->len == 2) ? args->items[0] : (Element) { INT, .INT = 0 };
+	Element end = args->items[args->len - 1];
+	if (begin.type == ERR || end.type == ERR)
+		return (begin.type == ERR) ? begin : end;
+	if (begin.type != INT || end.type != INT)
+		return error(str_fmt(a, "Wrong types for range got %.*s and %.*s, expected INT",
+					fmt(type_str(begin.type)), fmt(type_str(end.type))));
+	i64 len = (end.INT > begin.INT) ? end.INT - begin.INT : 0;
+	if (len > UINT32_MAX)
+		return error(str_fmt(a, "range too long: %ld items, at most %u", len, UINT32_MAX));
+	ElemArray *res = elemarray(a, len);
+	for (u32 i = 0; i < res->len; i++)
+		res->items[i] = (Element) { INT, .INT = begin.INT + i };
+	return (Element) { ARRAY, .ARRAY = res };
+}
+
+// ~PARALLEL SAFETY
+// A function can run on several threads at once when it can't write to anything another
+// call sees: it only assigns to names it declared, only writes into containers it built
+// or was passed (callers then check what they pass), doesn't print, and what it calls by
+// a name bound outside of it follows the same rules. Callees that are parameters or
+// expressions can't be looked into, so calling them makes the function unsafe.
+#define PURE_LOCALS_MAX 256
+#define PURE_SEEN_MAX 64
+#define PURE_CONTAINERS ((1 << LIST) | (1 << ARRAY) | (1 << MAP))
+
+typedef struct PureLocal {
+	String	name;
+	bool	param;   // Or bound to one
+	bool	is_fn;   // Bound to a function literal
+	bool	mutates; // ...which writes into its parameters
+	bool	shared;  // Bound to outer, or an item of it depth levels down
+	Element	outer;
+	u32	depth;
+} PureLocal;
+
+typedef struct Purity {
+	Namespace *ns; // Where names that aren't local resolve
+	u32	base;     // First local the function being checked can see
+	u32	len;
+	bool	mutates;  // The function being checked writes into its parameters
+	u32	seen_len;
+	Function *seen[PURE_SEEN_MAX];
+	bool	seen_mutates[PURE_SEEN_MAX];
+	PureLocal locals[PURE_LOCALS_MAX];
+} Purity;
+
+priv bool pure_node(Purity *p, AST *node);
+
+priv PureLocal *pure_local(Purity *p, String name)
+{
+	for (u32 i = p->len; i > p->base; i--)
+		if (str_eq(p->locals[i - 1].name, name)) return &p->locals[i - 1];
+	return NULL;
+}
+
+priv PureLocal *pure_declare(Purity *p, String name, bool param)
+{
+	if (p->len == PURE_LOCALS_MAX)
+		return NULL;
+	p->locals[p->len] = (PureLocal) { name, param };
+	return &p->locals[p->len++];
+}
+
+priv Element pure_resolve(Purity *p, String name)
+{
+	Namespace *owner = NULL;
+	Bind *b = ns_find(p->ns, name, hash(name), &owner);
+	return (b) ? b->element : BUILTINS(name, hash(name));
+}
+
+// Whether writing into what node evaluates to can't reach a container bound outside of
+// the function, when the write only changes values of a type in types
+priv bool pure_writable(Purity *p, AST *node, u32 types)
+{
+	u32 depth = 0;
+	for (; node->type == AST_INDEX; depth++)
+		node = node->AST_INDEX.left;
+	if (node->type != AST_IDENT)
+		return true;
+	Element outer;
+	PureLocal *l = pure_local(p, node->AST_IDENT.name);
+	if (l) {
+		p->mutates |= l->param;
+		if (!l->shared)
+			return true;
+		outer = l->outer, depth += l->depth;
+	} else
+		outer = pure_resolve(p, node->AST_IDENT.name);
+	if (depth == 0)
+		return !(types & (1 << outer.type));
+	if (depth > 1 || outer.type != ARRAY)
+		return false;
+	for (u32 i = 0; i < outer.ARRAY->len; i++)
+		if (types & (1 << outer.ARRAY->items[i].type)) return false;
+	return true;
+}
+
+// Records what l holds when value is a binding or an item of one
+priv void pure_bind(Purity *p, PureLocal *l, AST *value)
+{
+	u32 depth = 0;
+	for (; value->type == AST_INDEX; depth++)
+		value = value->AST_INDEX.left;
+	if (value->type != AST_IDENT)
+		return ;
+	PureLocal *src = pure_local(p, value->AST_IDENT.name);
+	l->param |= (src && src->param);
+	if (src && !src->shared)
+		return ;
+	Element outer = (src) ? src->outer : pure_resolve(p, value->AST_IDENT.name);
+	depth += (src) ? src->depth : 0;
+	if (l->shared && (l->depth != depth || l->outer.type != outer.type || l->outer.ARRAY != outer.ARRAY))
+		depth = 2; // Holds one or the other
+	l->shared = true, l->outer = outer, l->depth = depth;
+}
+
+priv bool pure_block(Purity *p, ASTList *list)
+{
+	u32 len = p->len;
+	bool ok = true;
+	for (ASTNode *tmp = list->head; ok && tmp; tmp = tmp->next)
+		ok = pure_node(p, tmp->ast);
+	p->len = len;
+	return ok;
+}
+
+priv bool pure_fn(Purity *p, ASTList *params, ASTList *body, bool *mutates)
+{
+	u32 len = p->len;
+	bool outer = p->mutates, ok = true;
+	p->mutates = false;
+	for (ASTNode *tmp = params->head; ok && tmp; tmp = tmp->next)
+		ok = (pure_declare(p, tmp->ast->AST_STR, true) != NULL);
+	ok = ok && pure_block(p, body);
+	*mutates = p->mutates;
+	p->mutates = outer;
+	p->len = len;
+	return ok;
+}
+
+// Functions bound outside are checked in their own namespace, once
+priv bool pure_function(Purity *p, Function *fn, bool *mutates)
+{
+	*mutates = false;
+	if (!fn->body) // Compiled by emit_c, there's nothing to look into
+		return false;
+	for (u32 i = 0; i < p->seen_len; i++)
+		if (p->seen[i] == fn) return (*mutates = p->seen_mutates[i], true);
+	if (p->seen_len == PURE_SEEN_MAX)
+		return false;
+	u32 at = p->seen_len++;
+	p->seen[at] = fn, p->seen_mutates[at] = false;
+	Namespace *ns = p->ns;
+	u32 base = p->base;
+	p->ns = fn->namespace, p->base = p->len;
+	bool ok = pure_fn(p, fn->params, fn->body, mutates);
+	p->ns = ns, p->base = base;
+	p->seen_mutates[at] = *mutates;
+	return ok;
+}
+
+priv Element builtin_print(Arena *a, Namespace *ns, ElemArray *args);
+priv bool pure_callee(Purity *p, AST *callee, bool *mutates);
+// Builtins writing into their first argument, and the ones calling a function on items
+priv bool pure_builtin(Purity *p, BuiltinFunction f, ASTList *args)
+{
+	if (f == &builtin_print || !builtin_core(f)) // Nothing is known about the host's
+		return false;
+	bool writes = (f == &builtin_push || f == &builtin_concat || f == &builtin_del || f == &builtin_reserve);
+	if (!args || !args->head)
+		return !writes;
+	AST *first = args->head->ast;
+	if (f == &builtin_push || f == &builtin_concat)
+		return pure_writable(p, first, 1 << LIST);
+	if (f == &builtin_del)
+		return pure_writable(p, first, 1 << MAP);
+	if (f == &builtin_reserve)
+		return pure_writable(p, first, 1 << ARRAY);
+	bool higher_order = (f == &builtin_map || f == &builtin_filter || f == &builtin_reduce || f == &builtin_each
+			|| f == &builtin_any || f == &builtin_all || f == &builtin_pmap || f == &builtin_pfilter || f == &builtin_preduce);
+	if (!higher_order || args->len < 2)
+		return true;
+	bool mutates = false;
+	if (!pure_callee(p, args->head->next->ast, &mutates))
+		return false;
+	return !mutates || pure_writable(p, first, PURE_CONTAINERS);
+}
+
+priv bool pure_callee(Purity *p, AST *callee, bool *mutates)
+{
+	*mutates = false;
+	if (callee->type == AST_FN)
+		return pure_fn(p, callee->AST_FN.params, callee->AST_FN.body, mutates);
+	if (callee->type != AST_IDENT)
+		return false;
+	PureLocal *l = pure_local(p, callee->AST_IDENT.name);
+	if (l)
+		return (*mutates = l->mutates, l->is_fn);
+	Element fn = pure_resolve(p, callee->AST_IDENT.name);
+	if (fn.type == BUILTIN)
+		return pure_builtin(p, fn.BUILTIN, NULL);
+	return fn.type == FUNCTION && pure_function(p, fn.FUNCTION, mutates);
+}
+
+priv bool pure_call(Purity *p, struct AST_CALL *call)
+{
+	for (ASTNode *tmp = call->args->head; tmp; tmp = tmp->next)
+		if (!pure_node(p, tmp->ast)) return false;
+	AST *callee = call->function;
+	if (callee->type == AST_IDENT && !pure_local(p, callee->AST_IDENT.name)) {
+		Element fn = pure_resolve(p, callee->AST_IDENT.name);
+		if (fn.type == BUILTIN)
+			return pure_builtin(p, fn.BUILTIN, call->args);
+	}
+	bool mutates = false;
+	if (!pure_callee(p, callee, &mutates))
+		return false;
+	for (ASTNode *tmp = call->args->head; mutates && tmp; tmp = tmp->next)
+		if (!pure_writable(p, tmp->ast, PURE_CONTAINERS)) return false;
+	return true;
+}
+
+priv bool pure_node(Purity *p, AST *node)
+{
+	if (!node)
+		return true;
+	switch (node->type) {
+		case AST_VAL: case AST_VAR: {
+			String name = (node->type == AST_VAL) ? node->AST_VAL.name : node->AST_VAR.name;
+			AST *value = (node->type == AST_VAL) ? node->AST_VAL.value : node->AST_VAR.value;
+			if (value->type == AST_FN) { // Declared first, the function can call itself
+				PureLocal *l = pure_declare(p, name, false);
+				if (!l)
+					return false;
+				l->is_fn = true;
+				return pure_fn(p, value->AST_FN.params, value->AST_FN.body, &l->mutates);
+			}
+			if (!pure_node(p, value))
+				return false;
+			PureLocal *l = pure_declare(p, name, false);
+			return l && (pure_bind(p, l, value), true);
+		}
+		case AST_ASSIGN: {
+			AST *left = node->AST_ASSIGN.left, *right = node->AST_ASSIGN.right;
+			if (!pure_node(p, right))
+				return false;
+			if (left->type == AST_INDEX)
+				return pure_node(p, left->AST_INDEX.left) && pure_node(p, left->AST_INDEX.index)
+					&& pure_writable(p, left->AST_INDEX.left, PURE_CONTAINERS);
+			PureLocal *l = (left->type == AST_IDENT) ? pure_local(p, left->AST_IDENT.name) : NULL;
+			if (!l)
+				return false;
+			l->is_fn = false;
+			pure_bind(p, l, right);
+			return true;
+		}
+		case AST_WHILE: // Twice, for what a binding holds at the end of an iteration
+			return pure_node(p, node->AST_WHILE.condition)
+				&& pure_block(p, node->AST_WHILE.body) && pure_block(p, node->AST_WHILE.body);
+		case AST_COND:
+			return pure_node(p, node->AST_COND.condition) && pure_block(p, node->AST_COND.consequence)
+				&& (!node->AST_COND.alternative || pure_block(p, node->AST_COND.alternative));
+		case AST_RETURN:
+			return pure_node(p, node->AST_RETURN.value);
+		case AST_FN: {
+			bool mutates;
+			return pure_fn(p, node->AST_FN.params, node->AST_FN.body, &mutates);
+		}
+		case AST_CALL:
+			return pure_call(p, &node->AST_CALL);
+		case AST_INFIX: // + on a LIST links the right one after the left one
+			return pure_node(p, node->AST_INFIX.left) && pure_node(p, node->AST_INFIX.right)
+				&& (!str_eq(node->AST_INFIX.op, str("+")) || pure_writable(p, node->AST_INFIX.left, 1 << LIST));
+		case AST_PREFIX:
+			return pure_node(p, node->AST_PREFIX.right);
+		case AST_INDEX:
+			return pure_node(p, node->AST_INDEX.left) && pure_node(p, node->AST_INDEX.index);
+		case AST_INVARIANT:
+			return pure_node(p, node->AST_INVARIANT.value);
+		case AST_LIST: case AST_MAP:
+			for (ASTNode *tmp = node->AST_LIST->head; tmp; tmp = tmp->next)
+				if (!pure_node(p, tmp->ast)) return false;
+			return true;
+		case AST_IDENT: case AST_INT: case AST_BOOL: case AST_STR: case AST_NULL:
+			return true;
+		case AST_PROGRAM:
+			return false;
+	}
+	return false;
+}
+
+// Whether fn can be called from several threads at once
+priv bool parallel_safe(Element fn)
+{
+	Purity p = { .ns = (fn.type == FUNCTION) ? fn.FUNCTION->namespace : NULL };
+	if (fn.type == BUILTIN)
+		return pure_builtin(&p, fn.BUILTIN, NULL);
+	bool mutates;
+	return pure_function(&p, fn.FUNCTION, &mutates);
+}
+
+// ~PARALLEL BUILTINS
+// pmap, pfilter and preduce split the items in chunks handed out to a pool of threads
+// started on first use. Every thread takes the next chunk left until there's none, so
+// the ones finishing early take over from the others, and evaluates with its own frames
+// and scratch arenas. Results go to an arena per thread, copied from by the calling
+// thread once they're all done. Functions parallel_safe turns down run on the calling
+// thread like map, filter and reduce do, and so does anything called from a pool thread.
+#define POOL_MAX 64
+#define POOL_STACK MB(8)
+#define POOL_CHUNKS 8 // Per thread
+
+typedef enum JobKind { JOB_MAP, JOB_FILTER, JOB_REDUCE } JobKind;
+
+typedef struct Job {
+	JobKind	kind;
+	Element	fn;
+	Namespace *ns;
+	Element	*items;
+	u32	len;
+	u32	chunk;
+	u32	chunks;
+	u32	next;    // First chunk nobody took yet
+	bool	failed;  // Stops the others once a call errored
+	bool	full;    // A thread's arena ran out of space
+	u32	max_depth;
+	Element	*results; // One per item, or per chunk for preduce
+} Job;
+
+typedef struct Pool {
+	u32	size;
+	pthread_mutex_t taken; // By the interpreter whose job runs, the others don't wait for it
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	u64	generation; // Jobs started
+	u32	busy;
+	Job	*job;
+	Arena	*results[POOL_MAX];
+} Pool;
+
+global u32 pool_threads = 0;
+global pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+global Pool pool = { .taken = PTHREAD_MUTEX_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+void eval_threads(u32 threads)
+{
+	pool_threads = MIN(threads, POOL_MAX);
+}
+
+priv void job_run(Job *job, Arena *out)
+{
+	EvalState state = eval_state();
+	jmp_buf env;
+	jmp_buf *previous = arena_catch(&env);
+	if (setjmp(env)) {
+		__atomic_store_n(&job->full, true, __ATOMIC_RELAXED);
+		__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+		eval_restore(&state);
+		arena_catch(previous);
+		return ;
+	}
+	max_depth = job->max_depth;
+	Callback cb = { job->fn, job->ns, frame_acquire() };
+	cb.args = elemarray(cb.frame, (job->kind == JOB_REDUCE) ? 2 : 1);
+	cb.mark = cb.frame->used;
+	for (;;) {
+		u32 c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (c >= job->chunks || __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+			break;
+		u32 begin = c * job->chunk, end = MIN(begin + job->chunk, job->len);
+		if (job->kind == JOB_REDUCE) { // Each chunk folds from its first item
+			Element acc = job->items[begin];
+			for (u32 i = begin + 1; i < end && acc.type != ERR; i++, callback_rewind(&cb)) {
+				cb.args->items[0] = acc, cb.args->items[1] = job->items[i];
+				acc = callback_call(out, out, &cb);
+			}
+			if (acc.type == ERR)
+				__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+			job->results[c] = acc;
+			continue;
+		}
+		for (u32 i = begin; i < end; i++, callback_rewind(&cb)) {
+			cb.args->items[0] = job->items[i];
+			Element res = callback_call(out, (job->kind == JOB_MAP) ? out : cb.frame, &cb);
+			if (res.type == ERR) {
+				__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+				job->results[i] = res;
+				break;
+			}
+			job->results[i] = (job->kind == JOB_MAP) ? res : (Element) { BOOL, .BOOL = is_truthy(res) };
+		}
+	}
+	frame_release(cb.frame);
+	arena_catch(previous);
+}
+
+priv void *pool_worker(void *arg)
+{
+	Arena *out = arg;
+	in_worker = true;
+	for (u64 seen = 0;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.generation == seen)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		seen = pool.generation;
+		Job *job = pool.job;
+		pthread_mutex_unlock(&pool.lock);
+		job_run(job, out);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+// Threads live as long as the process, one per core unless --threads says otherwise
+// The threads don't survive a fork, the child starts its own pool when it needs one
+priv void pool_forked(void)
+{
+	pool.size = 0;
+	pool.busy = 0;
+	pool.generation = 0; // New threads wait for the next one
+	pool.job = NULL;
+	pool.taken = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	pool.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	pool.wake = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	pool.done = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+	pool_owner = false;
+}
+
+priv void pool_register_fork(void)
+{
+	pthread_atfork(NULL, NULL, &pool_forked);
+}
+
+priv bool pool_start(void)
+{
+	if (pool.size)
+		return true;
+	pthread_once(&pool_once, &pool_register_fork);
+	u32 size = pool_threads;
+	if (!size) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		size = (cores < 1) ? 1 : MIN((u32)cores, POOL_MAX);
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, POOL_STACK);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (u32 i = 0; i < size; i++) {
+		pthread_t thread;
+		if (!pool.results[i])
+			pool.results[i] = arena(GB(4));
+		if (pthread_create(&thread, &attr, pool_worker, pool.results[i]) != 0)
+			break;
+		pool.size++;
+	}
+	pthread_attr_destroy(&attr);
+	return pool.size > 0;
+}
+
+// Checks the arguments like callback_open and lays the items out in an array. Returns
+// NIL when the job should run on the pool, BOOL false when it should run here.
+priv Element job_open(Arena *a, Namespace *ns, String name, ElemArray *args, JobKind kind, Job *job)
+{
+	Seq s;
+	Element err = callback_check(a, name, args, &s);
+	if (err.type == ERR)
+		return err;
+	Element fn = args->items[1];
+	if (in_worker || seq_len(&s) < 2 || !parallel_safe(fn))
+		return (Element) { BOOL, .BOOL = false };
+	if (pthread_mutex_trylock(&pool.taken) != 0)
+		return (Element) { BOOL, .BOOL = false };
+	if (!pool_start()) {
+		pthread_mutex_unlock(&pool.taken);
+		return (Element) { BOOL, .BOOL = false };
+	}
+	pool_owner = true;
+	*job = (Job) { kind, fn, (fn.type == FUNCTION) ? fn.FUNCTION->namespace : ns };
+	job->max_depth = max_depth;
+	job->len = seq_len(&s);
+	if (args->items[0].type == ARRAY) {
+		job->items = args->items[0].ARRAY->items;
+	} else {
+		job->items = arena_alloc(a, job->len * sizeof(Element));
+		u32 i = 0;
+		for (Element *item; (item = seq_next(&s)); )
+			job->items[i++] = *item;
+	}
+	job->chunk = MAX(job->len / (pool.size * POOL_CHUNKS), 1);
+	job->chunks = (job->len + job->chunk - 1) / job->chunk;
+	job->results = arena_alloc_zero(a, ((kind == JOB_REDUCE) ? job->chunks : job->len) * sizeof(Element));
+	return (Element) { NIL };
+}
+
+// Runs job on every thread of the pool and waits for them
+priv Element job_wait(Arena *a, Job *job)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.busy = pool.size;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	if (job->full)
+		return error(str("Out of memory: an arena ran out of space"));
+	u32 len = (job->kind == JOB_REDUCE) ? job->chunks : job->len;
+	for (u32 i = 0; job->failed && i < len; i++)
+		if (job->results[i].type == ERR) return elem_copy(a, job->results[i]);
+	return (Element) { NIL };
+}
+
+priv void job_close(void)
+{
+	for (u32 i = 0; i < pool.size; i++)
+		arena_reset(pool.results[i]);
+	pool_owner = false;
+	pthread_mutex_unlock(&pool.taken);
+}
+
+// map on the threads of the pool
+priv Element builtin_pmap(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for pmap: got %lu, expected 2", args->len));
+	Job job;
+	Element res = job_open(a, ns, str("pmap"), args, JOB_MAP, &job);
+	if (res.type != NIL)
+		return (res.type == ERR) ? res : builtin_map(a, ns, args);
+	res = job_wait(a, &job);
+	if (res.type != ERR) {
+		res = (Element) { ARRAY, .ARRAY = elemarray(a, job.len) };
+		for (u32 i = 0; i < job.len; i++)
+			res.ARRAY->items[i] = disown(elem_copy(a, job.results[i]));
+	}
+	job_close();
+	return res;
+}
+
+// filter on the threads of the pool, keeping the items in order
+priv Element builtin_pfilter(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for pfilter: got %lu, expected 2", args->len));
+	Job job;
+	Element res = job_open(a, ns, str("pfilter"), args, JOB_FILTER, &job);
+	if (res.type != NIL)
+		return (res.type == ERR) ? res : builtin_filter(a, ns, args);
+	res = job_wait(a, &job);
+	if (res.type != ERR) {
+		res = (Element) { ARRAY, .ARRAY = elemarray(a, job.len) };
+		res.ARRAY->len = 0;
+		for (u32 i = 0; i < job.len; i++)
+			if (job.results[i].BOOL) res.ARRAY->items[res.ARRAY->len++] = disown(job.items[i]);
+	}
+	job_close();
+	return res;
+}
+
+// reduce on the threads of the pool: each chunk is folded on its own, then init and the
+// chunks' results here, so fn has to be associative for the result to match reduce's
+priv Element builtin_preduce(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 3)
+		return error(str_fmt(a, "Wrong number of args for preduce: got %lu, expected 3", args->len));
+	Job job;
+	Element acc = job_open(a, ns, str("preduce"), args, JOB_REDUCE, &job);
+	if (acc.type != NIL)
+		return (acc.type == ERR) ? acc : builtin_reduce(a, ns, args);
+	acc = job_wait(a, &job);
+	if (acc.type == ERR)
+		return (job_close(), acc);
+	Callback cb = { job.fn, job.ns, frame_acquire() };
+	cb.args = elemarray(cb.frame, 2);
+	cb.mark = cb.frame->used;
+	acc = args->items[2];
+	for (u32 c = 0; c < job.chunks && acc.type != ERR; c++, callback_rewind(&cb)) {
+		cb.args->items[0] = acc, cb.args->items[1] = job.results[c];
+		acc = callback_call(a, a, &cb);
+	}
+	acc = elem_copy(a, acc); // Builtins may return one of the chunks' results
+	job_close();
+	return callback_close(&cb, acc);
+}
+
+// A persistent vector with the items of an ARRAY or LIST, or an empty one
+priv Element builtin_vector(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len > 1)
+		return error(str_fmt(a, "Wrong number of args for vector: got %lu, expected 0 or 1", args->len));
+	ElemVector v = { NULL, NULL, 0, VEC_BITS };
+	if (!args->len)
+		return (Element) { VECTOR, .VECTOR = elemvector(a, v) };
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR || arg0.type == VECTOR)
+		return arg0;
+	if (arg0.type == ARRAY) {
+		for (u32 i = 0; i < arg0.ARRAY->len; i++)
+			v = vec_push(&v, arg0.ARRAY->items[i]);
+		return (Element) { VECTOR, .VECTOR = elemvector(a, v) };
+	}
+	if (arg0.type == LIST) {
+		ListIter it = elemlist_iter(arg0.LIST);
+		for (Element *cursor; (cursor = elemlist_next(&it)); )
+			v = vec_push(&v, *cursor);
+		return (Element) { VECTOR, .VECTOR = elemvector(a, v) };
+	}
+	return error(str_fmt(a, "Wrong type for vector got %.*s", fmt(type_str(arg0.type))));
+}
+
+// A new vector with the item at index replaced, sharing everything but the path to it
+priv Element builtin_set(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 3)
+		return error(str_fmt(a, "Wrong number of args for set: got %lu, expected 3", args->len));
+	for (int i = 0; i < 3; i++)
+		if (args->items[i].type == ERR) return args->items[i];
+	Element arg0 = args->items[0], index = args->items[1];
+	if (arg0.type != VECTOR || index.type != INT)
+		return error(str_fmt(a, "Wrong types for set got %.*s and %.*s, expected VECTOR and INT",
+					fmt(type_str(arg0.type)), fmt(type_str(index.type))));
+	if (index.INT < 0 || index.INT >= arg0.VECTOR->len)
+		return error(str_fmt(a, "Out of bounds assignment: max index is %d, attempted to access %d", 
+					(arg0.VECTOR->len - 1), index.INT));
+	return (Element) { VECTOR, .VECTOR = elemvector(a, vec_set(arg0.VECTOR, index.INT, args->items[2])) };
+}
+
+// Items from begin up to end, both clamped to the array or string, without copying them
+priv Element builtin_slice(Arena *a, Namespace *ns, ElemArray *args)
+{
+	if (args->len != 3)
+		return error(str_fmt(a, "Wrong number of args for slice: got %lu, expected 3", args->len));
+	for (int i = 0; i < 3; i++)
+		if (args->items[i].type == ERR) return args->items[i];
+	Element arg0 = args->items[0], begin = args->items[1], end = args->items[2];
+	if ((arg0.type != ARRAY && arg0.type != STR) || begin.type != INT || end.type != INT)
+		return error(str_fmt(a, "Wrong types for slice got %.*s, %.*s and %.*s, expected ARRAY or STR and two INTs",
+					fmt(type_str(arg0.type)), fmt(type_str(begin.type)), fmt(type_str(end.type))));
+	i64 len = (arg0.type == ARRAY) ? arg0.ARRAY->len : arg0.len;
+	i64 to = MIN(MAX(end.INT, 0), len);
+	i64 from = MIN(MAX(begin.INT, 0), to);
+	if (arg0.type == STR)
+		return elem_from_str(STR, str_slice(elem_str(arg0), from, to));
+	return (Element) { ARRAY, .ARRAY = elemarray_slice(a, arg0.ARRAY, from, to) };
+}
+
+// Makes room for n items without changing the array
+priv Element builtin_reserve(Arena *a, Namespace *ns, ElemArray *args)
 {
 	if (args->len != 2)
-		return error(str_fmt(a, "Wrong number of args for push: got %lu, expected 2", args->len));
+		return error(str_fmt(a, "Wrong number of args for reserve: got %lu, expected 2", args->len));
 	Element arg0 = args->items[0];
 	if (arg0.type == ERR)
 		return arg0;
 	Element arg1 = args->items[1];
 	if (arg1.type == ERR)
 		return arg1;
-	if (arg0.type == LIST) {
-		elempush(arg0.LIST, arg1);
+	if (arg0.type != ARRAY || arg1.type != INT || arg1.INT < 0 || arg1.INT > UINT32_MAX)
+		return error(str_fmt(a, "Wrong type for reserve got %.*s and %.*s, expected ARRAY and a positive INT",
+					fmt(type_str(arg0.type)), fmt(type_str(arg1.type))));
+	elemarray_reserve(arg0.ARRAY, arg1.INT);
+	return arg0;
+}
+
+priv Element map_column(Arena *a, ElemArray *args, String name, bool keys)
+{
+	if (args->len != 1)
+		return error(str_fmt(a, "Wrong number of args for %.*s: got %lu, expected 1", fmt(name), args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
 		return arg0;
-	}
-	if (arg0.type == ARRAY) {
-		u32 a0_len = arg0.ARRAY->len;
-		ElemArray *res = elemarray(a, (a0_len + 1));
-		for (int i = 0; i < a0_len; i++)
-			res->items[i] = arg0.ARRAY->items[i];
-		res->items[a0_len] = arg1;
-		return (Element) { ARRAY, .ARRAY = res };
-	}
-	return error(str_fmt(a, "Wrong type for push got %.*s and %.*s",
-				fmt(type_str(arg0.type)), fmt(type_str(arg1.type))));
+	if (arg0.type != MAP)
+		return error(str_fmt(a, "Wrong type for %.*s got %.*s", fmt(name), fmt(type_str(arg0.type))));
+	ElemMap *m = arg0.MAP;
+	ElemArray *res = elemarray(a, m->len);
+	u32 j = 0;
+	for (u32 i = 0; i < m->used; i++)
+		if (m->entries[i].live)
+			res->items[j++] = (keys) ? m->entries[i].key : m->entries[i].value;
+	return (Element) { ARRAY, .ARRAY = res };
+}
+
+// Keys in insertion order
+priv Element builtin_keys(Arena *a, Namespace *ns, ElemArray *args)
+{
+	return map_column(a, args, str("keys"), true);
+}
+
+priv Element builtin_values(Arena *a, Namespace *ns, ElemArray *args)
+{
+	return map_column(a, args, str("values"), false);
+}
+
+priv Element map_key_arg(Arena *a, ElemArray *args, String name, u32 *key_hash)
+{
+	if (args->len != 2)
+		return error(str_fmt(a, "Wrong number of args for %.*s: got %lu, expected 2", fmt(name), args->len));
+	Element arg0 = args->items[0];
+	if (arg0.type == ERR)
+		return arg0;
+	Element arg1 = args->items[1];
+	if (arg1.type == ERR)
+		return arg1;
+	if (arg0.type != MAP)
+		return error(str_fmt(a, "Wrong type for %.*s got %.*s", fmt(name), fmt(type_str(arg0.type))));
+	if (!map_hash(arg1, key_hash))
+		return map_key_error(a, arg1);
+	return arg1;
+}
+
+priv Element builtin_has(Arena *a, Namespace *ns, ElemArray *args)
+{
+	u32 key_hash;
+	Element key = map_key_arg(a, args, str("has"), &key_hash);
+	if (key.type == ERR)
+		return key;
+	return (Element) { BOOL, .BOOL = (map_lookup(args->items[0].MAP, key, key_hash) != NULL) };
+}
+
+// Whether the key was there
+priv Element builtin_del(Arena *a, Namespace *ns, ElemArray *args)
+{
+	u32 key_hash;
+	Element key = map_key_arg(a, args, str("del"), &key_hash);
+	if (key.type == ERR)
+		return key;
+	MapEntry *entry = map_lookup(args->items[0].MAP, key, key_hash);
+	if (!entry)
+		return (Element) { BOOL, .BOOL = false };
+	entry->live = false;
+	args->items[0].MAP->len--;
+	return (Element) { BOOL, .BOOL = true };
 }
 
 priv Element builtin_type(Arena *a, Namespace *ns, ElemArray *args)
@@ -711,13 +2864,28 @@ priv Element builtin_type(Arena *a, Namespace *ns, ElemArray *args)
 	return (Element) { TYPE, .TYPE = args->items[0].type };
 }
 
+// To the running interpreter's output, stdout without one
+priv void output(String s)
+{
+	if (!running)
+		return str_print(s);
+	if (running->out_fd < 0)
+		return strpush(running->printed, str_dup(running->output, s));
+	for (u32 done = 0; done < s.len; ) {
+		i64 n = write(running->out_fd, s.buf + done, s.len - done);
+		if (n <= 0)
+			return ;
+		done += n;
+	}
+}
+
 priv Element builtin_print(Arena *a, Namespace *ns, ElemArray *args)
 {
 	u64	previous_offset = a->used;
 	for (int i = 0; i < args->len; i++)
-		str_print(to_string(a, args->items[i]));
+		output(to_string(a, args->items[i]));
 	arena_pop_to(a, previous_offset);
-	str_print(str("\n"));
+	output(str("\n"));
 	return (Element) { NIL };
 }
 
@@ -727,11 +2895,15 @@ priv Element builtin_len(Arena *a, Namespace *ns, ElemArray *args)
 		return error(str_fmt(a, "Wrong number of args for len: got %lu, expected 1", args->len));
 	Element arg0 = args->items[0];
 	if (arg0.type == STR)
-		return (Element) { INT, .INT = arg0.STR.len };
+		return (Element) { INT, .INT = arg0.len };
 	if (arg0.type == ARRAY)
 		return (Element) { INT, .INT = arg0.ARRAY->len };
 	if (arg0.type == LIST)
 		return (Element) { INT, .INT = arg0.LIST->len };
+	if (arg0.type == MAP)
+		return (Element) { INT, .INT = arg0.MAP->len };
+	if (arg0.type == VECTOR)
+		return (Element) { INT, .INT = arg0.VECTOR->len };
 	return error(str_fmt(a, "Type error: len called with argument of type: %.*s", fmt(type_str(arg0.type))));
 }
 
@@ -739,8 +2911,14 @@ priv Element builtin_len(Arena *a, Namespace *ns, ElemArray *args)
 priv Element *elem_alloc(Arena *a, Element elem)
 {
 	Element	*ptr = arena_alloc(a, sizeof(Element));
+	*ptr = elem_copy(a, elem);
+	return ptr;
+}
+
+priv Element elem_copy(Arena *a, Element elem)
+{
 	if (elem.type == STR || elem.type == ERR)
-		elem.STR = str_dup(a, elem.STR);
+		elem.STR = str_dup(a, elem_str(elem)).buf;
 	if (elem.type == RETURN)
 		elem.RETURN.value = elem_alloc(a, *elem.RETURN.value);
 	if (elem.type == LIST) {
@@ -749,23 +2927,40 @@ priv Element *elem_alloc(Arena *a, Element elem)
 	if (elem.type == ARRAY) {
 		elem.ARRAY = elemarray_copy(a, elem.ARRAY);
 	}
+	if (elem.type == MAP)
+		elem.MAP = elemmap_copy(a, elem.MAP);
+	if (elem.type == VECTOR) // Nodes are never freed, only the header needs to move
+		elem.VECTOR = elemvector(a, *elem.VECTOR);
 	if (elem.type == FUNCTION) {
-		elem.FUNCTION.params = astlist_copy(a, elem.FUNCTION.params);
-		elem.FUNCTION.body = astlist_copy(a, elem.FUNCTION.body);
-		elem.FUNCTION.namespace = ns_copy(a, elem.FUNCTION.namespace);
+		Function *fn = arena_alloc_zero(a, sizeof(Function));
+		fn->params = astlist_copy(a, elem.FUNCTION->params);
+		fn->body = (elem.FUNCTION->body) ? astlist_copy(a, elem.FUNCTION->body) : NULL;
+		fn->native = elem.FUNCTION->native;
+		fn->namespace = ns_copy(a, elem.FUNCTION->namespace);
+		elem.FUNCTION = fn;
 	}
-	*ptr = elem;
-	return ptr;
+	return elem;
 }
 
-priv Element elem_copy(Arena *a, Element elem)
+// Value to store in a binding or container living in arena a: immediates are kept as
+// they are and strings already in it are shared, since strings are never mutated.
+priv Element elem_store(Arena *a, Element elem)
 {
-	return (*elem_alloc(a, elem));
+	switch (elem.type) {
+		case NIL: case INT: case BOOL: case BUILTIN: case TYPE:
+			return elem;
+		case STR:
+			return arena_owns(a, elem.STR) ? elem : elem_copy(a, elem);
+		default:
+			return elem_copy(a, elem);
+	}
 }
 
 // STDOUT
 priv String array_to_string(Arena *a, ElemArray *arr);
 priv String list_to_string(Arena *a, ElemList *lst);
+priv String map_to_string(Arena *a, ElemMap *m);
+priv String vector_to_string(Arena *a, ElemVector *v);
 String	to_string(Arena *a, Element e)
 {
 	switch (e.type) {
@@ -776,17 +2971,21 @@ String	to_string(Arena *a, Element e)
 		case BOOL:
 			return (e.BOOL) ? str("true") : str("false");
 		case STR:
-			return str_fmt(a, "%.*s", fmt(e.STR));
+			return str_fmt(a, "%.*s", fmt(elem_str(e)));
 		case RETURN:
 			return to_string(a, (*e.RETURN.value));
 		case ARRAY:
 			return array_to_string(a, e.ARRAY);
 		case LIST:
 			return list_to_string(a, e.LIST);
+		case MAP:
+			return map_to_string(a, e.MAP);
+		case VECTOR:
+			return vector_to_string(a, e.VECTOR);
 		case FUNCTION:
-			return str_fmt(a, "fn(namespace: %p)", e.FUNCTION.namespace);
+			return str_fmt(a, "fn(namespace: %p)", e.FUNCTION->namespace);
 		case ERR:
-			return e.ERR;
+			return elem_str(e);
 		case BUILTIN:
 			return str("builtin fn");
 		case TYPE:
@@ -826,12 +3025,13 @@ priv String list_to_string(Arena *a, ElemList *lst)
 	char *buf = arena_alloc(a, 1);
 	buf[0] = '[';
 	u32 len = 1;
-	for (ElemNode *cursor = lst->head; cursor; cursor = cursor->next) {
-		String tmp = to_string(a, cursor->element);
+	ListIter it = elemlist_iter(lst);
+	for (Element *cursor; (cursor = elemlist_next(&it)); ) {
+		String tmp = to_string(a, *cursor);
 		arena_alloc(a, tmp.len);
 		memmove(buf + len, tmp.buf, tmp.len);
 		len += tmp.len;
-		if (cursor->next) {
+		if (it.left) {
 			tmp = str(", ");
 			arena_alloc(a, tmp.len);
 			memmove(buf + len, tmp.buf, tmp.len);
@@ -845,12 +3045,52 @@ priv String list_to_string(Arena *a, ElemList *lst)
 	return (String){ buf, len };
 }
 
+priv String map_to_string(Arena *a, ElemMap *m)
+{
+	char *buf = arena_alloc(a, 1);
+	buf[0] = '{';
+	u32 len = 1;
+	u32 left = m->len;
+	for (u32 i = 0; i < m->used; i++) {
+		if (!m->entries[i].live)
+			continue;
+		String parts[] = { to_string(a, m->entries[i].key), str(": "), 
+			to_string(a, m->entries[i].value), (--left) ? str(", ") : str("") };
+		for (int j = 0; j < arrlen(parts); j++) {
+			arena_alloc(a, parts[j].len);
+			memmove(buf + len, parts[j].buf, parts[j].len);
+			len += parts[j].len;
+		}
+	}
+	arena_alloc(a, 1);
+	buf[len++] = '}';
+	return (String){ buf, len };
+}
+
+priv String vector_to_string(Arena *a, ElemVector *v)
+{
+	char *buf = arena_alloc(a, 1);
+	buf[0] = '[';
+	u32 len = 1;
+	for (u32 i = 0; i < v->len; i++) {
+		String parts[] = { to_string(a, *elemvector_at(v, i)), (i + 1 < v->len) ? str(", ") : str("") };
+		for (int j = 0; j < arrlen(parts); j++) {
+			arena_alloc(a, parts[j].len);
+			memmove(buf + len, parts[j].buf, parts[j].len);
+			len += parts[j].len;
+		}
+	}
+	arena_alloc(a, 1);
+	buf[len++] = ']';
+	return (String){ buf, len };
+}
+
 String	type_str(ElementType type)
 {
 	String strings[] = { 
 		str("NIL"), str("ERR"), str("INT"), 
 		str("BOOL"), str("STR"), str("LIST"), str("ARRAY"),
-		str("RETURN"), str("FUNCTION"), str("BUILTIN"),
+		str("MAP"), str("VECTOR"), str("RETURN"), str("FUNCTION"), str("BUILTIN"),
 		str("TYPE")
 	};
 	if (NEVER(type < 0 || type >= arrlen(strings)))
@@ -859,34 +3099,89 @@ String	type_str(ElementType type)
 }
 
 // ~ELEMLIST
+#define LIST_NODE_MIN 4
+#define LIST_NODE_MAX 64
+
 priv ElemList *elemlist(Arena *a)
 {
-	ElemList *l = arena_alloc(a, sizeof(ElemList));
+	ElemList *l = arena_alloc_zero(a, sizeof(ElemList));
 	l->arena = a;
-	l->head = NULL;
-	l->len = 0;
 	return l;
 }
 
-priv void elempush(ElemList *l, Element el)
+priv ElemNode *elemnode(Arena *a, u32 cap)
 {
-	ElemNode *node = arena_alloc(l->arena, sizeof(ElemNode));
-	node->element = elem_copy(l->arena, el);
-	node->next = NULL;
-
-	if (NEVER(!l));
+	ElemNode *node = arena_alloc(a, sizeof(ElemNode) + cap * sizeof(Element));
+	*node = (ElemNode) { NULL, 0, cap };
+	return node;
+}
 
-	if (!l->head) {
-		l->head = node;
-		l->tail = node;
-		l->len++;
+priv void elemlist_append(ElemList *l, Element el);
+priv void elempush(ElemList *l, Element el)
+{
+	if (NEVER(!l))
 		return ;
+	elemlist_append(l, elem_copy(l->arena, el));
+}
+
+// Appends to the tail node while the list ends there. If another list sharing the node
+// appended past it or linked a node after it, the list takes a copy of its items first.
+priv void elemlist_append(ElemList *l, Element el)
+{
+	ElemNode *tail = l->tail;
+	if (tail && (l->tail_end != tail->len || (tail->next && tail->len == tail->cap)))
+		elemlist_unshare(l), tail = l->tail;
+	if (!tail || tail->len == tail->cap) {
+		ElemNode *node = elemnode(l->arena, (tail) ? MIN(tail->cap * 2, LIST_NODE_MAX) : LIST_NODE_MIN);
+		if (tail)
+			tail->next = node;
+		else
+			l->head = node, l->start = 0;
+		l->tail = tail = node;
 	}
-	l->tail->next = node;
-	l->tail = node;
+	tail->items[tail->len++] = el;
+	l->tail_end = tail->len;
 	l->len++;
 }
 
+priv void elemlist_unshare(ElemList *l)
+{
+	ElemList res = { l->arena };
+	ListIter it = elemlist_iter(l);
+	for (Element *cursor; (cursor = elemlist_next(&it)); )
+		elemlist_append(&res, *cursor);
+	*l = res;
+}
+
+// Sequential indexing resumes from the node the previous lookup landed in
+priv Element *elemlist_at(ElemList *l, u32 i)
+{
+	u32 pos = l->start + i, node_pos = 0;
+	ElemNode *node = l->head;
+	if (l->cursor && l->cursor_pos <= pos)
+		node = l->cursor, node_pos = l->cursor_pos;
+	while (pos >= node_pos + node->len)
+		node_pos += node->len, node = node->next;
+	if (!in_worker)
+		l->cursor = node, l->cursor_pos = node_pos;
+	return &node->items[pos - node_pos];
+}
+
+priv ListIter elemlist_iter(ElemList *l)
+{
+	return (ListIter) { l->head, l->start, l->len };
+}
+
+priv Element *elemlist_next(ListIter *it)
+{
+	if (!it->left)
+		return NULL;
+	while (it->at == it->node->len)
+		it->node = it->node->next, it->at = 0;
+	it->left--;
+	return &it->node->items[it->at++];
+}
+
 priv ElemList *elemlist_single(Arena *a, Element el)
 {
 	ElemList *lst = elemlist(a);
@@ -913,8 +3208,9 @@ priv ElemList *elemlist_from_ast(Arena *a, Namespace *ns, ASTList *lst)
 priv ElemList *elemlist_copy(Arena *a, ElemList *lst)
 {
 	ElemList *res = elemlist(a);
-	for (ElemNode *cursor = lst->head; cursor; cursor = cursor->next)
-		elempush(res, cursor->element);
+	ListIter it = elemlist_iter(lst);
+	for (Element *cursor; (cursor = elemlist_next(&it)); )
+		elempush(res, *cursor);
 	return res;
 }
 
@@ -924,24 +3220,65 @@ ElemArray *elemarray(Arena *a, u32 len)
 	ElemArray *arr = arena_alloc_zero(a, sizeof(ElemArray));
 	arr->items = arena_alloc(a, len * sizeof(Element));
 	arr->len = len;
+	arr->cap = len;
+	arr->arena = a;
 	return arr;
 }
 
+priv void elemarray_reserve(ElemArray *arr, u32 cap)
+{
+	if (cap <= arr->cap)
+		return ;
+	cap = MAX(cap, 4);
+	Element *items = arena_alloc(arr->arena, cap * sizeof(Element));
+	memcpy(items, arr->items, arr->len * sizeof(Element));
+	arr->items = items;
+	arr->cap = cap;
+	arr->shared = false;
+}
+
+priv ElemArray *elemarray_slice(Arena *a, ElemArray *arr, u32 begin, u32 end)
+{
+	ElemArray *res = arena_alloc_zero(a, sizeof(ElemArray));
+	*res = (ElemArray) { arr->items + begin, end - begin, end - begin, a, NULL, true };
+	arr->shared = true;
+	return res;
+}
+
+// Gives the array items of its own before writing to them
+priv void elemarray_unshare(ElemArray *arr)
+{
+	Element *items = arena_alloc(arr->arena, MAX(arr->cap, 1) * sizeof(Element));
+	memcpy(items, arr->items, arr->len * sizeof(Element));
+	arr->items = items;
+	arr->shared = false;
+}
+
+// Stored somewhere else than its binding: the binding can't update it in place anymore
+priv bool owns(Bind *b, ElemArray *arr)
+{
+	return arr->owner == b && !arr->lent;
+}
+
+priv Element disown(Element elem)
+{
+	if (elem.type == ARRAY)
+		elem.ARRAY->owner = NULL;
+	return elem;
+}
+
 
 priv ElemArray *elemarray_single(Arena *a, Element el);
 priv ElemArray *elemarray_from_ast(Arena *a, Namespace *ns, ASTList *lst)
 {
-	u64	previous_offset = a->used;
 	ElemArray *arr = elemarray(a, lst->len);
 
 	int	i = 0;
 	Element tmp = {0};
 	for (ASTNode *cursor = lst->head; cursor; cursor = cursor->next) {
 		tmp = eval(a, ns, cursor->ast);
-		if (tmp.type == ERR) {
-			arena_pop_to(a, previous_offset);
+		if (tmp.type == ERR) // Not popping arr: the message may have been allocated after it
 			return elemarray_single(a, tmp);
-		}
 		arr->items[i] = tmp;
 		i++;
 	}
@@ -955,23 +3292,315 @@ priv ElemArray *elemarray_single(Arena *a, Element el)
 	return arr;
 }
 
+// Keeps the capacity, so a reserved array bound with var still pushes without moving
 priv ElemArray *elemarray_copy(Arena *a, ElemArray *arr)
 {
-	ElemArray *res = elemarray(a, arr->len);
+	ElemArray *res = elemarray(a, MAX(arr->len, arr->cap));
+	res->len = arr->len;
 	for (int i = 0; i < arr->len; i++)
 		res->items[i] = elem_copy(a, arr->items[i]);
 	return res;
 }
 
+// ~ELEMMAP
+// Keys are INT, BOOL or STR. Their hash is stored next to them, so probes and grows
+// compare and rehash without touching the keys' contents.
+priv ElemMap *elemmap(Arena *a, u32 len) // len: expected entries
+{
+	u32 cap = 8;
+	while (cap * 3 < len * 4) cap *= 2;
+	ElemMap *m = arena_alloc_zero(a, sizeof(ElemMap));
+	m->arena = a;
+	m->cap = cap;
+	m->slots = arena_alloc_zero(a, sizeof(u32) * cap);
+	m->entries = arena_alloc(a, sizeof(MapEntry) * (cap / 4 * 3));
+	return m;
+}
+
+priv bool map_hash(Element key, u32 *res)
+{
+	switch (key.type) {
+		case STR:
+			*res = hash(elem_str(key));
+			return true;
+		case INT: // Fibonacci hashing, the top bits mix in every bit of the key
+			*res = (u32)(((u64)key.INT * 11400714819323198485llu) >> 32);
+			return true;
+		case BOOL:
+			*res = key.BOOL;
+			return true;
+		default:
+			return false;
+	}
+}
+
+priv Element map_key_error(Arena *a, Element key)
+{
+	return error(str_fmt(a, "Can't use %.*s as a MAP key", fmt(type_str(key.type))));
+}
+
+priv bool map_key_eq(Element key, Element other)
+{
+	if (key.type != other.type)
+		return false;
+	if (key.type == STR)
+		return str_eq(elem_str(key), elem_str(other));
+	return (key.type == INT) ? key.INT == other.INT : key.BOOL == other.BOOL;
+}
+
+// Deleted entries are skipped, but keep their slot so probes go on past them
+priv MapEntry *map_lookup(ElemMap *m, Element key, u32 key_hash)
+{
+	u32 mask = m->cap - 1;
+	for (u32 i = key_hash & mask; m->slots[i]; i = (i + 1) & mask) {
+		MapEntry *entry = &m->entries[m->slots[i] - 1];
+		if (entry->hash == key_hash && entry->live && map_key_eq(entry->key, key))
+			return entry;
+	}
+	return NULL;
+}
+
+priv void map_append(ElemMap *m, MapEntry entry)
+{
+	u32 mask = m->cap - 1;
+	u32 i = entry.hash & mask;
+	while (m->slots[i])
+		i = (i + 1) & mask;
+	m->entries[m->used] = entry;
+	m->slots[i] = ++m->used;
+	m->len++;
+}
+
+// Rebuilds the table without the deleted entries
+priv void map_grow(ElemMap *m, u32 cap)
+{
+	MapEntry *old = m->entries;
+	u32 used = m->used;
+	m->cap = cap;
+	m->slots = arena_alloc_zero(m->arena, sizeof(u32) * cap);
+	m->entries = arena_alloc(m->arena, sizeof(MapEntry) * (cap / 4 * 3));
+	m->used = m->len = 0;
+	for (u32 i = 0; i < used; i++)
+		if (old[i].live) map_append(m, old[i]);
+}
+
+priv void map_set(ElemMap *m, Element key, u32 key_hash, Element value)
+{
+	MapEntry *entry = map_lookup(m, key, key_hash);
+	if (entry) {
+		entry->value = elem_store(m->arena, value);
+		return ;
+	}
+	if (m->used == m->cap / 4 * 3) // Same size when mostly deleted entries
+		map_grow(m, (m->len * 2 >= m->used) ? m->cap * 2 : m->cap);
+	map_append(m, (MapEntry) { elem_store(m->arena, key), elem_store(m->arena, value), key_hash, true });
+}
+
+// Later keys win over earlier duplicates
+priv Element map_from_items(Arena *a, Element *items, u32 len)
+{
+	ElemMap *m = elemmap(a, len);
+	for (u32 i = 0; i < len; i++) {
+		u32 key_hash;
+		if (!map_hash(items[i * 2], &key_hash))
+			return map_key_error(a, items[i * 2]);
+		map_set(m, items[i * 2], key_hash, items[i * 2 + 1]);
+	}
+	return (Element) { MAP, .MAP = m };
+}
+
+priv ElemMap *elemmap_copy(Arena *a, ElemMap *m)
+{
+	ElemMap *res = elemmap(a, m->len);
+	for (u32 i = 0; i < m->used; i++) {
+		MapEntry entry = m->entries[i];
+		if (entry.live)
+			map_append(res, (MapEntry) { elem_copy(a, entry.key), elem_copy(a, entry.value), entry.hash, true });
+	}
+	return res;
+}
+
+// ~ELEMVECTOR
+thread_global Arena *vector_heap = NULL; // Nodes of every vector version, kept for the whole run
+
+priv Arena *vec_heap(void)
+{
+	if (running && running->in_run)
+		return running->run;
+	if (running) {
+		if (!running->vectors)
+			running->vectors = arena(GB(16));
+		return running->vectors;
+	}
+	if (!vector_heap)
+		vector_heap = arena(GB(16));
+	return vector_heap;
+}
+
+priv VecNode *vecnode(VecNode *from)
+{
+	VecNode *node = arena_alloc(vec_heap(), sizeof(VecNode));
+	if (from)
+		*node = *from;
+	else
+		memset(node, 0, sizeof(VecNode));
+	return node;
+}
+
+priv ElemVector *elemvector(Arena *a, ElemVector v)
+{
+	ElemVector *res = arena_alloc(a, sizeof(ElemVector));
+	*res = v;
+	return res;
+}
+
+// Index of the first item in the tail
+priv u32 vec_tailoff(u32 len)
+{
+	return (len == 0) ? 0 : ((len - 1) >> VEC_BITS) << VEC_BITS;
+}
+
+priv VecNode *vec_leaf(ElemVector *v, u32 i)
+{
+	if (i >= vec_tailoff(v->len))
+		return v->tail;
+	VecNode *node = v->root;
+	for (u32 level = v->shift; level > 0; level -= VEC_BITS)
+		node = node->kids[(i >> level) & (VEC_WIDTH - 1)];
+	return node;
+}
+
+Element *elemvector_at(ElemVector *v, u32 i)
+{
+	return &vec_leaf(v, i)->items[i & (VEC_WIDTH - 1)];
+}
+
+priv VecNode *vec_path(u32 level, VecNode *leaf)
+{
+	if (level == 0)
+		return leaf;
+	VecNode *node = vecnode(NULL);
+	node->kids[0] = vec_path(level - VEC_BITS, leaf);
+	return node;
+}
+
+// Copies the path to the slot after the last full leaf of a vector of len items
+priv VecNode *vec_push_leaf(u32 len, u32 level, VecNode *parent, VecNode *leaf)
+{
+	VecNode *node = vecnode(parent);
+	u32 at = ((len - 1) >> level) & (VEC_WIDTH - 1);
+	if (level == VEC_BITS)
+		node->kids[at] = leaf;
+	else if (parent && parent->kids[at])
+		node->kids[at] = vec_push_leaf(len, level - VEC_BITS, parent->kids[at], leaf);
+	else
+		node->kids[at] = vec_path(level - VEC_BITS, leaf);
+	return node;
+}
+
+// Takes the slot after the tail's last item for a version of length tail_len, atomically
+// in pmap workers, where versions sharing the tail can be pushed to at the same time
+priv bool vec_claim(VecNode *tail, u32 tail_len)
+{
+	if (!in_worker)
+		return tail->len == tail_len;
+	u32 expected = tail_len;
+	return __atomic_compare_exchange_n(&tail->len, &expected, tail_len + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Appends to the tail in place unless another version already wrote past its end.
+// A full tail moves into the trie, which grows a level once the root is full.
+priv ElemVector vec_push(ElemVector *v, Element el)
+{
+	el = elem_store(vec_heap(), disown(el));
+	u32 tail_len = v->len - vec_tailoff(v->len);
+	if (v->len && tail_len < VEC_WIDTH) {
+		VecNode *tail = v->tail;
+		if (!vec_claim(tail, tail_len))
+			tail = vecnode(tail);
+		tail->items[tail_len] = el;
+		tail->len = tail_len + 1;
+		return (ElemVector) { v->root, tail, v->len + 1, v->shift };
+	}
+	VecNode *tail = vecnode(NULL);
+	tail->items[0] = el;
+	tail->len = 1;
+	if (!v->len)
+		return (ElemVector) { NULL, tail, 1, VEC_BITS };
+	if ((v->len >> VEC_BITS) > (1u << v->shift)) {
+		VecNode *root = vecnode(NULL);
+		root->kids[0] = v->root;
+		root->kids[1] = vec_path(v->shift, v->tail);
+		return (ElemVector) { root, tail, v->len + 1, v->shift + VEC_BITS };
+	}
+	return (ElemVector) { vec_push_leaf(v->len, v->shift, v->root, v->tail), tail, v->len + 1, v->shift };
+}
+
+// Copies the path to the last full leaf, without it. NULL when nothing is left below
+priv VecNode *vec_pop_leaf(u32 len, u32 level, VecNode *node)
+{
+	u32 at = ((len - 2) >> level) & (VEC_WIDTH - 1);
+	VecNode *kid = (level > VEC_BITS) ? vec_pop_leaf(len, level - VEC_BITS, node->kids[at]) : NULL;
+	if (!kid && at == 0)
+		return NULL;
+	VecNode *res = vecnode(node);
+	res->kids[at] = kid;
+	return res;
+}
+
+// The last full leaf becomes the tail when the tail empties
+priv ElemVector vec_pop(ElemVector *v)
+{
+	if (v->len <= 1)
+		return (ElemVector) { NULL, NULL, 0, VEC_BITS };
+	if (v->len - vec_tailoff(v->len) > 1)
+		return (ElemVector) { v->root, v->tail, v->len - 1, v->shift };
+	ElemVector res = { vec_pop_leaf(v->len, v->shift, v->root), vec_leaf(v, v->len - 2), v->len - 1, v->shift };
+	if (res.shift > VEC_BITS && res.root && !res.root->kids[1])
+		res.root = res.root->kids[0], res.shift -= VEC_BITS;
+	return res;
+}
+
+priv VecNode *vec_assoc(u32 level, VecNode *node, u32 i, Element el)
+{
+	VecNode *res = vecnode(node);
+	if (level == 0)
+		res->items[i & (VEC_WIDTH - 1)] = el;
+	else {
+		u32 at = (i >> level) & (VEC_WIDTH - 1);
+		res->kids[at] = vec_assoc(level - VEC_BITS, node->kids[at], i, el);
+	}
+	return res;
+}
+
+priv ElemVector vec_set(ElemVector *v, u32 i, Element el)
+{
+	el = elem_store(vec_heap(), disown(el));
+	if (i < vec_tailoff(v->len))
+		return (ElemVector) { vec_assoc(v->shift, v->root, i, el), v->tail, v->len, v->shift };
+	VecNode *tail = vecnode(v->tail);
+	tail->items[i & (VEC_WIDTH - 1)] = el;
+	tail->len = v->len - vec_tailoff(v->len);
+	return (ElemVector) { v->root, tail, v->len, v->shift };
+}
+
 // ~NAMESPACE
-Namespace *ns_create(Arena *a, u32 cap)
+priv void ns_grow(Namespace *ns, u32 cap);
+Namespace *ns_create(Arena *a, u32 cap) // cap: expected bindings
 {
 	Namespace *ns = arena_alloc(a, sizeof(Namespace));
 	ns->arena = a;
 	ns->len = 0;
-	ns->cap = cap;
-	ns->values = arena_alloc_zero(a, sizeof(Bind *) * ns->cap);
+	ns->cap = 0;
+	ns->slots = NULL;
 	ns->parent = NULL;
+	ns->serial = (running) ? ++running->ns_serial : ++ns_serial;
+	ns->names = 0;
+	if (cap > NS_INLINE) {
+		u32 slots = NS_INLINE * 4;
+		while (slots * 3 < cap * 4) slots *= 2;
+		ns_grow(ns, slots);
+	}
 	return ns;
 }
 
@@ -994,88 +3623,159 @@ priv u32 hash(String key) // FNV hash
 	return hash;
 }
 
-priv Bind *bind_alloc(Arena *a, String key, Element el, bool is_mutable)
+priv void ns_slot_insert(Namespace *ns, Bind *b)
 {
-	Bind *b = arena_alloc(a, sizeof(Bind));
-	b->key = str_dup(a, key);
-	b->element = el;
-	b->mutable = is_mutable;
-	b->next = NULL;
-	return b;
+	u32 mask = ns->cap - 1;
+	u32 i = b->hash & mask;
+	while (ns->slots[i].bind)
+		i = (i + 1) & mask;
+	ns->slots[i] = (NsSlot) { b->hash, b };
 }
 
-priv int ns_put(Namespace *ns, String key, Element elem, bool is_mutable)
+priv void ns_grow(Namespace *ns, u32 cap)
 {
-	u32 id = hash(key) % ns->cap;
-	for (Bind *b = ns->values[id]; b; b = b->next) {
-		if (str_eq(key, b->key)) { // if key used, update
-			if (is_mutable) {
-				b->element = elem;
-				return 1;
-			}
-			else
-				return -1; // found an immutable binding
-		}
+	NsSlot *old = ns->slots;
+	u32 old_cap = ns->cap;
+	ns->slots = arena_alloc_zero(ns->arena, sizeof(NsSlot) * cap);
+	ns->cap = cap;
+	if (!old) {
+		for (u32 i = 0; i < ns->len; i++)
+			ns_slot_insert(ns, &ns->binds[i]);
+		return ;
+	}
+	for (u32 i = 0; i < old_cap; i++)
+		if (old[i].bind) ns_slot_insert(ns, old[i].bind);
+}
+
+priv Bind *ns_lookup(Namespace *ns, String key, u32 key_hash)
+{
+	if (!ns->cap) {
+		for (u32 i = 0; i < ns->len; i++)
+			if (ns->binds[i].hash == key_hash && str_eq(key, ns->binds[i].key))
+				return &ns->binds[i];
+		return NULL;
+	}
+	u32 mask = ns->cap - 1;
+	for (u32 i = key_hash & mask; ns->slots[i].bind; i = (i + 1) & mask)
+		if (ns->slots[i].hash == key_hash && str_eq(key, ns->slots[i].bind->key))
+			return ns->slots[i].bind;
+	return NULL;
+}
+
+// Keys are copied unless the caller guarantees they outlive the namespace
+priv int ns_set(Namespace *ns, String key, u32 key_hash, Element elem, bool is_mutable, bool copy_key)
+{
+	disown(elem);
+	Bind *b = ns_lookup(ns, key, key_hash);
+	if (b) { // if key used, update
+		if (!is_mutable)
+			return -1; // found an immutable binding
+		b->element = elem;
+		b->reusable = false;
+		return 1;
 	}
-	Bind *b = bind_alloc(ns->arena, key, elem, is_mutable);
-	b->next = ns->values[id];
-	ns->values[id] = b;
+	if ((ns->cap) ? (ns->len + 1) * 4 > ns->cap * 3 : ns->len == NS_INLINE)
+		ns_grow(ns, (ns->cap) ? ns->cap * 2 : NS_INLINE * 4);
+	ns->names |= NS_NAME_BIT(key_hash);
+	b = (ns->len < NS_INLINE) ? &ns->binds[ns->len] : arena_alloc(ns->arena, sizeof(Bind));
+	*b = (Bind) { (copy_key) ? str_dup(ns->arena, key) : key, elem, key_hash, is_mutable };
+	if (ns->cap)
+		ns_slot_insert(ns, b);
 	ns->len++;
 	return 1;
 }
 
-priv Bind *ns_get_inner(Namespace *ns, String key)
+priv int ns_put(Namespace *ns, String key, Element elem, bool is_mutable)
+{
+	return ns_set(ns, key, hash(key), elem, is_mutable, true);
+}
+
+Bind *ns_get_inner(Namespace *ns, String key)
 {
-	u32 id = hash(key) % ns->cap;
-	for (Bind *tmp = ns->values[id]; tmp; tmp = tmp->next)
-		if (str_eq(key, tmp->key))
-			return tmp;
+	return ns_lookup(ns, key, hash(key));
+}
+
+priv Bind *ns_find(Namespace *ns, String key, u32 key_hash, Namespace **owner)
+{
+	for (; ns; ns = ns->parent) {
+		Bind *res = ns_lookup(ns, key, key_hash);
+		if (res)
+			return (*owner = ns, res);
+	}
 	return NULL;
 }
 
-priv Bind *ns_get(Namespace *ns, String key)
+// Reading a binding hands its element out, after which the buffer may be seen elsewhere.
+// Only the first read writes, atomically: pmap's workers read the same bindings.
+priv Element bind_read(Bind *b)
 {
-	Bind *res = ns_get_inner(ns, key);
-	if (!res && ns->parent) res = ns_get(ns->parent, key);
-	return res;
+	if (__atomic_load_n(&b->reusable, __ATOMIC_RELAXED))
+		__atomic_store_n(&b->reusable, false, __ATOMIC_RELAXED);
+	return b->element;
 }
 
-priv int ns_update(Namespace *ns, String key, Element elem) // XXX Build a more granular allocator for namespaces (it currently "leaks")
+// Copies a string into the binding's own buffer, which keeps its capacity in front of it
+priv void bind_store_str(Arena *a, Bind *b, Element elem)
 {
-	// Updates first hit of binding in the namespace it's found - Assumes it's been confirmed to exist as MUTABLE before
-	Bind *target = ns_get_inner(ns, key);
-	if (!target) {
-		if (ns->parent)
-			return ns_update(ns->parent, key, elem);
-		else
-			return 0;
+	if (b->reusable && b->element.type == STR && ((u64 *)b->element.STR)[-1] >= elem.len) {
+		memcpy(b->element.STR, elem.STR, elem.len);
+		b->element.len = elem.len;
+		return ;
 	}
+	u64 *buf = arena_alloc(a, sizeof(u64) + elem.len);
+	*buf = elem.len;
+	memcpy(buf + 1, elem.STR, elem.len);
+	b->element = elem;
+	b->element.STR = (char *)(buf + 1);
+	b->reusable = true;
+}
+
+// Copies the items over the array the binding owns, when they fit and no slice sees them
+priv bool bind_store_array(Bind *b, Element elem)
+{
+	ElemArray *arr = b->element.ARRAY;
+	if (b->element.type != ARRAY || !owns(b, arr) || arr->shared || arr == elem.ARRAY || arr->cap < elem.ARRAY->len)
+		return false;
+	for (u32 i = 0; i < elem.ARRAY->len; i++)
+		arr->items[i] = elem_copy(arr->arena, elem.ARRAY->items[i]);
+	arr->len = elem.ARRAY->len;
+	return true;
+}
+
+// Immediates are overwritten in place. A string goes into a buffer of the binding's own,
+// reused by the next assignment unless the binding was read since; one already in the
+// namespace's arena is shared instead when there is no such buffer. The binding owns its
+// copy of an array until it's stored anywhere else, and the next array assigned reuses
+// its items. Other values are copied to the namespace's arena and the old copy is left
+// behind: other bindings or containers may point to it.
+priv void ns_update(Namespace *ns, Bind *target, Element elem)
+{
 	if (NEVER(!target->mutable))
-		return 0;
-	target->element = elem_copy(ns->arena, elem);
-	return 1;
+		return ;
+	if (elem.type == target->element.type && (elem.type == LIST || elem.type == MAP)
+			&& elem.LIST == target->element.LIST) // Updated in place, like push on a LIST
+		return ;
+	if (elem.type == STR && (target->reusable || !arena_owns(ns->arena, elem.STR)))
+		return bind_store_str(ns->arena, target, elem);
+	if (elem.type == ARRAY && bind_store_array(target, elem))
+		return ;
+	target->reusable = false;
+	target->element = elem_store(ns->arena, elem);
+	if (elem.type == ARRAY)
+		target->element.ARRAY->owner = target;
 }
 
 priv Namespace *ns_copy(Arena *a, Namespace *ns)
 {
-	Namespace *res = ns_create(a, ns->cap);
-	for (int i = 0; i < ns->cap; i++) {
-		if (ns->values[i]) {
-			res->values[i] =
-			    bind_alloc(res->arena, ns->values[i]->key,
-				       ns->values[i]->element, ns->values[i]->mutable);
-			res->len++;
-			if (ns->values[i]->next) {
-				for (Bind *ns_cursor = ns->values[i]->next;
-				     ns_cursor; ns_cursor = ns_cursor->next) {
-					Bind *p = bind_alloc(a, ns_cursor->key,
-							     ns_cursor->element, ns_cursor->mutable);
-					p->next = res->values[i];
-					res->values[i] = p;
-					res->len++;
-				}
-			}
-		}
+	Namespace *res = ns_create(a, ns->len);
+	if (!ns->cap) {
+		for (u32 i = 0; i < ns->len; i++)
+			ns_set(res, ns->binds[i].key, ns->binds[i].hash, bind_read(&ns->binds[i]), ns->binds[i].mutable, true);
+		return res;
+	}
+	for (u32 i = 0; i < ns->cap; i++) {
+		Bind *b = ns->slots[i].bind;
+		if (b) ns_set(res, b->key, b->hash, bind_read(b), b->mutable, true);
 	}
 	return res;
 }
@@ -14,12 +14,12 @@ priv ElemArray *elemarray_from_list(Arena *a, Namespace *ns, ElemList *lst)
 {
 	u64 previous_offset = a->used;
 	ElemArray *arr = elemarray(a, lst->len);
-	ElemNode *tmp = lst->head;
+	ListIter it = elemlist_iter(lst);
 	for (int i = 0; i < arr->len; i++) {
+		Element *tmp = elemlist_next(&it);
 		if (NEVER(!tmp))
 			return (arena_pop_to(a, previous_offset), elemarray_single(a, error(str("Error copying list to array"))));
-		arr->items[i] = elem_copy(a, tmp->element);
-		tmp = tmp->next;
+		arr->items[i] = elem_copy(a, *tmp);
 	}
 	return arr;
 }
@@ -0,0 +1,417 @@
+#include "base.h"
+#include "toyscript.h"
+#include <sys/mman.h>
+
+// Baseline template JIT: pure functions over INT parameters whose bodies only use
+// literals, arithmetic, comparisons, if/else, return and calls to themselves are
+// compiled to x86-64, one fixed machine code template per AST node, keeping every
+// value in rax and spilling operands to the native stack.
+#define JIT_CODE_MAX KB(64)
+#define JIT_FIXUPS_MAX 512
+#define JIT_PARAMS_MAX 6
+
+typedef enum JitType { JIT_NIL, JIT_NEVER, JIT_INT, JIT_BOOL } JitType;
+typedef i64 (*JitEntry)(i64, i64, i64, i64, i64, i64);
+
+struct JitFunction {
+	JitEntry	entry;
+	JitType		result;
+	u32			params;
+	u64			size;
+	JitState	*state;
+	Function	*fn;
+	JitFunction	*next; // Compiled before, for jit_free and jit_rewind
+};
+
+typedef struct Emitter {
+	u8			*code;
+	u32			len;
+	Function	*fn;
+	JitState	*state;
+	JitType		result;
+	bool		failed;
+	u32			returns[JIT_FIXUPS_MAX];
+	u32			returns_len;
+	u32			calls[JIT_FIXUPS_MAX];
+	u32			calls_len;
+} Emitter;
+
+Bind *ns_get_inner(Namespace *ns, String key);
+
+#if defined(__x86_64__)
+priv JitType emit_expr(Emitter *e, AST *node);
+priv JitType emit_block(Emitter *e, ASTList *block);
+
+priv void emit(Emitter *e, u8 *bytes, u32 len)
+{
+	if (e->len + len > JIT_CODE_MAX) {
+		e->failed = true;
+		return ;
+	}
+	memcpy(e->code + e->len, bytes, len);
+	e->len += len;
+}
+#define EMIT(e, ...) emit(e, (u8[]) { __VA_ARGS__ }, sizeof((u8[]) { __VA_ARGS__ }))
+
+priv JitType unsupported(Emitter *e)
+{
+	e->failed = true;
+	return JIT_NIL;
+}
+
+priv void emit_imm64(Emitter *e, u64 imm)
+{
+	emit(e, (u8 *)&imm, sizeof(imm));
+}
+
+priv void emit_rel32(Emitter *e, u32 target)
+{
+	i32 rel = (i32)target - (i32)(e->len + 4);
+	emit(e, (u8 *)&rel, sizeof(rel));
+}
+
+priv void patch_rel32(Emitter *e, u32 at, u32 target)
+{
+	i32 rel = (i32)target - (i32)(at + 4);
+	memcpy(e->code + at, &rel, sizeof(rel));
+}
+
+priv void fixup(Emitter *e, u32 *list, u32 *len)
+{
+	if (*len >= JIT_FIXUPS_MAX) {
+		e->failed = true;
+		return ;
+	}
+	list[(*len)++] = e->len;
+}
+
+priv i32 param_slot(Emitter *e, String name)
+{
+	i32 i = 0;
+	for (ASTNode *tmp = e->fn->params->head; tmp; tmp = tmp->next, i++)
+		if (str_eq(tmp->ast->AST_STR, name)) return i;
+	return -1;
+}
+
+priv bool is_self(Emitter *e, AST *callee)
+{
+	if (callee->type != AST_IDENT || param_slot(e, callee->AST_STR) >= 0)
+		return false;
+	Bind *b = ns_get_inner(e->fn->namespace, callee->AST_STR);
+	return (b && !b->mutable && b->element.type == FUNCTION && b->element.FUNCTION == e->fn);
+}
+
+// Division by zero leaves the native code so the interpreter reports it
+priv void emit_bail_if_zero(Emitter *e)
+{
+	EMIT(e, 0x48, 0x85, 0xc9); // test rcx, rcx
+	EMIT(e, 0x0f, 0x85); // jnz divide
+	u32 to_divide = e->len;
+	emit_rel32(e, 0);
+	EMIT(e, 0x48, 0xba); // mov rdx, &bail
+	emit_imm64(e, (u64)&e->state->bail);
+	EMIT(e, 0xc6, 0x02, 0x01); // mov byte [rdx], 1
+	EMIT(e, 0xe9); // jmp epilogue
+	fixup(e, e->returns, &e->returns_len);
+	emit_rel32(e, 0);
+	patch_rel32(e, to_divide, e->len);
+}
+
+priv JitType emit_call(Emitter *e, struct AST_CALL call)
+{
+	if (!is_self(e, call.function) || call.args->len != e->fn->params->len)
+		return unsupported(e);
+	for (ASTNode *tmp = call.args->head; tmp; tmp = tmp->next) {
+		if (emit_expr(e, tmp->ast) != JIT_INT) return unsupported(e);
+		EMIT(e, 0x50); // push rax
+	}
+	u8 pops[][2] = { {0x5f}, {0x5e}, {0x5a}, {0x59}, {0x41, 0x58}, {0x41, 0x59} };
+	for (i32 i = call.args->len - 1; i >= 0; i--)
+		emit(e, pops[i], (pops[i][0] == 0x41) ? 2 : 1); // pop rdi, rsi, rdx, rcx, r8, r9
+	EMIT(e, 0x48, 0xb8); // mov rax, entry
+	fixup(e, e->calls, &e->calls_len);
+	emit_imm64(e, 0);
+	EMIT(e, 0xff, 0xd0); // call rax
+	EMIT(e, 0x48, 0xb9); // mov rcx, &bail
+	emit_imm64(e, (u64)&e->state->bail);
+	EMIT(e, 0x80, 0x39, 0x00); // cmp byte [rcx], 0
+	EMIT(e, 0x0f, 0x85); // jne epilogue
+	fixup(e, e->returns, &e->returns_len);
+	emit_rel32(e, 0);
+	return e->result;
+}
+
+priv JitType emit_infix(Emitter *e, struct AST_INFIX infix)
+{
+	JitType left = emit_expr(e, infix.left);
+	EMIT(e, 0x50); // push rax
+	JitType right = emit_expr(e, infix.right);
+	EMIT(e, 0x48, 0x89, 0xc1); // mov rcx, rax
+	EMIT(e, 0x58); // pop rax
+	if (left != right || (left != JIT_INT && left != JIT_BOOL))
+		return unsupported(e);
+	String op = infix.op;
+	if (str_eq(op, str("==")) || str_eq(op, str("!="))) {
+		EMIT(e, 0x48, 0x39, 0xc8); // cmp rax, rcx
+		EMIT(e, 0x0f, str_eq(op, str("==")) ? 0x94 : 0x95, 0xc0); // sete/setne al
+		EMIT(e, 0x0f, 0xb6, 0xc0); // movzx eax, al
+		return JIT_BOOL;
+	}
+	if (left != JIT_INT)
+		return unsupported(e);
+	if (str_eq(op, str("<")) || str_eq(op, str(">"))) {
+		EMIT(e, 0x48, 0x39, 0xc8); // cmp rax, rcx
+		EMIT(e, 0x0f, str_eq(op, str("<")) ? 0x9c : 0x9f, 0xc0); // setl/setg al
+		EMIT(e, 0x0f, 0xb6, 0xc0); // movzx eax, al
+		return JIT_BOOL;
+	}
+	if (str_eq(op, str("+")))
+		EMIT(e, 0x48, 0x01, 0xc8); // add rax, rcx
+	else if (str_eq(op, str("-")))
+		EMIT(e, 0x48, 0x29, 0xc8); // sub rax, rcx
+	else if (str_eq(op, str("*")))
+		EMIT(e, 0x48, 0x0f, 0xaf, 0xc1); // imul rax, rcx
+	else if (str_eq(op, str("/")) || str_eq(op, str("%"))) {
+		emit_bail_if_zero(e);
+		EMIT(e, 0x48, 0x99, 0x48, 0xf7, 0xf9); // cqo; idiv rcx
+		if (str_eq(op, str("%")))
+			EMIT(e, 0x48, 0x89, 0xd0); // mov rax, rdx
+	} else
+		return unsupported(e);
+	return JIT_INT;
+}
+
+priv JitType emit_cond(Emitter *e, struct AST_COND cond)
+{
+	JitType condition = emit_expr(e, cond.condition);
+	if (condition != JIT_INT && condition != JIT_BOOL)
+		return unsupported(e);
+	EMIT(e, 0x48, 0x85, 0xc0); // test rax, rax
+	EMIT(e, 0x0f, 0x84); // jz alternative
+	u32 to_alternative = e->len;
+	emit_rel32(e, 0);
+	JitType consequence = emit_block(e, cond.consequence);
+	EMIT(e, 0xe9); // jmp end
+	u32 to_end = e->len;
+	emit_rel32(e, 0);
+	patch_rel32(e, to_alternative, e->len);
+	JitType alternative = (cond.alternative) ? emit_block(e, cond.alternative) : JIT_NIL;
+	patch_rel32(e, to_end, e->len);
+	if (consequence == JIT_NEVER) return alternative;
+	if (alternative == JIT_NEVER) return consequence;
+	return (consequence == alternative) ? consequence : JIT_NIL;
+}
+
+priv JitType emit_expr(Emitter *e, AST *node)
+{
+	if (e->failed) return JIT_NIL;
+	switch (node->type) {
+		case AST_INT:
+			EMIT(e, 0x48, 0xb8); // mov rax, imm64
+			emit_imm64(e, (u64)node->AST_INT.value);
+			return JIT_INT;
+		case AST_BOOL:
+			EMIT(e, 0x48, 0xb8); // mov rax, imm64
+			emit_imm64(e, node->AST_BOOL.value);
+			return JIT_BOOL;
+		case AST_IDENT: {
+			i32 slot = param_slot(e, node->AST_STR);
+			if (slot < 0) return unsupported(e);
+			EMIT(e, 0x48, 0x8b, 0x45, (u8)(-8 * (slot + 1))); // mov rax, [rbp - 8 * (slot + 1)]
+			return JIT_INT;
+		}
+		case AST_PREFIX: {
+			JitType right = emit_expr(e, node->AST_PREFIX.right);
+			if (str_eq(node->AST_PREFIX.op, str("-")) && right == JIT_INT) {
+				EMIT(e, 0x48, 0xf7, 0xd8); // neg rax
+				return JIT_INT;
+			}
+			if (str_eq(node->AST_PREFIX.op, str("!")) && (right == JIT_INT || right == JIT_BOOL)) {
+				EMIT(e, 0x48, 0x85, 0xc0, 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0); // test rax, rax; sete al; movzx eax, al
+				return JIT_BOOL;
+			}
+			return unsupported(e);
+		}
+		case AST_INFIX:
+			return emit_infix(e, node->AST_INFIX);
+		case AST_COND:
+			return emit_cond(e, node->AST_COND);
+		case AST_CALL:
+			return emit_call(e, node->AST_CALL);
+		case AST_RETURN: {
+			JitType value = emit_expr(e, node->AST_RETURN.value);
+			if (value != e->result) return unsupported(e);
+			EMIT(e, 0xe9); // jmp epilogue
+			fixup(e, e->returns, &e->returns_len);
+			emit_rel32(e, 0);
+			return JIT_NEVER;
+		}
+		default:
+			return unsupported(e);
+	}
+}
+
+priv JitType emit_block(Emitter *e, ASTList *block)
+{
+	JitType res = JIT_NIL;
+	for (ASTNode *tmp = block->head; tmp; tmp = tmp->next) {
+		res = emit_expr(e, tmp->ast);
+		if (e->failed || res == JIT_NEVER) return res;
+	}
+	return res;
+}
+
+priv bool emit_function(Emitter *e)
+{
+	EMIT(e, 0x55, 0x48, 0x89, 0xe5); // push rbp; mov rbp, rsp
+	EMIT(e, 0x48, 0x83, 0xec, (u8)(8 * JIT_PARAMS_MAX)); // sub rsp, 8 * JIT_PARAMS_MAX
+	u8 stores[][4] = {
+		{0x48, 0x89, 0x7d}, {0x48, 0x89, 0x75}, {0x48, 0x89, 0x55},
+		{0x48, 0x89, 0x4d}, {0x4c, 0x89, 0x45}, {0x4c, 0x89, 0x4d}
+	};
+	for (u32 i = 0; i < e->fn->params->len; i++) {
+		stores[i][3] = (u8)(-8 * (i + 1));
+		emit(e, stores[i], 4); // mov [rbp - 8 * (i + 1)], reg
+	}
+	EMIT(e, 0x48, 0xb9); // mov rcx, &budget
+	emit_imm64(e, (u64)&e->state->budget);
+	EMIT(e, 0x48, 0x83, 0x29, 0x01); // sub qword [rcx], 1
+	EMIT(e, 0x0f, 0x89); // jns body
+	u32 to_body = e->len;
+	emit_rel32(e, 0);
+	EMIT(e, 0x48, 0xb9); // mov rcx, &bail
+	emit_imm64(e, (u64)&e->state->bail);
+	EMIT(e, 0xc6, 0x01, 0x01); // mov byte [rcx], 1
+	EMIT(e, 0xe9); // jmp epilogue
+	fixup(e, e->returns, &e->returns_len);
+	emit_rel32(e, 0);
+	patch_rel32(e, to_body, e->len);
+
+	JitType body = emit_block(e, e->fn->body);
+	if (e->failed || (body != e->result && body != JIT_NEVER))
+		return false;
+
+	for (u32 i = 0; i < e->returns_len; i++)
+		patch_rel32(e, e->returns[i], e->len);
+	EMIT(e, 0x48, 0xb9); // mov rcx, &budget
+	emit_imm64(e, (u64)&e->state->budget);
+	EMIT(e, 0x48, 0x83, 0x01, 0x01); // add qword [rcx], 1
+	EMIT(e, 0xc9, 0xc3); // leave; ret
+	return !e->failed;
+}
+
+priv JitEntry jit_install(Emitter *e, u64 *size_out)
+{
+	u64 size = e->len + (KB(4) - 1);
+	size -= size % KB(4);
+	*size_out = size;
+	u8 *code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return NULL;
+	for (u32 i = 0; i < e->calls_len; i++)
+		memcpy(e->code + e->calls[i], &code, sizeof(code));
+	memcpy(code, e->code, e->len);
+	if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, size);
+		return NULL;
+	}
+	return (JitEntry)code;
+}
+
+JitFunction *jit_compile(JitState *js, Function *fn)
+{
+	if (!js->arena) js->arena = arena(MB(64));
+	JitFunction *jit = arena_alloc_zero(js->arena, sizeof(JitFunction));
+	*jit = (JitFunction) { .state = js, .fn = fn, .next = js->compiled };
+	js->compiled = jit;
+	if (!fn->body || fn->params->len > JIT_PARAMS_MAX)
+		return jit;
+
+	u64 previous_offset = js->arena->used;
+	Emitter *e = arena_alloc(js->arena, sizeof(Emitter));
+	JitType results[] = { JIT_INT, JIT_BOOL };
+	for (int i = 0; i < arrlen(results) && !jit->entry; i++) {
+		*e = (Emitter) { .fn = fn, .state = js, .result = results[i] };
+		e->code = arena_alloc(js->arena, JIT_CODE_MAX);
+		if (emit_function(e)) {
+			jit->entry = jit_install(e, &jit->size);
+			jit->result = results[i];
+			jit->params = fn->params->len;
+		}
+	}
+	arena_pop_to(js->arena, previous_offset);
+	return jit;
+}
+
+bool jit_call(JitFunction *jit, ElemArray *args, i64 budget, Element *res)
+{
+	if (!jit->entry || args->len != jit->params)
+		return false;
+	i64 regs[JIT_PARAMS_MAX] = {0};
+	for (u32 i = 0; i < args->len; i++) {
+		if (args->items[i].type != INT) // Guard: anything but INT runs in the interpreter
+			return false;
+		regs[i] = args->items[i].INT;
+	}
+	JitState *js = jit->state;
+	js->budget = budget;
+	js->bail = 0;
+	i64 value = jit->entry(regs[0], regs[1], regs[2], regs[3], regs[4], regs[5]);
+	if (js->bail)
+		return false;
+	*res = (jit->result == JIT_INT) ? (Element) { INT, .INT = value } : (Element) { BOOL, .BOOL = (value != 0) };
+	return true;
+}
+
+// Unmaps the code compiled for js, which can't be called anymore
+void jit_free(JitState *js)
+{
+	for (JitFunction *tmp = js->compiled; tmp; tmp = tmp->next)
+		if (tmp->entry) munmap((void *)tmp->entry, tmp->size);
+	if (js->arena)
+		arena_free(&js->arena);
+	js->compiled = js->checkpoint = NULL;
+}
+#else
+JitFunction *jit_compile(JitState *js, Function *fn)
+{
+	if (!js->arena) js->arena = arena(MB(1));
+	JitFunction *jit = arena_alloc_zero(js->arena, sizeof(JitFunction));
+	*jit = (JitFunction) { .state = js, .fn = fn, .next = js->compiled };
+	js->compiled = jit;
+	return jit;
+}
+
+void jit_free(JitState *js)
+{
+	if (js->arena)
+		arena_free(&js->arena);
+	js->compiled = js->checkpoint = NULL;
+}
+
+bool jit_call(JitFunction *jit, ElemArray *args, i64 budget, Element *res)
+{
+	return false;
+}
+#endif
+
+// Keeps what was compiled so far through the next jit_rewind
+void jit_checkpoint(JitState *js)
+{
+	js->checkpoint = js->compiled;
+	js->checkpoint_used = (js->arena) ? js->arena->used : 0;
+}
+
+// Drops what was compiled since jit_checkpoint. Functions still around get compiled
+// again on their next hot call.
+void jit_rewind(JitState *js)
+{
+	for (JitFunction *tmp = js->compiled; tmp != js->checkpoint; tmp = tmp->next) {
+		if (tmp->entry)
+			munmap((void *)tmp->entry, tmp->size);
+		tmp->fn->jit = NULL;
+	}
+	js->compiled = js->checkpoint;
+	if (js->arena)
+		arena_pop_to(js->arena, js->checkpoint_used);
+}
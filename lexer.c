@@ -67,6 +67,10 @@ Token lexer_token(Lexer *l)
 			t.type = TK_COMMA;
 			t.lit = str(",");
 			break;
+		case ':':
+			t.type = TK_COLON;
+			t.lit = str(":");
+			break;
 		case '(':
 			t.type = TK_LPAREN;
 			t.lit = str("(");
@@ -215,8 +219,8 @@ String token_str(TokenType type)
 {
 	String names[] = {
 	    str("EOF"),	   str("ILLEGAL"), str("SEMICOLON"), str("COMMA"),
-	    str("BANG"),   str("STAR"),	   str("SLASH"),     str("MOD"),
-	    str("GT"),	   str("LT"),	   str("LPAREN"),    str("RPAREN"),
+	    str("COLON"),  str("BANG"),    str("STAR"),	     str("SLASH"),
+	    str("MOD"),    str("GT"),	   str("LT"),	   str("LPAREN"),    str("RPAREN"),
 	    str("LBRACE"), str("RBRACE"),  str("LBRACKET"),  str("RBRACKET"),
 	    str("PLUS"),   str("MINUS"),   str("ASSIGN"),    str("EQ"),
 	    str("NOT_EQ"), str("INT"),	   str("STRING"), 	 str("IDENT"),     str("VAL"),    
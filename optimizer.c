@@ -0,0 +1,777 @@
+#include "base.h"
+#include "toyscript.h"
+#include <limits.h>
+
+#define INLINE_MAX_NODES 24
+#define NAMES_CAP 256
+
+// Rewrites the AST between parsing and evaluation: operations on literals are folded
+// with the evaluator itself, arithmetic identities are dropped where the operand is
+// known to be an INT, conditionals with a literal condition keep only the branch
+// they would take, calls to small functions are inlined and loop invariant expressions
+// are hoisted. Anything that fails at runtime is left alone so it still fails there.
+typedef struct Name {
+	String	key;
+	u32		bindings;	// val, var and parameters using the name, anywhere
+	u32		assigned;	// Assignments to the name, anywhere
+	u32		loop;		// Last loop found to bind the name
+	bool	top_level;	// Its binding is in the program namespace
+	AST		*inline_fn;
+	struct Name *next;
+} Name;
+
+typedef struct Loop {
+	AST		*node;
+	u32		id;
+	bool	mutates;	// Might change a container: index assignments, push or function calls
+} Loop;
+
+typedef struct Optimizer {
+	Arena	*arena;
+	u32		depth;	// Function bodies and while loops entered
+	u32		loops;
+	OptimizeStats stats;
+	Name	*names[NAMES_CAP];
+} Optimizer;
+
+AST *ast_alloc(Arena *a, AST node);
+bool builtin_replaced(String name);
+ASTList *astlist(Arena *a);
+void astpush(ASTList *l, AST *ast);
+priv AST *fold(Optimizer *o, AST *node);
+priv void fold_block(Optimizer *o, ASTList *block);
+
+thread_global bool inlining = true;
+thread_global OptimizeStats last_stats = {0};
+
+// Returns the previous setting, for this thread
+bool optimize_inline(bool enabled)
+{
+	bool previous = inlining;
+	inlining = enabled;
+	return previous;
+}
+
+priv bool is_literal(AST *node)
+{
+	return (node->type == AST_INT || node->type == AST_BOOL
+			|| node->type == AST_STR || node->type == AST_NULL);
+}
+
+priv bool literal_truthy(AST *node)
+{
+	switch (node->type) {
+		case AST_INT: return (node->AST_INT.value != 0);
+		case AST_BOOL: return node->AST_BOOL.value;
+		case AST_STR: return (node->AST_STR.len != 0);
+		default: return false;
+	}
+}
+
+// INT (or an error) whatever the bindings: + - * / % of two such operands would
+// concatenate LISTs or ARRAYs otherwise
+priv bool is_int(AST *node)
+{
+	if (node->type == AST_INT)
+		return true;
+	if (node->type == AST_PREFIX)
+		return str_eq(node->AST_PREFIX.op, str("-"));
+	if (node->type != AST_INFIX)
+		return false;
+	String op = node->AST_INFIX.op;
+	bool arithmetic = (str_eq(op, str("+")) || str_eq(op, str("-")) || str_eq(op, str("*"))
+			|| str_eq(op, str("/")) || str_eq(op, str("%")));
+	return (arithmetic && is_int(node->AST_INFIX.left) && is_int(node->AST_INFIX.right));
+}
+
+priv bool is_int_value(AST *node, long value)
+{
+	return (node->type == AST_INT && node->AST_INT.value == value);
+}
+
+priv AST *literal(Optimizer *o, AST *node, Element value)
+{
+	Arena *a = o->arena;
+	if (value.type == INT || value.type == BOOL || value.type == STR)
+		o->stats.folded++;
+	switch (value.type) {
+		case INT:
+			return ast_alloc(a, (AST) { AST_INT, .AST_INT = { value.INT }});
+		case BOOL:
+			return ast_alloc(a, (AST) { AST_BOOL, .AST_BOOL = { value.BOOL }});
+		case STR:
+			return ast_alloc(a, (AST) { AST_STR, .AST_STR = elem_str(value) });
+		default:
+			return node;
+	}
+}
+
+priv AST *fold_infix(Optimizer *o, AST *node)
+{
+	Arena *a = o->arena;
+	AST *left = node->AST_INFIX.left;
+	AST *right = node->AST_INFIX.right;
+	String op = node->AST_INFIX.op;
+	if (is_literal(left) && is_literal(right)) {
+		bool divides = (str_eq(op, str("/")) || str_eq(op, str("%")));
+		if (divides && right->type == AST_INT && (right->AST_INT.value == 0
+					|| (right->AST_INT.value == -1 && left->type == AST_INT && left->AST_INT.value == LONG_MIN)))
+			return node;
+		return literal(o, node, eval(a, NULL, node));
+	}
+	AST *res = node;
+	if (str_eq(op, str("+")) && is_int(left) && is_int_value(right, 0)) res = left;
+	if (str_eq(op, str("+")) && is_int_value(left, 0) && is_int(right)) res = right;
+	if (str_eq(op, str("-")) && is_int(left) && is_int_value(right, 0)) res = left;
+	if (str_eq(op, str("*")) && is_int(left) && is_int_value(right, 1)) res = left;
+	if (str_eq(op, str("*")) && is_int_value(left, 1) && is_int(right)) res = right;
+	if (str_eq(op, str("/")) && is_int(left) && is_int_value(right, 1)) res = left;
+	if (res != node)
+		o->stats.folded++;
+	return res;
+}
+
+// The block a conditional with a literal condition evaluates, NULL if it has none
+priv ASTList *taken_branch(AST *node)
+{
+	if (literal_truthy(node->AST_COND.condition))
+		return node->AST_COND.consequence;
+	return node->AST_COND.alternative;
+}
+
+// ~INLINING
+// A call is replaced by the body of the function when it's bound by a top level val
+// and its body is one small expression whose free names can't be shadowed at the call
+// site and whose value is never an alias (calls return copies). Arguments have to be
+// literals or identifiers, the latter evaluated unconditionally and in order by the
+// body, so duplicating them doesn't change what runs or which error comes first.
+priv u32 name_hash(String key)
+{
+	u32 h = 2166136261u;
+	for (u32 i = 0; i < key.len; i++)
+		h = (h ^ (u8)key.buf[i]) * 16777619u;
+	return h;
+}
+
+priv Name *name(Optimizer *o, String key, bool create)
+{
+	Name **bucket = &o->names[name_hash(key) % NAMES_CAP];
+	for (Name *tmp = *bucket; tmp; tmp = tmp->next)
+		if (str_eq(tmp->key, key)) return tmp;
+	if (!create)
+		return NULL;
+	Name *res = arena_alloc_zero(o->arena, sizeof(Name));
+	*res = (Name) { .key = key, .next = *bucket };
+	*bucket = res;
+	return res;
+}
+
+priv void bind_name(Optimizer *o, String key)
+{
+	Name *n = name(o, key, true);
+	n->bindings++;
+	n->top_level = (o->depth == 0);
+}
+
+priv void count_bindings(Optimizer *o, AST *node);
+priv void count_list(Optimizer *o, ASTList *list)
+{
+	for (ASTNode *tmp = (list) ? list->head : NULL; tmp; tmp = tmp->next)
+		count_bindings(o, tmp->ast);
+}
+
+priv void count_bindings(Optimizer *o, AST *node)
+{
+	switch (node->type) {
+		case AST_VAL: bind_name(o, node->AST_VAL.name), count_bindings(o, node->AST_VAL.value); break;
+		case AST_VAR: bind_name(o, node->AST_VAR.name), count_bindings(o, node->AST_VAR.value); break;
+		case AST_RETURN: count_bindings(o, node->AST_RETURN.value); break;
+		case AST_ASSIGN:
+			if (node->AST_ASSIGN.left->type == AST_IDENT)
+				name(o, node->AST_ASSIGN.left->AST_STR, true)->assigned++;
+			count_bindings(o, node->AST_ASSIGN.left), count_bindings(o, node->AST_ASSIGN.right);
+			break;
+		case AST_WHILE:
+			count_bindings(o, node->AST_WHILE.condition);
+			o->depth++, count_list(o, node->AST_WHILE.body), o->depth--;
+			break;
+		case AST_LIST: case AST_PROGRAM: count_list(o, node->AST_LIST); break;
+		case AST_MAP: count_list(o, node->AST_MAP); break;
+		case AST_FN:
+			o->depth++;
+			for (ASTNode *tmp = node->AST_FN.params->head; tmp; tmp = tmp->next)
+				bind_name(o, tmp->ast->AST_STR);
+			count_list(o, node->AST_FN.body);
+			o->depth--;
+			break;
+		case AST_PREFIX: count_bindings(o, node->AST_PREFIX.right); break;
+		case AST_INFIX: count_bindings(o, node->AST_INFIX.left), count_bindings(o, node->AST_INFIX.right); break;
+		case AST_COND:
+			count_bindings(o, node->AST_COND.condition);
+			count_list(o, node->AST_COND.consequence), count_list(o, node->AST_COND.alternative);
+			break;
+		case AST_CALL: count_bindings(o, node->AST_CALL.function), count_list(o, node->AST_CALL.args); break;
+		case AST_INDEX: count_bindings(o, node->AST_INDEX.left), count_bindings(o, node->AST_INDEX.index); break;
+		default: break;
+	}
+}
+
+priv i32 param_index(ASTList *params, String key)
+{
+	i32 i = 0;
+	for (ASTNode *tmp = params->head; tmp; tmp = tmp->next, i++)
+		if (str_eq(tmp->ast->AST_STR, key)) return i;
+	return -1;
+}
+
+// Node count of an expression made only of inlinable parts, or -1
+priv i32 inline_size(Optimizer *o, String self, ASTList *params, AST *node);
+priv i32 inline_size_list(Optimizer *o, String self, ASTList *params, ASTList *list)
+{
+	i32 size = 0;
+	for (ASTNode *tmp = (list) ? list->head : NULL; tmp; tmp = tmp->next) {
+		i32 n = inline_size(o, self, params, tmp->ast);
+		if (n < 0) return -1;
+		size += n;
+	}
+	return size;
+}
+
+priv i32 inline_size(Optimizer *o, String self, ASTList *params, AST *node)
+{
+	i32 l, r;
+	switch (node->type) {
+		case AST_INT: case AST_BOOL: case AST_STR: case AST_NULL:
+			return 1;
+		case AST_IDENT: {
+			if (param_index(params, node->AST_STR) >= 0) return 1;
+			if (str_eq(node->AST_STR, self)) return -1;
+			Name *n = name(o, node->AST_STR, false);
+			return (!n || (n->bindings == 1 && n->top_level)) ? 1 : -1;
+		}
+		case AST_PREFIX:
+			l = inline_size(o, self, params, node->AST_PREFIX.right);
+			return (l < 0) ? -1 : l + 1;
+		case AST_INFIX:
+			l = inline_size(o, self, params, node->AST_INFIX.left);
+			r = inline_size(o, self, params, node->AST_INFIX.right);
+			return (l < 0 || r < 0) ? -1 : l + r + 1;
+		case AST_INDEX:
+			l = inline_size(o, self, params, node->AST_INDEX.left);
+			r = inline_size(o, self, params, node->AST_INDEX.index);
+			return (l < 0 || r < 0) ? -1 : l + r + 1;
+		case AST_LIST:
+			l = inline_size_list(o, self, params, node->AST_LIST);
+			return (l < 0) ? -1 : l + 1;
+		case AST_CALL:
+			l = inline_size(o, self, params, node->AST_CALL.function);
+			r = inline_size_list(o, self, params, node->AST_CALL.args);
+			return (l < 0 || r < 0) ? -1 : l + r + 1;
+		case AST_COND: {
+			i32 c = inline_size(o, self, params, node->AST_COND.condition);
+			l = inline_size_list(o, self, params, node->AST_COND.consequence);
+			r = inline_size_list(o, self, params, node->AST_COND.alternative);
+			return (c < 0 || l < 0 || r < 0) ? -1 : c + l + r + 1;
+		}
+		default:
+			return -1;
+	}
+}
+
+// The value is created by the expression itself rather than read from a binding
+priv bool is_fresh(AST *node)
+{
+	switch (node->type) {
+		case AST_INT: case AST_BOOL: case AST_STR: case AST_NULL:
+		case AST_PREFIX: case AST_INFIX: case AST_LIST:
+			return true;
+		case AST_COND: {
+			ASTList *blocks[] = { node->AST_COND.consequence, node->AST_COND.alternative };
+			for (int i = 0; i < arrlen(blocks); i++)
+				if (blocks[i] && blocks[i]->len && !is_fresh(blocks[i]->tail->ast)) return false;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+// Parameters in the order the body first evaluates them, skipping conditional branches
+priv void first_uses(AST *node, ASTList *params, i32 *order, u32 *len)
+{
+	switch (node->type) {
+		case AST_IDENT: {
+			i32 i = param_index(params, node->AST_STR);
+			for (u32 j = 0; j < *len; j++)
+				if (order[j] == i) return;
+			if (i >= 0) order[(*len)++] = i;
+		} break;
+		case AST_PREFIX: first_uses(node->AST_PREFIX.right, params, order, len); break;
+		case AST_INFIX:
+			first_uses(node->AST_INFIX.left, params, order, len);
+			first_uses(node->AST_INFIX.right, params, order, len);
+			break;
+		case AST_INDEX:
+			first_uses(node->AST_INDEX.left, params, order, len);
+			first_uses(node->AST_INDEX.index, params, order, len);
+			break;
+		case AST_LIST:
+			for (ASTNode *tmp = node->AST_LIST->head; tmp; tmp = tmp->next)
+				first_uses(tmp->ast, params, order, len);
+			break;
+		case AST_CALL:
+			first_uses(node->AST_CALL.function, params, order, len);
+			for (ASTNode *tmp = node->AST_CALL.args->head; tmp; tmp = tmp->next)
+				first_uses(tmp->ast, params, order, len);
+			break;
+		case AST_COND: first_uses(node->AST_COND.condition, params, order, len); break;
+		default: break;
+	}
+}
+
+priv bool is_readonly_builtin(Optimizer *o, AST *callee);
+
+// Whether evaluating the expression can run code that might assign a binding
+priv bool calls_out(Optimizer *o, AST *node)
+{
+	if (!node) return false;
+	switch (node->type) {
+		case AST_PREFIX: return calls_out(o, node->AST_PREFIX.right);
+		case AST_INFIX: return calls_out(o, node->AST_INFIX.left) || calls_out(o, node->AST_INFIX.right);
+		case AST_INDEX: return calls_out(o, node->AST_INDEX.left) || calls_out(o, node->AST_INDEX.index);
+		case AST_LIST:
+			for (ASTNode *tmp = node->AST_LIST->head; tmp; tmp = tmp->next)
+				if (calls_out(o, tmp->ast)) return true;
+			return false;
+		case AST_CALL:
+			if (!is_readonly_builtin(o, node->AST_CALL.function)) return true;
+			for (ASTNode *tmp = node->AST_CALL.args->head; tmp; tmp = tmp->next)
+				if (calls_out(o, tmp->ast)) return true;
+			return false;
+		case AST_COND: {
+			ASTList *blocks[] = { node->AST_COND.consequence, node->AST_COND.alternative };
+			if (calls_out(o, node->AST_COND.condition)) return true;
+			for (int i = 0; i < arrlen(blocks); i++)
+				for (ASTNode *tmp = (blocks[i]) ? blocks[i]->head : NULL; tmp; tmp = tmp->next)
+					if (calls_out(o, tmp->ast)) return true;
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+priv AST *inline_body(AST *fn)
+{
+	ASTList *body = fn->AST_FN.body;
+	if (body->len != 1) return NULL;
+	AST *res = body->head->ast;
+	return (res->type == AST_RETURN) ? res->AST_RETURN.value : res;
+}
+
+priv void inline_candidate(Optimizer *o, String key, AST *fn)
+{
+	Name *n = name(o, key, false);
+	AST *body = inline_body(fn);
+	if (!inlining || !n || n->bindings != 1 || !body || !is_fresh(body))
+		return;
+	i32 size = inline_size(o, key, fn->AST_FN.params, body);
+	if (size >= 0 && size <= INLINE_MAX_NODES)
+		n->inline_fn = fn;
+}
+
+priv AST *substitute(Optimizer *o, AST *node, ASTList *params, ASTList *args);
+priv ASTList *substitute_list(Optimizer *o, ASTList *list, ASTList *params, ASTList *args)
+{
+	if (!list) return NULL;
+	ASTList *res = astlist(o->arena);
+	for (ASTNode *tmp = list->head; tmp; tmp = tmp->next)
+		astpush(res, substitute(o, tmp->ast, params, args));
+	return res;
+}
+
+priv AST *substitute(Optimizer *o, AST *node, ASTList *params, ASTList *args)
+{
+	AST res = *node;
+	switch (node->type) {
+		case AST_IDENT: {
+			i32 i = param_index(params, node->AST_STR);
+			if (i < 0)
+				return ast_alloc(o->arena, (AST) { AST_IDENT, .AST_IDENT = { node->AST_STR }});
+			ASTNode *arg = args->head;
+			while (i--) arg = arg->next;
+			return arg->ast;
+		}
+		case AST_PREFIX:
+			res.AST_PREFIX.right = substitute(o, node->AST_PREFIX.right, params, args);
+			break;
+		case AST_INFIX:
+			res.AST_INFIX = (struct AST_INFIX) { substitute(o, node->AST_INFIX.left, params, args),
+				node->AST_INFIX.op, substitute(o, node->AST_INFIX.right, params, args) };
+			break;
+		case AST_INDEX:
+			res.AST_INDEX = (struct AST_INDEX) { substitute(o, node->AST_INDEX.left, params, args),
+				substitute(o, node->AST_INDEX.index, params, args) };
+			break;
+		case AST_LIST:
+			res.AST_LIST = substitute_list(o, node->AST_LIST, params, args);
+			break;
+		case AST_CALL:
+			res.AST_CALL = (struct AST_CALL) { substitute(o, node->AST_CALL.function, params, args),
+				substitute_list(o, node->AST_CALL.args, params, args) };
+			break;
+		case AST_COND:
+			res.AST_COND.condition = substitute(o, node->AST_COND.condition, params, args);
+			res.AST_COND.consequence = substitute_list(o, node->AST_COND.consequence, params, args);
+			res.AST_COND.alternative = substitute_list(o, node->AST_COND.alternative, params, args);
+			break;
+		default:
+			break;
+	}
+	return ast_alloc(o->arena, res);
+}
+
+priv AST *inline_call(Optimizer *o, AST *node)
+{
+	AST *callee = node->AST_CALL.function;
+	Name *n = (callee->type == AST_IDENT) ? name(o, callee->AST_STR, false) : NULL;
+	if (!n || !n->inline_fn)
+		return node;
+	ASTList *params = n->inline_fn->AST_FN.params;
+	ASTList *args = node->AST_CALL.args;
+	if (params->len != args->len)
+		return node;
+
+	AST *body = inline_body(n->inline_fn);
+	i32 *order = arena_alloc(o->arena, sizeof(i32) * params->len);
+	u32 len = 0;
+	first_uses(body, params, order, &len);
+	// A call in the body could assign a name passed in, which the call would have read once up front
+	bool effects = calls_out(o, body);
+	i32 i = 0, last = -1;
+	for (ASTNode *tmp = args->head; tmp; tmp = tmp->next, i++) {
+		if (is_literal(tmp->ast))
+			continue;
+		if (tmp->ast->type != AST_IDENT || effects)
+			return node;
+		i32 pos = 0;
+		while (pos < len && order[pos] != i)
+			pos++;
+		if (pos == len || pos < last)
+			return node;
+		last = pos;
+	}
+	o->stats.inlined++;
+	return fold(o, substitute(o, body, params, args));
+}
+
+priv AST *fold(Optimizer *o, AST *node)
+{
+	Arena *a = o->arena;
+	switch (node->type) {
+		case AST_VAL:
+			node->AST_VAL.value = fold(o, node->AST_VAL.value);
+			if (o->depth == 0 && node->AST_VAL.value->type == AST_FN)
+				inline_candidate(o, node->AST_VAL.name, node->AST_VAL.value);
+			break;
+		case AST_VAR:
+			if (node->AST_VAR.value->type == AST_LIST)
+				for (ASTNode *tmp = node->AST_VAR.value->AST_LIST->head; tmp; tmp = tmp->next)
+					tmp->ast = fold(o, tmp->ast);
+			else { // A list literal in a var binds a LIST, anything else evaluating to one an ARRAY
+				OptimizeStats stats = o->stats;
+				AST *value = fold(o, node->AST_VAR.value);
+				if (value->type == AST_LIST)
+					o->stats = stats;
+				else
+					node->AST_VAR.value = value;
+			}
+			break;
+		case AST_RETURN:
+			node->AST_RETURN.value = fold(o, node->AST_RETURN.value);
+			break;
+		case AST_ASSIGN:
+			if (node->AST_ASSIGN.left->type == AST_INDEX)
+				node->AST_ASSIGN.left->AST_INDEX.index = fold(o, node->AST_ASSIGN.left->AST_INDEX.index);
+			node->AST_ASSIGN.right = fold(o, node->AST_ASSIGN.right);
+			break;
+		case AST_WHILE:
+			node->AST_WHILE.condition = fold(o, node->AST_WHILE.condition);
+			o->depth++;
+			fold_block(o, node->AST_WHILE.body);
+			o->depth--;
+			if (is_literal(node->AST_WHILE.condition) && !literal_truthy(node->AST_WHILE.condition))
+				return (o->stats.folded++, ast_alloc(a, (AST) { AST_NULL }));
+			break;
+		case AST_LIST:
+			for (ASTNode *tmp = node->AST_LIST->head; tmp; tmp = tmp->next)
+				tmp->ast = fold(o, tmp->ast);
+			break;
+		case AST_MAP:
+			for (ASTNode *tmp = node->AST_MAP->head; tmp; tmp = tmp->next)
+				tmp->ast = fold(o, tmp->ast);
+			break;
+		case AST_FN:
+			o->depth++;
+			fold_block(o, node->AST_FN.body);
+			o->depth--;
+			break;
+		case AST_PREFIX:
+			node->AST_PREFIX.right = fold(o, node->AST_PREFIX.right);
+			if (is_literal(node->AST_PREFIX.right))
+				return literal(o, node, eval(a, NULL, node));
+			break;
+		case AST_INFIX:
+			node->AST_INFIX.left = fold(o, node->AST_INFIX.left);
+			node->AST_INFIX.right = fold(o, node->AST_INFIX.right);
+			return fold_infix(o, node);
+		case AST_COND: {
+			node->AST_COND.condition = fold(o, node->AST_COND.condition);
+			fold_block(o, node->AST_COND.consequence);
+			if (node->AST_COND.alternative)
+				fold_block(o, node->AST_COND.alternative);
+			if (!is_literal(node->AST_COND.condition))
+				break;
+			// A block evaluates in the enclosing namespace, so one statement is the block
+			o->stats.folded++;
+			ASTList *taken = taken_branch(node);
+			if (!taken || taken->len == 0)
+				return ast_alloc(a, (AST) { AST_NULL });
+			if (taken->len == 1)
+				return taken->head->ast;
+		} break;
+		case AST_CALL:
+			node->AST_CALL.function = fold(o, node->AST_CALL.function);
+			for (ASTNode *tmp = node->AST_CALL.args->head; tmp; tmp = tmp->next)
+				tmp->ast = fold(o, tmp->ast);
+			return inline_call(o, node);
+		case AST_INDEX:
+			node->AST_INDEX.left = fold(o, node->AST_INDEX.left);
+			node->AST_INDEX.index = fold(o, node->AST_INDEX.index);
+			break;
+		case AST_PROGRAM:
+			fold_block(o, node->AST_LIST);
+			break;
+		default:
+			break;
+	}
+	return node;
+}
+
+// Statements of a pruned conditional that kept a longer block are spliced in its place
+priv void fold_block(Optimizer *o, ASTList *block)
+{
+	ASTNode *head = block->head;
+	*block = (ASTList) { block->arena };
+	for (ASTNode *tmp = head; tmp; tmp = tmp->next) {
+		AST *node = fold(o, tmp->ast);
+		if (node->type == AST_COND && is_literal(node->AST_COND.condition)) {
+			for (ASTNode *stmt = taken_branch(node)->head; stmt; stmt = stmt->next)
+				astpush(block, stmt->ast);
+		} else
+			astpush(block, node);
+	}
+}
+
+// ~LOOP INVARIANTS
+// Expressions in a while loop that only read names no assignment targets and no
+// binding inside the loop shadows are evaluated once per run of the loop. Operators
+// are always pure; indexing and len are too as long as the loop can't reach code
+// changing a container. Only INT and BOOL results are kept, so an error is still
+// raised by the iteration that evaluates it and containers are never shared.
+// A core builtin that leaves containers alone, shadowed neither by a binding nor by a
+// native of the interpreter compiling the script
+priv bool is_readonly_builtin(Optimizer *o, AST *callee)
+{
+	String readonly[] = { str("print"), str("len"), str("type"), str("car"), str("cdr"), str("concat"), str("slurp"),
+		str("keys"), str("values"), str("has"), str("pop"), str("reserve"), str("slice"), str("vector"), str("set"), str("range") };
+	if (callee->type != AST_IDENT || name(o, callee->AST_STR, false) || builtin_replaced(callee->AST_STR))
+		return false;
+	for (int i = 0; i < arrlen(readonly); i++)
+		if (str_eq(callee->AST_STR, readonly[i])) return true;
+	return false;
+}
+
+priv void scan_loop(Optimizer *o, Loop *loop, AST *node);
+priv void scan_loop_list(Optimizer *o, Loop *loop, ASTList *list)
+{
+	for (ASTNode *tmp = (list) ? list->head : NULL; tmp; tmp = tmp->next)
+		scan_loop(o, loop, tmp->ast);
+}
+
+// Marks the names bound anywhere inside the loop and whether it might mutate a container
+priv void scan_loop(Optimizer *o, Loop *loop, AST *node)
+{
+	switch (node->type) {
+		case AST_VAL:
+			name(o, node->AST_VAL.name, true)->loop = loop->id;
+			scan_loop(o, loop, node->AST_VAL.value);
+			break;
+		case AST_VAR:
+			name(o, node->AST_VAR.name, true)->loop = loop->id;
+			scan_loop(o, loop, node->AST_VAR.value);
+			break;
+		case AST_RETURN: scan_loop(o, loop, node->AST_RETURN.value); break;
+		case AST_ASSIGN:
+			loop->mutates |= (node->AST_ASSIGN.left->type == AST_INDEX);
+			scan_loop(o, loop, node->AST_ASSIGN.left), scan_loop(o, loop, node->AST_ASSIGN.right);
+			break;
+		case AST_WHILE:
+			scan_loop(o, loop, node->AST_WHILE.condition), scan_loop_list(o, loop, node->AST_WHILE.body);
+			break;
+		case AST_LIST: scan_loop_list(o, loop, node->AST_LIST); break;
+		case AST_MAP: scan_loop_list(o, loop, node->AST_MAP); break;
+		case AST_FN:
+			for (ASTNode *tmp = node->AST_FN.params->head; tmp; tmp = tmp->next)
+				name(o, tmp->ast->AST_STR, true)->loop = loop->id;
+			scan_loop_list(o, loop, node->AST_FN.body);
+			break;
+		case AST_PREFIX: scan_loop(o, loop, node->AST_PREFIX.right); break;
+		case AST_INFIX: scan_loop(o, loop, node->AST_INFIX.left), scan_loop(o, loop, node->AST_INFIX.right); break;
+		case AST_COND:
+			scan_loop(o, loop, node->AST_COND.condition);
+			scan_loop_list(o, loop, node->AST_COND.consequence), scan_loop_list(o, loop, node->AST_COND.alternative);
+			break;
+		case AST_CALL:
+			loop->mutates |= !is_readonly_builtin(o, node->AST_CALL.function);
+			scan_loop(o, loop, node->AST_CALL.function), scan_loop_list(o, loop, node->AST_CALL.args);
+			break;
+		case AST_INDEX: scan_loop(o, loop, node->AST_INDEX.left), scan_loop(o, loop, node->AST_INDEX.index); break;
+		case AST_INVARIANT: scan_loop(o, loop, node->AST_INVARIANT.value); break;
+		default: break;
+	}
+}
+
+priv bool invariant(Optimizer *o, Loop *loop, AST *node)
+{
+	switch (node->type) {
+		case AST_INT: case AST_BOOL: case AST_STR: case AST_NULL:
+			return true;
+		case AST_IDENT: {
+			Name *n = name(o, node->AST_STR, false);
+			return (!n || (n->assigned == 0 && n->loop != loop->id));
+		}
+		case AST_PREFIX:
+			return invariant(o, loop, node->AST_PREFIX.right);
+		case AST_INFIX:
+			return invariant(o, loop, node->AST_INFIX.left) && invariant(o, loop, node->AST_INFIX.right);
+		case AST_INDEX:
+			return (!loop->mutates && invariant(o, loop, node->AST_INDEX.left)
+					&& invariant(o, loop, node->AST_INDEX.index));
+		case AST_CALL: {
+			AST *callee = node->AST_CALL.function;
+			ASTList *args = node->AST_CALL.args;
+			return (!loop->mutates && is_readonly_builtin(o, callee) && str_eq(callee->AST_STR, str("len"))
+					&& args->len == 1 && invariant(o, loop, args->head->ast));
+		}
+		default:
+			return false;
+	}
+}
+
+priv AST *hoist(Optimizer *o, Loop *loop, AST *node);
+priv void hoist_list(Optimizer *o, Loop *loop, ASTList *list)
+{
+	for (ASTNode *tmp = (list) ? list->head : NULL; tmp; tmp = tmp->next)
+		tmp->ast = hoist(o, loop, tmp->ast);
+}
+
+// Wraps the largest invariant expressions of a loop, function bodies excluded
+priv AST *hoist(Optimizer *o, Loop *loop, AST *node)
+{
+	switch (node->type) {
+		case AST_PREFIX: case AST_INFIX: case AST_INDEX: case AST_CALL:
+			if (!invariant(o, loop, node))
+				break;
+			o->stats.hoisted++;
+			return ast_alloc(o->arena, (AST) { AST_INVARIANT, .AST_INVARIANT = { node, loop->node }});
+		default:
+			break;
+	}
+	switch (node->type) {
+		case AST_VAL: node->AST_VAL.value = hoist(o, loop, node->AST_VAL.value); break;
+		case AST_VAR: node->AST_VAR.value = hoist(o, loop, node->AST_VAR.value); break;
+		case AST_RETURN: node->AST_RETURN.value = hoist(o, loop, node->AST_RETURN.value); break;
+		case AST_ASSIGN:
+			if (node->AST_ASSIGN.left->type == AST_INDEX)
+				node->AST_ASSIGN.left->AST_INDEX.index = hoist(o, loop, node->AST_ASSIGN.left->AST_INDEX.index);
+			node->AST_ASSIGN.right = hoist(o, loop, node->AST_ASSIGN.right);
+			break;
+		case AST_WHILE:
+			node->AST_WHILE.condition = hoist(o, loop, node->AST_WHILE.condition);
+			hoist_list(o, loop, node->AST_WHILE.body);
+			break;
+		case AST_LIST: hoist_list(o, loop, node->AST_LIST); break;
+		case AST_MAP: hoist_list(o, loop, node->AST_MAP); break;
+		case AST_PREFIX: node->AST_PREFIX.right = hoist(o, loop, node->AST_PREFIX.right); break;
+		case AST_INFIX:
+			node->AST_INFIX.left = hoist(o, loop, node->AST_INFIX.left);
+			node->AST_INFIX.right = hoist(o, loop, node->AST_INFIX.right);
+			break;
+		case AST_COND:
+			node->AST_COND.condition = hoist(o, loop, node->AST_COND.condition);
+			hoist_list(o, loop, node->AST_COND.consequence), hoist_list(o, loop, node->AST_COND.alternative);
+			break;
+		case AST_CALL: hoist_list(o, loop, node->AST_CALL.args); break;
+		case AST_INDEX:
+			node->AST_INDEX.left = hoist(o, loop, node->AST_INDEX.left);
+			node->AST_INDEX.index = hoist(o, loop, node->AST_INDEX.index);
+			break;
+		default:
+			break;
+	}
+	return node;
+}
+
+// Outer loops first, so an expression is cached for as long as it can be
+priv void hoist_loops(Optimizer *o, AST *node);
+priv void hoist_loops_list(Optimizer *o, ASTList *list)
+{
+	for (ASTNode *tmp = (list) ? list->head : NULL; tmp; tmp = tmp->next)
+		hoist_loops(o, tmp->ast);
+}
+
+priv void hoist_loops(Optimizer *o, AST *node)
+{
+	switch (node->type) {
+		case AST_VAL: hoist_loops(o, node->AST_VAL.value); break;
+		case AST_VAR: hoist_loops(o, node->AST_VAR.value); break;
+		case AST_RETURN: hoist_loops(o, node->AST_RETURN.value); break;
+		case AST_ASSIGN: hoist_loops(o, node->AST_ASSIGN.left), hoist_loops(o, node->AST_ASSIGN.right); break;
+		case AST_WHILE: {
+			Loop *loop = &(Loop) { node, ++o->loops };
+			scan_loop(o, loop, node);
+			node->AST_WHILE.condition = hoist(o, loop, node->AST_WHILE.condition);
+			hoist_list(o, loop, node->AST_WHILE.body);
+			hoist_loops(o, node->AST_WHILE.condition), hoist_loops_list(o, node->AST_WHILE.body);
+		} break;
+		case AST_LIST: case AST_PROGRAM: hoist_loops_list(o, node->AST_LIST); break;
+		case AST_MAP: hoist_loops_list(o, node->AST_MAP); break;
+		case AST_FN: hoist_loops_list(o, node->AST_FN.body); break;
+		case AST_PREFIX: hoist_loops(o, node->AST_PREFIX.right); break;
+		case AST_INFIX: hoist_loops(o, node->AST_INFIX.left), hoist_loops(o, node->AST_INFIX.right); break;
+		case AST_COND:
+			hoist_loops(o, node->AST_COND.condition);
+			hoist_loops_list(o, node->AST_COND.consequence), hoist_loops_list(o, node->AST_COND.alternative);
+			break;
+		case AST_CALL: hoist_loops(o, node->AST_CALL.function), hoist_loops_list(o, node->AST_CALL.args); break;
+		case AST_INDEX: hoist_loops(o, node->AST_INDEX.left), hoist_loops(o, node->AST_INDEX.index); break;
+		default: break;
+	}
+}
+
+OptimizeStats optimize_stats(void)
+{
+	return last_stats;
+}
+
+AST *ast_optimize(Arena *a, AST *program)
+{
+	Optimizer *o = arena_alloc_zero(a, sizeof(Optimizer));
+	o->arena = a;
+	count_bindings(o, program);
+	program = fold(o, program);
+	hoist_loops(o, program);
+	last_stats = o->stats;
+	return program;
+}
@@ -1,4 +1,8 @@
 #include "tests.h"
+#include <pthread.h>
+#include <unistd.h>
+
+Bind *ns_get_inner(Namespace *ns, String key);
 
 TestResult test_integer_eval(Arena *a);
 TestResult test_string_eval(Arena *a);
@@ -16,6 +20,26 @@ TestResult test_builtin_function(Arena *a);
 TestResult test_assignment(Arena *a);
 TestResult test_while_loop(Arena *a);
 TestResult test_arr_concat(Arena *a);
+TestResult test_call_depth(Arena *a);
+TestResult test_specialized_nodes(Arena *a);
+TestResult test_inline_caches(Arena *a);
+TestResult test_jit(Arena *a);
+TestResult test_emit_c(Arena *a);
+TestResult test_constant_folding(Arena *a);
+TestResult test_inlining(Arena *a);
+TestResult test_loop_invariants(Arena *a);
+TestResult test_loop_scratch(Arena *a);
+TestResult test_namespace_growth(Arena *a);
+TestResult test_maps(Arena *a);
+TestResult test_dynamic_arrays(Arena *a);
+TestResult test_array_slices(Arena *a);
+TestResult test_unrolled_lists(Arena *a);
+TestResult test_vectors(Arena *a);
+TestResult test_higher_order(Arena *a);
+TestResult test_parallel_builtins(Arena *a);
+TestResult test_interpreters(Arena *a);
+TestResult test_scripts(Arena *a);
+TestResult test_natives(Arena *a);
 
 int main(int ac, char **av)
 {
@@ -38,6 +62,26 @@ int main(int ac, char **av)
 			{str("ASSIGNMENT"), &test_assignment},
 			{str("WHILE"), &test_while_loop},
 			{str("WHILE"), &test_arr_concat},
+			{str("CALL DEPTH"), &test_call_depth},
+			{str("SPECIALIZED NODES"), &test_specialized_nodes},
+			{str("INLINE CACHES"), &test_inline_caches},
+			{str("JIT"), &test_jit},
+			{str("EMIT C"), &test_emit_c},
+			{str("CONSTANT FOLDING"), &test_constant_folding},
+			{str("INLINING"), &test_inlining},
+			{str("LOOP INVARIANTS"), &test_loop_invariants},
+			{str("LOOP SCRATCH"), &test_loop_scratch},
+			{str("NAMESPACE GROWTH"), &test_namespace_growth},
+			{str("MAPS"), &test_maps},
+			{str("DYNAMIC ARRAYS"), &test_dynamic_arrays},
+			{str("ARRAY SLICES"), &test_array_slices},
+			{str("UNROLLED LISTS"), &test_unrolled_lists},
+			{str("PERSISTENT VECTORS"), &test_vectors},
+			{str("HIGHER ORDER BUILTINS"), &test_higher_order},
+			{str("PARALLEL BUILTINS"), &test_parallel_builtins},
+			{str("INTERPRETERS"), &test_interpreters},
+			{str("SCRIPTS"), &test_scripts},
+			{str("NATIVES"), &test_natives},
 	};
 
 	if (ac < 2) {
@@ -94,7 +138,7 @@ TestResult test_string_eval(Arena *a)
 		Element res = eval_wrapper(a, tests[i].input);
 		if (TEST(res.type != STR))
 			return fail(str("Wrong type"));
-		if (TEST(!str_eq(res.STR, tests[i].expected)))
+		if (TEST(!str_eq(elem_str(res), tests[i].expected)))
 			return fail(str("Value mismatch"));
 	}
 	return pass();
@@ -113,7 +157,7 @@ TestResult test_string_concat(Arena *a)
 		if (TEST(res.type != STR))
 			return fail(str("Wrong type"));
 
-		if (TEST(!str_eq(res.STR, tests[i].expected)))
+		if (TEST(!str_eq(elem_str(res), tests[i].expected)))
 			return fail(str("Value mismatch"));
 	}
 	return pass();
@@ -147,12 +191,12 @@ TestResult test_index_eval(Arena *a)
 	    {str("[2, false, 5][1]"), { BOOL, .BOOL = false}},
 	    {str("[1, 3, 4][-1]"), { NIL }},
 	    {str("[1, 3, 4][3]"), { NIL }},
-		{str("[\"string1\", 0, false][0]"), { STR, .STR = str("string1") }},
+		{str("[\"string1\", 0, false][0]"), elem_from_str(STR, str("string1"))},
 		{str("var x = [1, 3, 7]; x[0]"), { INT, .INT = 1 }},
 	    {str("var x = [2, false, 5]; x[1]"), { BOOL, .BOOL = false}},
 	    {str("var x = [1, 3, 4]; x[-1]"), { NIL }},
 	    {str("var x = [1, 3, 4]; x[3]"), { NIL }},
-		{str("var x = [\"string1\", 0, false]; x[0]"), { STR, .STR = str("string1") }}
+		{str("var x = [\"string1\", 0, false]; x[0]"), elem_from_str(STR, str("string1"))}
 	};
 	for (int i = 0; i < arrlen(tests); i++) {
 		Element res = eval_wrapper(a, tests[i].input);
@@ -167,7 +211,7 @@ TestResult test_index_eval(Arena *a)
 				return fail(str("Value mismatch"));
 		}
 		if (res.type == STR) {
-			if (TEST(!str_eq(res.STR, tests[i].expected.STR)))
+			if (TEST(!str_eq(elem_str(res), elem_str(tests[i].expected))))
 				return fail(str("Value mismatch"));
 		}
 	}
@@ -278,7 +322,7 @@ TestResult test_errors(Arena *a)
 		Element res = eval_wrapper(a, tests[i].input);
 		if (TEST(res.type != ERR))
 			return fail(str("Wrong type"));
-		if (TEST(!str_eq(res.ERR, tests[i].expected_msg)))
+		if (TEST(!str_eq(elem_str(res), tests[i].expected_msg)))
 			return fail(str("Wrong error message"));
 	}
 	return pass();
@@ -320,14 +364,13 @@ TestResult test_function_eval(Arena *a)
 				.op = str("+"),
 				.right = ast_alloc(a, (AST) { AST_INT, .AST_INT = {2} })
 				}}));
-	Element expected = (Element) {
-		FUNCTION, .FUNCTION = {.params = exp_params, .body = exp_body}
-	};
+	Function exp_fn = { .params = exp_params, .body = exp_body };
+	Element expected = (Element) { FUNCTION, .FUNCTION = &exp_fn };
 
 	if (TEST(res.type != FUNCTION))
 		return fail(str("Wrong type"));
-	if (TEST(!astlist_eq(res.FUNCTION.params, expected.FUNCTION.params)));
-	if (TEST(!astlist_eq(res.FUNCTION.body, expected.FUNCTION.body)));
+	if (TEST(!astlist_eq(res.FUNCTION->params, expected.FUNCTION->params)));
+	if (TEST(!astlist_eq(res.FUNCTION->body, expected.FUNCTION->body)));
 	return pass();
 }
 
@@ -394,7 +437,10 @@ TestResult test_assignment(Arena *a)
 	struct test tests[] = {
 		{str("var x = 5; x = 10; x;"), (Element) { INT, .INT = 10 }},
 		{str("var x = false; x = true; x;"), (Element) { BOOL, .BOOL = true }},
-		{str("val x = 5; x = 10; x"), (Element) { ERR, .ERR = str("x binding is not mutable") }},
+		{str("val x = 5; x = 10; x"), elem_from_str(ERR, str("x binding is not mutable"))},
+		{str("var x = 5; x = \"a\"; x"), elem_from_str(ERR, str("Can't assign type STR of type x to variable of type INT"))},
+		{str("var s = \"a\" + \"b\"; var t = s; s = \"c\"; s = t; t"), elem_from_str(STR, str("ab"))},
+		{str("val mk = fn(x) { [x] }; var a = mk(1); var b = a; a = mk(2); b[0]"), (Element) { INT, .INT = 1 }},
 	};
 	for (int i = 0; i < arrlen(tests); i++) {
 		Element res = eval_wrapper(a, tests[i].input);
@@ -408,11 +454,22 @@ TestResult test_assignment(Arena *a)
 			if (TEST(res.BOOL != tests[i].expected.BOOL))
 				return fail(str("Value mismatch"));
 		}
-		if (res.type == ERR) {
-			if (TEST(!str_eq(res.ERR, tests[i].expected.ERR)))
+		if (res.type == ERR || res.type == STR) {
+			if (TEST(!str_eq(elem_str(res), elem_str(tests[i].expected))))
 				return fail(str("Value mismatch"));
 		}
 	}
+
+	// Assigning immediates overwrites the binding without allocating
+	Parser *p = parser(a, lexer(a, str("var i = 0; var b = true; while (i < 5000) { i = i + 1; b = !b; } i;")));
+	AST *prog = parse_program(p);
+	Namespace *ns = ns_create(a, 16);
+	u64 before = a->used;
+	Element res = eval(a, ns, prog);
+	if (TEST(res.type != INT || res.INT != 5000))
+		return fail(str("Loop result mismatch"));
+	if (TEST(a->used - before > KB(4)))
+		return fail(str_fmt(a, "Assignments allocated %lu bytes", a->used - before));
 	return pass();
 }
 
@@ -421,9 +478,12 @@ priv bool elemlist_eq(ElemList *l1, ElemList *l2)
 {
 	if (l1->len != l2->len)
 		return false;
-	for (ElemNode *n1 = l1->head, *n2 = l2->head; 
-			n1 && n2; n1 = n1->next, n2 = n2->next)
-		if (!elem_eq(n1->element, n2->element)) return false;
+	ElemNode *n1 = l1->head, *n2 = l2->head;
+	for (u32 i = 0, at1 = l1->start, at2 = l2->start; i < l1->len; i++, at1++, at2++) {
+		for (; at1 == n1->len; at1 = 0) n1 = n1->next;
+		for (; at2 == n2->len; at2 = 0) n2 = n2->next;
+		if (!elem_eq(n1->items[at1], n2->items[at2])) return false;
+	}
 	return true;
 }
 
@@ -437,6 +497,34 @@ priv bool elemarray_eq(ElemArray *a1, ElemArray *a2)
 	return true;
 }
 
+// Same entries in the same order
+priv bool elemmap_eq(ElemMap *m1, ElemMap *m2)
+{
+	if (m1->len != m2->len)
+		return false;
+	u32 j = 0;
+	for (u32 i = 0; i < m1->used; i++) {
+		if (!m1->entries[i].live)
+			continue;
+		while (!m2->entries[j].live) j++;
+		if (!elem_eq(m1->entries[i].key, m2->entries[j].key) || !elem_eq(m1->entries[i].value, m2->entries[j].value))
+			return false;
+		j++;
+	}
+	return true;
+}
+
+Element *elemvector_at(ElemVector *v, u32 i);
+priv bool elemvector_eq(ElemVector *v1, ElemVector *v2)
+{
+	if (v1->len != v2->len)
+		return false;
+	for (u32 i = 0; i < v1->len; i++)
+		if (!elem_eq(*elemvector_at(v1, i), *elemvector_at(v2, i)))
+			return false;
+	return true;
+}
+
 priv bool elem_eq(Element e1, Element e2)
 {
 	if (e1.type != e2.type) return false;
@@ -444,19 +532,20 @@ priv bool elem_eq(Element e1, Element e2)
 		case NIL: return true;
 		case INT: return e1.INT == e2.INT;
 		case BOOL: return e1.BOOL == e2.BOOL;
-		case ERR: case STR: return str_eq(e1.STR, e2.STR);
+		case ERR: case STR: return str_eq(elem_str(e1), elem_str(e2));
 		case TYPE: return e1.TYPE == e2.TYPE;
 		case ARRAY: return elemarray_eq(e1.ARRAY, e2.ARRAY);
 		case LIST: return elemlist_eq(e1.LIST, e2.LIST);
+		case MAP: return elemmap_eq(e1.MAP, e2.MAP);
+		case VECTOR: return elemvector_eq(e1.VECTOR, e2.VECTOR);
 		case RETURN: return elem_eq(*e1.RETURN.value, *e2.RETURN.value);
-		case FUNCTION: return astlist_eq(e1.FUNCTION.params, e2.FUNCTION.params) 
-				&& astlist_eq(e1.FUNCTION.body, e1.FUNCTION.body);
+		case FUNCTION: return astlist_eq(e1.FUNCTION->params, e2.FUNCTION->params) 
+				&& astlist_eq(e1.FUNCTION->body, e1.FUNCTION->body);
 		case BUILTIN: return false;
 	}
 	return (NEVER(1 && "Type slipped through switch"));
 }
 
-ElemArray *elemarray(Arena *a, int len);
 TestResult test_arr_concat(Arena *a)
 {
 	ElemArray *arr1 = elemarray(a, 3);
@@ -506,7 +595,7 @@ TestResult test_while_loop(Arena *a)
 			return pass();
 		if (res.type == NIL && !tests[i].expected.type == NIL)
 			return fail(str(""));
-		if (res.TYPE == INT) {
+		if (res.type == INT) {
 			if(TEST(res.INT != tests[i].expected.INT))
 				return fail(str("Value mismatch"));
 		}
@@ -514,6 +603,827 @@ TestResult test_while_loop(Arena *a)
 	return pass();
 }
 
+TestResult test_call_depth(Arena *a)
+{
+	char *deep = "val down = fn(x) { if (x == 0) { return 0; } return 1 + down(x - 1); }; down(50000);";
+	Element res = eval_wrapper(a, cstr(deep));
+	if (TEST(res.type != INT))
+		return fail(str("Wrong type"));
+	if (TEST(res.INT != 50000))
+		return fail(str("Value mismatch"));
+
+	eval_max_depth(100);
+	res = eval_wrapper(a, cstr(deep));
+	eval_max_depth(UINT32_MAX);
+	if (TEST(res.type != ERR))
+		return fail(str("Wrong type"));
+	if (TEST(!str_eq(elem_str(res), str("Stack overflow: maximum call depth of 100 exceeded"))))
+		return fail(str("Wrong error message"));
+	return pass();
+}
+
+TestResult test_specialized_nodes(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("var i = 0; while (i < 10) { i = i + 1; } i;"), (Element) { INT, .INT = 10 }},
+		{ str("val add = fn(x, y) { x + y; }; add(1, 2); add(\"a\", \"b\");"), elem_from_str(STR, str("ab")) },
+		{ str("val add = fn(x, y) { x + y; }; add(1, 2); add(1, false);"), 
+			elem_from_str(ERR, str("Invalid types in operation: INT + BOOL")) },
+		{ str("val at = fn(c, i) { c[i]; }; at([4, 5], 1); var l = [6, 7]; at(l, 0);"), (Element) { INT, .INT = 6 }},
+		{ str("val at = fn(c, i) { c[i]; }; at([4, 5], 1); at([4, 5], 2);"), (Element) { NIL }},
+		{ str("val call = fn(f) { f(2); }; call(fn(x) { x * 3; }); call(len);"), 
+			elem_from_str(ERR, str("Type error: len called with argument of type: INT")) },
+	};
+	eval_specialize(true);
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return eval_specialize(false), fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	eval_specialize(false);
+	return pass();
+}
+
+TestResult test_inline_caches(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val f = fn() { len(\"ab\"); }; f(); val len = fn(x) { 42; }; f();"), (Element) { INT, .INT = 42 }},
+		{ str("val sqr = fn(x) { x * x; }; val f = fn(n) { sqr(n) + sqr(n); }; f(2); f(3);"), (Element) { INT, .INT = 18 }},
+		{ str("val gt = fn(t) { fn(x) { x > t; }; }; val g3 = gt(3); val g5 = gt(5); g3(4); g5(4);"), (Element) { BOOL, .BOOL = false }},
+		{ str("val f = fn(c) { if (c) { val y = 1; } y; }; f(true); f(false);"), elem_from_str(ERR, str("Name not found: y")) },
+		{ str("val g = 1; val f = fn(c) { if (c) { val g = 2; } g; }; f(false); f(true);"), (Element) { INT, .INT = 2 }},
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	return pass();
+}
+
+TestResult test_jit(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val fib = fn(n) { if (n < 2) { return n; } fib(n - 1) + fib(n - 2); }; fib(20);"), (Element) { INT, .INT = 6765 }},
+		{ str("val even = fn(n) { if (n == 0) { true } else { !even(n - 1) } }; even(40);"), (Element) { BOOL, .BOOL = true }},
+		{ str("val m = fn(a, b) { -(a % b) * 2 / (1 + 0); }; var i = 0; var r = 0; while (i < 20) { r = m(i, 7); i = i + 1; } r;"), (Element) { INT, .INT = -10 }},
+		{ str("val add = fn(x, y) { x + y; }; var i = 0; while (i < 20) { add(i, i); i = i + 1; } add(\"a\", \"b\");"), elem_from_str(STR, str("ab")) },
+		{ str("val down = fn(x) { if (x == 0) { return 0; } 1 + down(x - 1); }; down(20); down(30000);"), (Element) { INT, .INT = 30000 }},
+	};
+	eval_jit(true);
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return eval_jit(false), fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	eval_jit(false);
+	return pass();
+}
+
+TestResult test_emit_c(Arena *a)
+{
+	char *expected[] = {
+		"static ASTList params_", "rt_fn(a, ns, &params_", "rt_infix(a, t0, (String) { \"+\", 1 }, t1)",
+		"rt_call(a, ns, t", "if (t1.type == RETURN) return *t1.RETURN.value;", "return rt_main(block_",
+	};
+	Parser *p = parser(a, lexer(a, str("val add = fn(x) { x + 1; }; add(2);")));
+	AST *prog = parse_program(p);
+	if (TEST(p->errors != NULL))
+		return fail(str("Parser errors"));
+	char *code = str_dupc(a, emit_c(a, prog, str("test.toy")));
+	for (int i = 0; i < arrlen(expected); i++) {
+		if (TEST(!strstr(code, expected[i])))
+			return fail(str_fmt(a, "Missing %s", expected[i]));
+	}
+	return pass();
+}
+
+TestResult test_constant_folding(Arena *a)
+{
+	struct {
+		String input;
+		String expected;
+	} tests[] = {
+		{ str("2 * (5 + 3);"), str("[16]") },
+		{ str("\"ab\" + \"cd\" == \"abcd\";"), str("[true]") },
+		{ str("!true;"), str("[false]") },
+		{ str("var x = 3; -x + 0; 1 * (-x * 1); x + 0;"), str("[|x=3|, (-x), (-x), (x+0)]") },
+		{ str("1 / 0; 1 + \"a\";"), str("[(1/0), (1+a)]") },
+		{ str("if (1 < 2) { 1; 2 } else { 3 }; if (false) { 4 }; val y = if (true) { 5 };"), str("[1, 2, NULL, |y=5|]") },
+		{ str("while (0) { 1 }; fn() { 2 + 2 };"), str("[NULL, [][4]]") },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Parser *p = parser(a, lexer(a, tests[i].input));
+		AST *prog = parse_program(p);
+		if (TEST(p->errors != NULL))
+			return fail(str_fmt(a, "Parser errors on test %d", i));
+		String res = ast_str(a, ast_optimize(a, prog));
+		if (TEST(!str_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Expected %.*s, got %.*s", fmt(tests[i].expected), fmt(res)));
+	}
+	return pass();
+}
+
+TestResult test_inlining(Arena *a)
+{
+	struct {
+		String input;
+		String expected;
+	} tests[] = {
+		{ str("val sqr = fn(x) { x * x; }; var y = 3; sqr(4); sqr(y); sqr(y + 1);"),
+			str("[|sqr=[x][(x*x)]|, |y=3|, 16, (y*y), (sqr<[(y+1)]>)]") },
+		{ str("val id = fn(x) { x }; val add = fn(a, b) { b + a }; id(1); add(1, 2); add(1, 2, 3);"),
+			str("[|id=[x][x]|, |add=[a, b][(b+a)]|, (id<[1]>), 3, (add<[1, 2, 3]>)]") },
+		{ str("val f = fn(n) { if (n < 2) { 1 } else { n * f(n - 1) } }; f(1);"),
+			str("[|f=[n][|if(n<2){[1]}[(n*(f<[(n-1)]>))]|]|, (f<[1]>)]") },
+		{ str("val k = 1; val g = fn(a) { a + k }; val h = fn(k) { g(k) }; g(2);"),
+			str("[|k=1|, |g=[a][(a+k)]|, |h=[k][(g<[k]>)]|, (g<[2]>)]") },
+		{ str("val k = 1; val g = fn(a) { a + k }; val h = fn(b) { g(b) }; g(2);"),
+			str("[|k=1|, |g=[a][(a+k)]|, |h=[b][(b+k)]|, (2+k)]") },
+		{ str("val f = fn(x) { x + bump() + x }; var y = 1; f(y); f(2); val g = fn(x) { x + len(x) }; g(y);"),
+			str("[|f=[x][((x+(bump<[]>))+x)]|, |y=1|, (f<[y]>), ((2+(bump<[]>))+2), |g=[x][(x+(len<[x]>))]|, (y+(len<[y]>))]") },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Parser *p = parser(a, lexer(a, tests[i].input));
+		AST *prog = parse_program(p);
+		if (TEST(p->errors != NULL))
+			return fail(str_fmt(a, "Parser errors on test %d", i));
+		String res = ast_str(a, ast_optimize(a, prog));
+		if (TEST(!str_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Expected %.*s, got %.*s", fmt(tests[i].expected), fmt(res)));
+	}
+	optimize_inline(false);
+	Parser *p = parser(a, lexer(a, str("val sqr = fn(x) { x * x; }; sqr(4);")));
+	String res = ast_str(a, ast_optimize(a, parse_program(p)));
+	optimize_inline(true);
+	if (TEST(!str_eq(res, str("[|sqr=[x][(x*x)]|, (sqr<[4]>)]"))))
+		return fail(str("Inlined while disabled"));
+	// The argument is read once, before the body's call assigns it
+	Interp *it = interp();
+	Element val = interp_eval(it, str("var y = 1; val bump = fn() { y = y + 10; 0 }; val f = fn(x) { x + bump() + x }; f(y);"));
+	bool ok = val.type == INT && val.INT == 2;
+	interp_free(&it);
+	if (TEST(!ok))
+		return fail(str("Inlined argument evaluated after a call assigned it"));
+	return pass();
+}
+
+TestResult test_loop_invariants(Arena *a)
+{
+	struct {
+		String input;
+		String expected;
+		Element value;
+	} tests[] = {
+		{ str("val k = 3; var i = 0; while (i < k * 2) { i = i + 1 }; i;"),
+			str("[|k=3|, |i=0|, |while (i<(hoisted (k*2))){[|i = (i+1)|]}|, i]"), (Element) { INT, .INT = 6 }},
+		{ str("var k = 3; var i = 0; while (i < k * 2) { i = i + 1; k = 2 }; i;"),
+			str("[|k=3|, |i=0|, |while (i<(k*2)){[|i = (i+1)|, |k = 2|]}|, i]"), (Element) { INT, .INT = 4 }},
+		{ str("val xs = [1]; var i = 0; while (i < len(xs)) { push(xs, i); i = i + 1; if (i > 3) { i = 9 } }; len(xs);"),
+			str("[|xs=[1]|, |i=0|, |while (i<(len<[xs]>)){[(push<[xs, i]>), |i = (i+1)|, |if(i>3){[|i = 9|]}|]}|, (len<[xs]>)]"),
+			(Element) { INT, .INT = 1 }},
+		{ str("val xs = [1, 2]; var i = 0; var s = 0; while (i < 4) { s = s + xs[1] * len(xs); i = i + 1 }; s;"),
+			str("[|xs=[1, 2]|, |i=0|, |s=0|, |while (i<4){[|s = (s+(hoisted ((xs[1])*(len<[xs]>))))|, |i = (i+1)|]}|, s]"),
+			(Element) { INT, .INT = 16 }},
+		{ str("val f = fn(n) { var i = 0; var s = 0; while (i < 2) { s = s + n * 2; if (n > 0) { s = s + f(n - 1) }; i = i + 1 }; s }; f(2);"),
+			str("[|f=[n][|i=0|, |s=0|, |while (i<2){[|s = (s+(hoisted (n*2)))|, |if(hoisted (n>0)){[|s = (s+(f<[(hoisted (n-1))]>))|]}|, |i = (i+1)|]}|, s]|, (f<[2]>)]"),
+			(Element) { INT, .INT = 16 }},
+		{ str("val f = fn(n) { var i = 0; var s = 0; while (i < 2) { s = s + n * 2; i = i + 1 }; s }; f(2) + f(5);"),
+			str("[|f=[n][|i=0|, |s=0|, |while (i<2){[|s = (s+(hoisted (n*2)))|, |i = (i+1)|]}|, s]|, ((f<[2]>)+(f<[5]>))]"),
+			(Element) { INT, .INT = 28 }},
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Parser *p = parser(a, lexer(a, tests[i].input));
+		AST *prog = parse_program(p);
+		if (TEST(p->errors != NULL))
+			return fail(str_fmt(a, "Parser errors on test %d", i));
+		prog = ast_optimize(a, prog);
+		String res = ast_str(a, prog);
+		if (TEST(!str_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Expected %.*s, got %.*s", fmt(tests[i].expected), fmt(res)));
+		if (TEST(!elem_eq(eval(a, ns_create(a, 16), prog), tests[i].value)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	if (TEST(optimize_stats().hoisted != 1))
+		return fail(str("Hoisted count mismatch"));
+	return pass();
+}
+
+TestResult test_loop_scratch(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("var xs = [0, 0]; var i = 0; var s = \"\"; while (i < 2) { var t = [\"a\" + \"b\"]; xs[i] = t[0] + \"c\"; s = s + t[0]; i = i + 1; } xs[1] + s;"),
+			elem_from_str(STR, str("abcabab")) },
+		{ str("var i = 0; var f = 0; while (i < 3) { if (i > 0) { i = i + f(1) } else { i = 1 }; var f = fn(x) { x + len(\"ab\" + \"c\") }; } i;"),
+			(Element) { INT, .INT = 5 }},
+		{ str("var i = 0; while (i < 3) { var j = 0; while (j < 3) { var k = [[\"x\" + \"y\"]]; j = j + len(k[0][0]); } i = i + j; } i;"),
+			(Element) { INT, .INT = 4 }},
+		{ str("var i = 0; while (i < 3) { i = i + 1; if (i == 2) { i + \"a\" } }"),
+			elem_from_str(ERR, str("Invalid types in operation: INT + STR")) },
+		// A string read from its binding keeps its value when the binding is assigned again
+		{ str("val t = \"ab\" + \"c\"; var s = \"\"; var keep = \"\"; var i = 0; "
+				"while (i < 3) { s = t + t; if (i == 1) { keep = s }; s = \"z\" + t; i = i + 1; } keep + s;"),
+			elem_from_str(STR, str("abcabczabc")) },
+		{ str("var s = \"a\" + \"b\"; s = \"cd\" + \"ef\"; val f = fn(x) { s = \"g\" + \"h\"; x }; f(s) + s;"),
+			elem_from_str(STR, str("cdefgh")) },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Temporaries of 2000 iterations would take ~700KB if they weren't reclaimed
+	Arena *loop_arena = arena(MB(16));
+	u64 before = loop_arena->used;
+	Element res = eval_wrapper(loop_arena, str("val s = \"xxxxxxxxxx\"; var i = 0; "
+				"while (i < 2000) { if (s + s + s + s + s + s + s + s == \"\") { 0 }; i = i + 1; } i;"));
+	u64 growth = loop_arena->used - before;
+	arena_free(&loop_arena);
+	if (TEST(res.type != INT || res.INT != 2000))
+		return fail(str("Loop result mismatch"));
+	if (TEST(growth > KB(128)))
+		return fail(str_fmt(a, "Loop grew its arena by %lu bytes", growth));
+
+	// Assigning an outer string reuses its buffer instead of leaving ~640KB of old copies
+	loop_arena = arena(MB(16));
+	before = loop_arena->used;
+	res = eval_wrapper(loop_arena, str("val t = \"ab\" + \"c\"; var s = \"\"; var i = 0; "
+				"while (i < 40000) { s = t + t; i = i + 1; } len(s);"));
+	growth = loop_arena->used - before;
+	arena_free(&loop_arena);
+	if (TEST(res.type != INT || res.INT != 6))
+		return fail(str("String assignment loop result mismatch"));
+	if (TEST(growth > KB(64)))
+		return fail(str_fmt(a, "Assigning a string in a loop grew the arena by %lu bytes", growth));
+	return pass();
+}
+
+TestResult test_namespace_growth(Arena *a)
+{
+	// Past the inline bindings and through a few table resizes, shadowing included
+	StrList *src = strlist(a);
+	for (int i = 0; i < 100; i++)
+		strpush(src, str_fmt(a, "val v%d = %d; ", i, i));
+	strpush(src, str("val f = fn(a, b, c, d, e, f, g, h, i, j) { val v3 = 1000; j + v3 + v99 + f }; "));
+	strpush(src, str("var v100 = 0; v100 = f(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) + v0 + v57; v100;"));
+	u64 len = 0;
+	for (StrNode *tmp = src->head; tmp; tmp = tmp->next)
+		len += tmp->string.len;
+	char *buf = arena_alloc(a, len);
+	len = 0;
+	for (StrNode *tmp = src->head; tmp; tmp = tmp->next)
+		memcpy(buf + len, tmp->string.buf, tmp->string.len), len += tmp->string.len;
+
+	Element res = eval_wrapper(a, (String) { buf, len });
+	if (TEST(!elem_eq(res, (Element) { INT, .INT = 10 + 1000 + 99 + 6 + 0 + 57 })))
+		return fail(str("Value mismatch"));
+	res = eval_wrapper(a, str("val f = fn(x, y) { fn(z) { x + y + z } }; val g = f(1, 2); val h = f(10, 20); g(3) + h(4);"));
+	if (TEST(!elem_eq(res, (Element) { INT, .INT = 40 })))
+		return fail(str("Closure value mismatch"));
+	return pass();
+}
+
+TestResult test_maps(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val m = {\"a\": 1, 2: \"two\", true: 3}; m[\"a\"] + m[true];"), (Element) { INT, .INT = 4 }},
+		{ str("val m = {\"a\": 1, 2: \"two\"}; m[2];"), elem_from_str(STR, str("two")) },
+		{ str("val m = {\"a\": 1, \"a\": 2}; m[\"a\"] + len(m);"), (Element) { INT, .INT = 3 }},
+		{ str("{\"a\": 1}[\"b\"];"), (Element) { NIL }},
+		{ str("val m = {}; m[\"x\"] = 5; m[\"x\"] = m[\"x\"] + 1; m[\"x\"];"), (Element) { INT, .INT = 6 }},
+		{ str("val m = {1: 1, 2: 2}; [has(m, 1), del(m, 1), has(m, 1), del(m, 1)][2];"), (Element) { BOOL, .BOOL = false }},
+		{ str("val m = {\"b\": 1, \"a\": 2, \"c\": 3}; del(m, \"a\"); keys(m)[1] + values(m)[0];"), (Element) { ERR }},
+		{ str("val m = {\"b\": 1, \"a\": 2, \"c\": 3}; del(m, \"a\"); keys(m)[1];"), elem_from_str(STR, str("c")) },
+		{ str("val m = {}; var i = 0; while (i < 1000) { m[\"k\" + i % 10] = i; i = i + 1; } 0;"),
+			elem_from_str(ERR, str("Invalid types in operation: STR + INT")) },
+		// Grown through deletions, keys built in the loop's scratch arena
+		{ str("val m = {}; var i = 0; while (i < 1000) { m[i] = [i * 2]; if (i % 3) { del(m, i - 1) }; i = i + 1; } "
+				"len(m) * 1000 + m[999][0] - m[998][0] + len(keys(m));"), (Element) { INT, .INT = 334 * 1000 + 1998 - 1996 + 334 }},
+		{ str("val mk = fn(x) { {x + \"k\": [x]} }; val m = mk(\"a\"); m[\"ak\"][0];"), elem_from_str(STR, str("a")) },
+		{ str("val m = {}; m[[1]] = 1;"), elem_from_str(ERR, str("Can't use ARRAY as a MAP key")) },
+		{ str("var m = {}; m = [1];"), elem_from_str(ERR, str("Can't assign type ARRAY of type m to variable of type MAP")) },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Aliases share the map, assignments copy it
+	Element res = eval_wrapper(a, str("val m = {1: 1}; var n = {}; n = m; n[2] = 2; val k = m; k[3] = 3; [len(m), len(n)];"));
+	if (TEST(res.type != ARRAY || res.ARRAY->len != 2 || res.ARRAY->items[0].INT != 2 || res.ARRAY->items[1].INT != 2))
+		return fail(str("Aliasing mismatch"));
+	return pass();
+}
+
+TestResult test_dynamic_arrays(Arena *a)
+{
+	String mk = str("val mk = fn() { [] }; var xs = mk(); ");
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("var i = 0; while (i < 100) { xs = push(xs, i); i = i + 1; } xs = pop(xs); len(xs) * 1000 + xs[98];"),
+			(Element) { INT, .INT = 99098 }},
+		{ str("xs = pop(xs); xs = push(xs, [1, 2]); xs = push(xs, [3]); len(xs[0]) + xs[1][0];"), (Element) { INT, .INT = 5 }},
+		{ str("xs = push(xs, \"a\" + \"b\"); xs = push(xs, 1); xs[0];"), elem_from_str(STR, str("ab")) },
+		// Other references to the array keep their value
+		{ str("xs = push(xs, 1); val ys = xs; xs = push(xs, 2); xs[0] = 9; ys[0] * 10 + len(ys);"), (Element) { INT, .INT = 11 }},
+		{ str("xs = push(xs, 1); val box = [xs]; xs = push(xs, 2); xs = pop(xs); xs = pop(xs); len(box[0]);"), (Element) { INT, .INT = 1 }},
+		{ str("xs = push(xs, 1); val f = fn(a) { fn() { len(a) } }; val g = f(xs); xs = push(xs, 2); g();"), (Element) { INT, .INT = 1 }},
+		{ str("xs = push(xs, 1); val ys = pop(xs); len(xs) * 10 + len(ys);"), (Element) { INT, .INT = 10 }},
+		{ str("reserve(xs, 64); xs = push(xs, 5); len(reserve(xs, 2)) + xs[0];"), (Element) { INT, .INT = 6 }},
+		{ str("xs = pop(pop(xs)); len(xs);"), (Element) { INT, .INT = 0 }},
+		// A parameter doesn't see the caller's array change under it during the call
+		{ str("xs = push(xs, 1); val f = fn(x) { xs = push(xs, 2); xs = [7, 8, 9]; len(x) * 10 + x[0]; }; f(xs) * 10 + len(xs);"),
+			(Element) { INT, .INT = 113 }},
+		{ str("var ys = range(2); var keep = ys; ys = [7, 8]; val z = ys; ys = [9, 10]; keep[1] * 100 + z[0] * 10 + ys[0];"),
+			(Element) { INT, .INT = 179 }},
+		{ str("reserve(xs, -1);"), elem_from_str(ERR, str("Wrong type for reserve got ARRAY and INT, expected ARRAY and a positive INT")) },
+		{ str("pop(\"abc\");"), elem_from_str(ERR, str("Wrong type for pop got STR")) },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, str_concat(a, mk, tests[i].input));
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Copying on every push would take 5000 * 5000 * 16 / 2 = ~200MB
+	Arena *push_arena = arena(GB(1));
+	u64 before = push_arena->used;
+	Element res = eval_wrapper(push_arena, str_concat(a, mk,
+				str("var i = 0; while (i < 5000) { xs = push(xs, i); i = i + 1; } len(xs);")));
+	u64 growth = push_arena->used - before;
+	arena_free(&push_arena);
+	if (TEST(res.type != INT || res.INT != 5000))
+		return fail(str("Push loop result mismatch"));
+	if (TEST(growth > MB(1)))
+		return fail(str_fmt(a, "Pushing grew the arena by %lu bytes", growth));
+
+	// Passing the array to a function doesn't take it from its binding
+	push_arena = arena(GB(1));
+	before = push_arena->used;
+	res = eval_wrapper(push_arena, str_concat(a, mk, str("val peek = fn(x) { len(x) }; "
+				"var i = 0; while (i < 5000) { peek(xs); xs = push(xs, i); i = i + 1; } len(xs);")));
+	growth = push_arena->used - before;
+	arena_free(&push_arena);
+	if (TEST(res.type != INT || res.INT != 5000))
+		return fail(str("Push loop with calls result mismatch"));
+	if (TEST(growth > MB(1)))
+		return fail(str_fmt(a, "Pushing after calls grew the arena by %lu bytes", growth));
+
+	// Assigning a new array over an owned one reuses its items instead of copying to the arena
+	push_arena = arena(GB(1));
+	before = push_arena->used;
+	res = eval_wrapper(push_arena, str("var ys = range(3); var i = 0; while (i < 20000) { ys = [i, i + 1, i + 2]; i = i + 1; } ys[2];"));
+	growth = push_arena->used - before;
+	arena_free(&push_arena);
+	if (TEST(res.type != INT || res.INT != 20001))
+		return fail(str("Array assignment loop result mismatch"));
+	if (TEST(growth > KB(64)))
+		return fail(str_fmt(a, "Assigning arrays in a loop grew the arena by %lu bytes", growth));
+
+	res = eval_wrapper(a, str("var xs = reserve([], 64); xs;"));
+	if (TEST(res.type != ARRAY || res.ARRAY->cap < 64))
+		return fail(str("Binding a reserved array lost its capacity"));
+	return pass();
+}
+
+TestResult test_array_slices(Arena *a)
+{
+	String mk = str("val mk = fn() { [] }; var xs = mk(); var i = 0; while (i < 5) { xs = push(xs, i); i = i + 1; } ");
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val t = slice(xs, 1, 4); len(t) * 10 + t[0] + t[2];"), (Element) { INT, .INT = 34 }},
+		{ str("len(slice(xs, -2, 2)) * 10 + len(slice(xs, 4, 100)) + len(slice(xs, 3, 1));"), (Element) { INT, .INT = 21 }},
+		{ str("slice(\"hello\", 1, 3);"), elem_from_str(STR, str("el")) },
+		{ str("car(cdr(cdr(xs))) + len(cdr(slice(xs, 0, 2)));"), (Element) { INT, .INT = 3 }},
+		{ str("cdr(slice(xs, 0, 1));"), (Element) { NIL }},
+		// Writes through either side don't show through the other
+		{ str("val t = cdr(xs); t[0] = 9; xs[1] * 10 + t[0];"), (Element) { INT, .INT = 19 }},
+		{ str("val t = cdr(xs); xs[1] = 9; xs[1] * 10 + t[0];"), (Element) { INT, .INT = 91 }},
+		{ str("xs = pop(xs); val t = slice(xs, 2, 4); xs = pop(xs); xs = push(xs, 7); t[1] * 10 + xs[3];"), (Element) { INT, .INT = 37 }},
+		{ str("var t = cdr(xs); t = push(t, 5); len(xs) * 10 + t[4];"), (Element) { INT, .INT = 55 }},
+		{ str("slice(xs, 0);"), (Element) { ERR }},
+		{ str("slice(mk, 0, 1);"), (Element) { ERR }},
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, str_concat(a, mk, tests[i].input));
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Each cdr shares the items instead of copying them
+	Arena *walk_arena = arena(GB(1));
+	Element res = eval_wrapper(walk_arena, str_concat(a, mk, str("while (i < 10000) { xs = push(xs, i); i = i + 1; } "
+				"val sum = fn(a, acc) { if (a) { sum(cdr(a), acc + car(a)) } else { acc } }; sum(xs, 0);")));
+	arena_free(&walk_arena);
+	if (TEST(res.type != INT || res.INT != 49995000))
+		return fail(str("Recursive walk result mismatch"));
+	return pass();
+}
+
+TestResult test_unrolled_lists(Arena *a)
+{
+	String mk = str("var xs = [0, 1, 2]; var ys = [3, 4]; var i = 3; ");
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("while (i < 200) { push(xs, i); i = i + 1; } var s = 0; i = 0; "
+				"while (i < 200) { s = s + xs[i]; i = i + 1; } s + xs[199] * 100000;"),
+			(Element) { INT, .INT = 19900 + 19900000 }},
+		{ str("while (i < 100) { push(xs, i); i = i + 1; } xs[70] = 0; xs[69] + xs[70] + xs[71] + car(cdr(xs));"),
+			(Element) { INT, .INT = 141 }},
+		{ str("val t = cdr(xs); push(xs, 7); push(t, 8); len(t) * 100 + t[2] * 10 + xs[3];"), (Element) { INT, .INT = 387 }},
+		{ str("concat(xs, ys); push(ys, 5); push(xs, 6); len(xs) * 100 + xs[5] * 10 + ys[2];"), (Element) { INT, .INT = 665 }},
+		{ str("val t = cdr(ys); concat(xs, t); push(xs, 5); len(xs) * 10 + xs[3] + len(ys);"), (Element) { INT, .INT = 56 }},
+		{ str("concat(xs, xs); push(xs, 9); len(xs) * 10 + xs[4] + xs[6];"), (Element) { INT, .INT = 80 }},
+		{ str("val t = cdr(xs); concat(t, xs); push(xs, 9); len(t) * 100 + t[2] * 10 + t[4] + len(xs);"), (Element) { INT, .INT = 506 }},
+		{ str("val t = cdr(cdr(xs)); concat(t, ys); xs[2] * 10 + len(xs) + len(t);"), (Element) { INT, .INT = 26 }},
+		{ str("xs[1];"), (Element) { INT, .INT = 1 }},
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, str_concat(a, mk, tests[i].input));
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Elements are stored in blocks rather than one node each
+	Element res = eval_wrapper(a, str_concat(a, mk, str("while (i < 1000) { push(xs, i); i = i + 1; } xs;")));
+	if (TEST(res.type != LIST || res.LIST->len != 1000))
+		return fail(str("Pushed list mismatch"));
+	u32 nodes = 0;
+	for (ElemNode *node = res.LIST->head; node; node = node->next)
+		nodes++;
+	if (TEST(nodes > 1000 / 32))
+		return fail(str_fmt(a, "%u nodes for 1000 elements", nodes));
+	return pass();
+}
+
+TestResult test_vectors(Arena *a)
+{
+	String mk = str("var v = vector(); var i = 0; while (i < 1100) { v = push(v, i); i = i + 1; } ");
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("var s = 0; i = 0; while (i < len(v)) { s = s + v[i]; i = i + 1; } s;"), (Element) { INT, .INT = 604450 }},
+		{ str("val w = set(v, 1050, 0); val u = set(w, 3, 0); v[1050] + w[3] * 10000 + u[1050] + u[3] + len(u);"),
+			(Element) { INT, .INT = 1050 + 30000 + 1100 }},
+		{ str("val w = set(v, 1099, -1); v[1099] * 10 + w[1099];"), (Element) { INT, .INT = 10989 }},
+		// Versions sharing a tail don't see each other's pushes
+		{ str("val p = pop(v); val a = push(p, -1); val b = push(p, -2); a[1099] * 10 + b[1099] + v[1099] * 100 + len(p);"),
+			(Element) { INT, .INT = -12 + 109900 + 1099 }},
+		{ str("while (i > 30) { v = pop(v); i = i - 1; } len(v) * 100 + v[29] + car(v);"), (Element) { INT, .INT = 3029 }},
+		{ str("while (i > 0) { v = pop(v); i = i - 1; } v = pop(v); v = push(v, 7); len(v) * 10 + v[0];"), (Element) { INT, .INT = 17 }},
+		{ str("val l = [1, 2]; val x = vector(l); val y = vector([\"a\"]); len(x) * 10 + x[1] + len(vector(v)) * 0;"),
+			(Element) { INT, .INT = 22 }},
+		{ str("v[2000];"), (Element) { NIL }},
+		{ str("type(v);"), (Element) { TYPE, .TYPE = VECTOR }},
+		{ str("v[0] = 1;"), elem_from_str(ERR, str("Can't assign to an index of a VECTOR, use set")) },
+		{ str("set(v, 1100, 1);"), elem_from_str(ERR, str("Out of bounds assignment: max index is 1099, attempted to access 1100")) },
+		{ str("vector(1);"), elem_from_str(ERR, str("Wrong type for vector got INT")) },
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, str_concat(a, mk, tests[i].input));
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Pushing a version only allocates its header in the evaluation arena
+	Arena *version_arena = arena(GB(1));
+	Element res = eval_wrapper(version_arena, str("val build = fn(v, i) { if (i < 5000) { build(push(v, i), i + 1) } else { v } }; "
+				"val v = build(vector(), 0); len(v) + v[4999];"));
+	u64 used = version_arena->used;
+	arena_free(&version_arena);
+	if (TEST(res.type != INT || res.INT != 9999))
+		return fail(str("Recursive build result mismatch"));
+	if (TEST(used > MB(1)))
+		return fail(str_fmt(a, "Building 5000 versions used %lu bytes", used));
+	return pass();
+}
+
+TestResult test_higher_order(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val xs = map(range(1, 5), fn(x) { x * 10 }); len(xs) * 1000 + xs[0] + xs[3];"), (Element) { INT, .INT = 4050 }},
+		{ str("val xs = filter(range(10), fn(x) { x % 3 == 0 }); len(xs) * 100 + xs[3];"), (Element) { INT, .INT = 409 }},
+		{ str("reduce(range(101), fn(acc, x) { acc + x }, 0);"), (Element) { INT, .INT = 5050 }},
+		{ str("reduce([], fn(acc, x) { acc + x }, 7);"), (Element) { INT, .INT = 7 }},
+		{ str("var l = [1, 2, 3]; reduce(map(l, fn(x) { [x] }), fn(acc, x) { acc + x[0] }, 0);"), (Element) { INT, .INT = 6 }},
+		{ str("val v = vector(range(40)); len(filter(v, fn(x) { x > 31 }));"), (Element) { INT, .INT = 8 }},
+		{ str("var s = 0; each(range(5), fn(x) { s = s + x; }); s;"), (Element) { INT, .INT = 10 }},
+		{ str("var n = 0; val found = any(range(100), fn(x) { n = n + 1; x == 3 }); if (found) { n } else { 0 };"), (Element) { INT, .INT = 4 }},
+		{ str("all(range(5), fn(x) { x < 5 });"), (Element) { BOOL, .BOOL = true }},
+		{ str("all(range(5), fn(x) { x < 4 });"), (Element) { BOOL, .BOOL = false }},
+		{ str("any([], fn(x) { true });"), (Element) { BOOL, .BOOL = false }},
+		{ str("val add = fn(n) { fn(x) { x + n } }; map(range(3), add(5))[2];"), (Element) { INT, .INT = 7 }},
+		{ str("map(range(3), fn(x) { \"s\" + x });"), (Element) { ERR }},
+		{ str("len(map(range(3), type));"), (Element) { INT, .INT = 3 }},
+		{ str("len(range(5, 2));"), (Element) { INT, .INT = 0 }},
+		{ str("map(1, fn(x) { x });"), elem_from_str(ERR, str("Wrong types for map got INT and FUNCTION, expected ARRAY, LIST or VECTOR and a function")) },
+		{ str("reduce(range(3), 1, 0);"), elem_from_str(ERR, str("Wrong types for reduce got ARRAY and INT, expected ARRAY, LIST or VECTOR and a function")) },
+		{ str("range(\"a\");"), elem_from_str(ERR, str("Wrong types for range got INT and STR, expected INT")) },
+		{ str("range(4294967297);"), elem_from_str(ERR, str("range too long: 4294967297 items, at most 4294967295")) },
+		{ str("len(range(5, 4294967300 - 4294967290));"), (Element) { INT, .INT = 5 }},
+	};
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+
+	// Tested results are left in the call frame instead of piling up in the caller's arena
+	Arena *hof_arena = arena(GB(1));
+	Element res = eval_wrapper(hof_arena, str("len(filter(range(20000), fn(x) { [x, x, x] }));"));
+	u64 used = hof_arena->used;
+	arena_free(&hof_arena);
+	if (TEST(res.type != INT || res.INT != 20000))
+		return fail(str("Filter result mismatch"));
+	if (TEST(used > MB(1)))
+		return fail(str_fmt(a, "Filtering 20000 items used %lu bytes", used));
+	return pass();
+}
+
+TestResult test_parallel_builtins(Arena *a)
+{
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val xs = pmap(range(1000), fn(x) { x * x }); xs[999] - xs[998] + len(xs);"), (Element) { INT, .INT = 2997 }},
+		{ str("val fib = fn(n) { if (n < 2) { n } else { fib(n - 1) + fib(n - 2) } }; pmap(range(20), fib)[19];"), (Element) { INT, .INT = 4181 }},
+		{ str("val xs = pfilter(range(100), fn(x) { x % 7 == 0 }); len(xs) * 100 + xs[14];"), (Element) { INT, .INT = 1598 }},
+		{ str("preduce(range(1001), fn(a, b) { a + b }, 0);"), (Element) { INT, .INT = 500500 }},
+		{ str("preduce(map(range(26), fn(x) { \"ab\" }), fn(a, b) { a + b }, \">\");"), elem_from_str(STR, str(">abababababababababababababababababababababababababab")) },
+		{ str("preduce([], fn(a, b) { a + b }, 7);"), (Element) { INT, .INT = 7 }},
+		{ str("var l = [1, 2, 3, 4]; len(pmap(l, fn(x) { [x] }));"), (Element) { INT, .INT = 4 }},
+		{ str("pmap(vector(range(40)), fn(x) { x + 1 })[39];"), (Element) { INT, .INT = 40 }},
+		{ str("val sq = fn(x) { x * x }; pmap(range(10), fn(x) { reduce(pmap(range(x), sq), fn(a, b) { a + b }, 0) })[9];"), (Element) { INT, .INT = 204 }},
+		{ str("pmap(range(200), fn(x) { var acc = []; var i = 0; while (i < x) { acc = push(acc, i); i = i + 1; }; len(acc) })[199];"), (Element) { INT, .INT = 199 }},
+		{ str("val v = vector([1]); val vs = pmap(range(64), fn(x) { push(v, x) }); vs[63][1] + len(v);"), (Element) { INT, .INT = 64 }},
+		// Writes to bindings or containers outside of the function run one item at a time
+		{ str("var n = 0; pmap(range(1000), fn(x) { n = n + 1; x }); n;"), (Element) { INT, .INT = 1000 }},
+		{ str("var n = 0; val count = fn() { n = n + 1 }; pfilter(range(500), fn(x) { count(); true }); n;"), (Element) { INT, .INT = 500 }},
+		{ str("val m = {}; pmap(range(300), fn(x) { m[x] = x }); len(keys(m));"), (Element) { INT, .INT = 300 }},
+		{ str("val mk = fn() { [0] }; val xs = mk(); pmap(range(400), fn(x) { xs[0] = xs[0] + 1 }); xs[0];"), (Element) { INT, .INT = 400 }},
+		{ str("var l = [0]; pmap(range(100), fn(x) { push(l, x) }); len(l);"), (Element) { INT, .INT = 101 }},
+		{ str("pmap(range(50), fn(x) { if (x == 30) { x + \"a\" } else { x } });"), elem_from_str(ERR, str("Invalid types in operation: INT + STR")) },
+		{ str("pmap(1, fn(x) { x });"), elem_from_str(ERR, str("Wrong types for pmap got INT and FUNCTION, expected ARRAY, LIST or VECTOR and a function")) },
+		{ str("preduce(range(3), fn(a, b) { a + b });"), (Element) { ERR }},
+	};
+	eval_threads(4);
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = eval_wrapper(a, tests[i].input);
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	return pass();
+}
+
+typedef struct InterpRun {
+	u32		seed;
+	bool	jit;
+	Element	result;
+	String	output;
+} InterpRun;
+
+// Bindings of the first call stay around for the second, fib runs deep enough to be jitted
+void *interp_thread(void *arg)
+{
+	InterpRun *run = arg;
+	Interp *it = interp();
+	it->jit = run->jit;
+	Arena *a = arena(KB(4));
+	interp_eval(it, str_fmt(a, "val n = %u; val fib = fn(x) { if (x < 2) { x } else { fib(x - 1) + fib(x - 2) } };", run->seed));
+	run->result = interp_eval(it, str("print(\"n=\", n); fib(20) + n;"));
+	run->output = str_dup(a, interp_output(it));
+	interp_free(&it);
+	return NULL;
+}
+
+void *interrupt_later(void *arg)
+{
+	usleep(50000);
+	interp_interrupt(arg);
+	return NULL;
+}
+
+TestResult test_interpreters(Arena *a)
+{
+	InterpRun runs[4] = {0};
+	pthread_t threads[arrlen(runs)];
+	for (u32 i = 0; i < arrlen(runs); i++) {
+		runs[i] = (InterpRun) { .seed = i * 100, .jit = i % 2 };
+		pthread_create(&threads[i], NULL, interp_thread, &runs[i]);
+	}
+	for (u32 i = 0; i < arrlen(runs); i++)
+		pthread_join(threads[i], NULL);
+	for (u32 i = 0; i < arrlen(runs); i++) {
+		if (TEST(!elem_eq(runs[i].result, (Element) { INT, .INT = 6765 + i * 100 })))
+			return fail(str_fmt(a, "Value mismatch on interpreter %u", i));
+		if (TEST(!str_eq(runs[i].output, str_fmt(a, "n=%u\n", i * 100))))
+			return fail(str_fmt(a, "Output mismatch on interpreter %u", i));
+	}
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("val x = ;"), (Element) { ERR }},
+		{ str("val y = 1; y = 2;"), (Element) { ERR }},
+		{ str("val f = fn(x) { f(x + 1) }; f(0);"), (Element) { ERR }},
+		{ str("val g = fn(x) { if (x == 0) { 0 } else { 1 + g(x - 1) } }; g(1000);"), (Element) { INT, .INT = 1000 }},
+	};
+	Interp *it = interp();
+	it->max_depth = 5000;
+	for (int i = 0; i < arrlen(tests); i++) {
+		Element res = interp_eval(it, tests[i].input);
+		if (tests[i].expected.type == ERR && tests[i].expected.len == 0) {
+			if (TEST(res.type != ERR))
+				return fail(str_fmt(a, "Expected an error on test %d", i));
+			continue;
+		}
+		if (TEST(!elem_eq(res, tests[i].expected)))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	// Running out of space deep in calls gives back the arrays they borrowed
+	interp_eval(it, str("var xs = range(2); val deep = fn(a, n) { if (n == 0) { var s = \"x\"; while (true) { s = s + s; } } deep(a, n - 1) };"));
+	for (u32 i = 0; i < 2; i++)
+		if (TEST(interp_eval(it, str("deep(xs, 100);")).type != ERR))
+			return fail(str("Expected running out of space to be an error"));
+	if (TEST(ns_get_inner(it->ns, str("xs"))->element.ARRAY->lent != 0))
+		return fail(str("An array is still lent to unwound calls"));
+	pthread_t interrupter;
+	pthread_create(&interrupter, NULL, interrupt_later, it);
+	Element res = interp_eval(it, str("var i = 0; while (true) { i = i + 1; }"));
+	pthread_join(interrupter, NULL);
+	if (TEST(!elem_eq(res, elem_from_str(ERR, str("Interrupted")))))
+		return fail(str("Expected a loop that never ends to be interrupted"));
+	interp_free(&it);
+	return pass();
+}
+
+// Compiled once, run with different arguments and reset between runs, with a global
+// from interp_eval and a jitted function defined by the script itself
+TestResult test_scripts(Arena *a)
+{
+	Interp *it = interp();
+	it->jit = true;
+	interp_eval(it, str("val scale = fn(x) { x * 10 };"));
+	Script *script = interp_compile(it, str("val fib = fn(x) { if (x < 2) { x } else { fib(x - 1) + fib(x - 2) } }; print(name, \"!\"); scale(fib(n)) + len(vector(range(n)));"));
+	for (u32 i = 0; i < 40; i++) {
+		u32 n = 10 + i % 5;
+		ScriptArg args[] = { { str("n"), (Element) { INT, .INT = n } }, { str("name"), elem_from_str(STR, str_fmt(a, "run%u", i)) } };
+		Element res = interp_run(it, script, args, arrlen(args));
+		i64 fib[] = { 55, 89, 144, 233, 377 };
+		if (TEST(!elem_eq(res, (Element) { INT, .INT = fib[i % 5] * 10 + n })))
+			return fail(str_fmt(a, "Value mismatch on run %u", i));
+		if (TEST(!str_eq(interp_output(it), str_fmt(a, "run%u!\n", i))))
+			return fail(str_fmt(a, "Output mismatch on run %u", i));
+		interp_reset(it);
+		if (TEST(it->run->used != sizeof(Arena)))
+			return fail(str_fmt(a, "Run %u left memory behind", i));
+	}
+	if (TEST(interp_run(it, script, NULL, 0).type != ERR))
+		return fail(str("Expected an error for missing arguments"));
+	if (TEST(interp_run(it, interp_compile(it, str("val x = ;")), NULL, 0).type != ERR))
+		return fail(str("Expected a parser error"));
+	interp_free(&it);
+
+	// Values stored into globals outlive the run that made them
+	it = interp();
+	interp_eval(it, str("var xs = range(2); var ls = [0, 1]; var m = {};"));
+	Script *store = interp_compile(it, str("xs[i] = range(n); ls[i] = \"n\" + \"=\"; m[i] = [n];"));
+	Script *churn = interp_compile(it, str("var junk = range(n); len(junk);"));
+	for (u32 i = 0; i < 2; i++) {
+		ScriptArg args[] = { { str("i"), (Element) { INT, .INT = i } }, { str("n"), (Element) { INT, .INT = 5 + i } } };
+		interp_run(it, store, args, arrlen(args));
+		interp_reset(it);
+		interp_run(it, churn, (ScriptArg[]) { { str("n"), (Element) { INT, .INT = 1000 } } }, 1);
+		interp_reset(it);
+	}
+	Element res = interp_eval(it, str("len(xs[0]) + xs[1][5] + len(ls[1]) + m[1][0];"));
+	interp_free(&it);
+	if (TEST(!elem_eq(res, (Element) { INT, .INT = 5 + 5 + 2 + 6 })))
+		return fail(str("Global containers lost values stored by a run"));
+	return pass();
+}
+
+priv Element native_clamp(Arena *a, Namespace *ns, ElemArray *args)
+{
+	for (u32 i = 0; i < args->len; i++)
+		if (args->items[i].type != INT) return elem_from_str(ERR, str("clamp takes INTs"));
+	i64 x = args->items[0].INT;
+	return (Element) { INT, .INT = MIN(MAX(x, args->items[1].INT), args->items[2].INT) };
+}
+
+priv Element native_total(Arena *a, Namespace *ns, ElemArray *args)
+{
+	i64 total = 0;
+	for (u32 i = 0; i < args->len; i++)
+		total += (args->items[i].type == INT) ? args->items[i].INT : 0;
+	return (Element) { INT, .INT = total };
+}
+
+priv u32 len_calls = 0;
+priv Element native_len(Arena *a, Namespace *ns, ElemArray *args)
+{
+	len_calls++;
+	return (Element) { INT, .INT = -1 };
+}
+
+TestResult test_natives(Arena *a)
+{
+	Native natives[] = {
+		{ str("clamp"), &native_clamp, 3 },
+		{ str("total"), &native_total, -1 },
+		{ str("len"), &native_len, 1 },
+	};
+	struct {
+		String input;
+		Element expected;
+	} tests[] = {
+		{ str("clamp(15, 0, 10) + clamp(-3, 0, 10) + clamp(4, 0, 10);"), (Element) { INT, .INT = 14 }},
+		{ str("total() + total(1) + total(1, 2, 3, \"x\", 4);"), (Element) { INT, .INT = 11 }},
+		{ str("reduce(map(range(20), fn(x) { clamp(x, 5, 15) }), fn(a, b) { a + b }, 0);"), (Element) { INT, .INT = 195 }},
+		{ str("val c = clamp; c(100, 1, 2);"), (Element) { INT, .INT = 2 }},
+		{ str("preduce(pmap(range(100), fn(x) { clamp(x, 10, 20) }), total, 0);"), (Element) { INT, .INT = 1845 }},
+		{ str("len([1, 2, 3]);"), (Element) { INT, .INT = -1 }},
+		{ str("val clamp = fn(x, lo, hi) { 0 }; clamp(5, 1, 3);"), (Element) { INT, .INT = 0 }},
+		{ str("clamp(1, 2);"), elem_from_str(ERR, str("Wrong number of args: got 2, expected 3")) },
+		{ str("clamp(1, 2, true);"), elem_from_str(ERR, str("clamp takes INTs")) },
+	};
+	eval_threads(4);
+	for (int i = 0; i < arrlen(tests); i++) {
+		Interp *it = interp_with(natives, arrlen(natives));
+		Element res = interp_eval(it, tests[i].input);
+		bool same = elem_eq(res, tests[i].expected);
+		interp_free(&it);
+		if (TEST(!same))
+			return fail(str_fmt(a, "Value mismatch on test %d", i));
+	}
+	// The optimizer knows nothing of a native len, so it isn't hoisted out of the loop
+	Interp *it = interp_with(natives, arrlen(natives));
+	len_calls = 0;
+	Element res = interp_eval(it, str("val xs = [1]; var i = 0; var n = 0; while (i < 3) { n = n + len(xs); i = i + 1; } n;"));
+	interp_free(&it);
+	if (TEST(!elem_eq(res, (Element) { INT, .INT = -3 }) || len_calls != 3))
+		return fail(str_fmt(a, "Native len called %u times instead of 3", len_calls));
+	it = interp();
+	bool hidden = (interp_eval(it, str("clamp(1, 2, 3);")).type == ERR);
+	interp_free(&it);
+	if (TEST(!hidden))
+		return fail(str("Natives leaked to another interpreter"));
+	return pass();
+}
+
 /* // Helpers */
 Element eval_wrapper(Arena *a, String input)
 {
@@ -34,8 +34,9 @@ TestResult all_tokens_test(Arena *arena)
 	Token expected[] = {
 		{TK_NIL, str("NIL")}, {TK_WHILE, str("while")},
 		{TK_SEMICOLON, str(";")}, {TK_COMMA, str(",")},
-		{TK_BANG, str("!")}, {TK_STAR, str("*")},
-		{TK_GT, str(">")}, {TK_LT, str("<")},
+		{TK_COLON, str(":")}, {TK_BANG, str("!")},
+		{TK_STAR, str("*")}, {TK_GT, str(">")},
+		{TK_LT, str("<")},
 		{TK_LPAREN, str("(")}, {TK_RPAREN, str(")")},
 		{TK_LBRACE, str("{")}, {TK_RBRACE, str("}")},
 		{TK_LBRACKET, str("[")}, {TK_RBRACKET, str("]")},
@@ -50,7 +51,7 @@ TestResult all_tokens_test(Arena *arena)
 	};
 
 	Lexer *l = lexer(
-	    arena, str("NIL while;,!*><(){}[]+-= == != 20 name fn val var return if else "
+	    arena, str("NIL while;,:!*><(){}[]+-= == != 20 name fn val var return if else "
 		       "true false \"This is a string\""));
 	Token t = lexer_token(l);
 	int i = 0;
@@ -0,0 +1,67 @@
+#include "tests.h"
+#include <time.h>
+
+#define ITERATIONS 1000000
+
+// Time per iteration of a loop reading a global, against the number of bindings in the
+// program namespace, next to the same loop without the read.
+// The probed name is also bound as a parameter so identifier caches can't skip the lookup.
+priv double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+priv double run(Arena *a, String src)
+{
+	Parser *p = parser(a, lexer(a, src));
+	AST *prog = parse_program(p);
+	if (p->errors) {
+		parser_print_errors(p);
+		exit(1);
+	}
+	Namespace *ns = ns_create(a, 16);
+	double start = now();
+	Element res = eval(a, ns, prog);
+	double elapsed = now() - start;
+	if (res.type == ERR) {
+		str_print(elem_str(res)), str_print(str("\n"));
+		exit(1);
+	}
+	return elapsed;
+}
+
+priv String program(Arena *a, u32 bindings, bool probe)
+{
+	StrList *src = strlist(a);
+	for (u32 i = 0; i < bindings; i++)
+		strpush(src, str_fmt(a, "val v%u = %u; ", i, i));
+	strpush(src, str("val shadow = fn(v0) { v0 }; shadow(1); var i = 0; var s = 0; "));
+	strpush(src, str_fmt(a, "while (i < %u) { s = s + %s; i = i + 1; } s;", ITERATIONS, (probe) ? "v0" : "0"));
+	u64 len = 0;
+	for (StrNode *tmp = src->head; tmp; tmp = tmp->next)
+		len += tmp->string.len;
+	char *buf = arena_alloc(a, len);
+	len = 0;
+	for (StrNode *tmp = src->head; tmp; tmp = tmp->next)
+		memcpy(buf + len, tmp->string.buf, tmp->string.len), len += tmp->string.len;
+	return (String) { buf, len };
+}
+
+int main(void)
+{
+	u32 counts[] = { 1, 4, 8, 16, 64, 256, 1024, 4096 };
+	str_print(str("bindings\tns/iteration\twith lookup\n"));
+	for (int i = 0; i < arrlen(counts); i++) {
+		Arena *a = arena(GB(1));
+		double base = 1e9, probed = 1e9;
+		for (int j = 0; j < 3; j++) {
+			base = MIN(base, run(a, program(a, counts[i], false)));
+			probed = MIN(probed, run(a, program(a, counts[i], true)));
+		}
+		str_print(str_fmt(a, "%u\t\t%.1f\t\t%.1f\n", counts[i], base * 1e9 / ITERATIONS, probed * 1e9 / ITERATIONS));
+		arena_free(&a);
+	}
+	return 0;
+}
@@ -10,6 +10,7 @@ TestResult int_literal_tests(Arena *a);
 TestResult string_literal_tests(Arena *a);
 TestResult bool_literal_tests(Arena *a);
 TestResult list_literal_tests(Arena *a);
+TestResult map_literal_tests(Arena *a);
 TestResult index_expression_tests(Arena *a);
 TestResult prefix_expression_tests(Arena *a);
 TestResult infix_expression_tests(Arena *a);
@@ -27,6 +28,7 @@ int main(int ac, char **av)
 	    {str("STRING LITERAL EXPRESSIONS"), &string_literal_tests},
 	    {str("BOOL LITERAL EXPRESSIONS"), &bool_literal_tests},
 	    {str("LIST LITERAL EXPRESSIONS"), &list_literal_tests},
+	    {str("MAP LITERAL EXPRESSIONS"), &map_literal_tests},
 	    {str("INDEX EXPRESSIONS"), &index_expression_tests},
 	    {str("PREFIX EXPRESSIONS"), &prefix_expression_tests},
 	    {str("INFIX EXPRESSIONS"), &infix_expression_tests},
@@ -251,6 +253,33 @@ TestResult list_literal_tests(Arena *a)
 	return pass();
 }
 
+TestResult map_literal_tests(Arena *a)
+{
+	Lexer *l= lexer(a, str("{\"one\": 1, 2: 3 * 5}; {}"));
+	Parser *p = parser(a, l);
+	ASTList *expected_map = astlist(a);
+	astpush(expected_map, ast_alloc(a, (AST) { AST_STR, .AST_STR = str("one") }));
+	astpush(expected_map, ast_alloc(a, (AST) { AST_INT, .AST_INT = {1} }));
+	astpush(expected_map, ast_alloc(a, (AST) { AST_INT, .AST_INT = {2} }));
+	astpush(expected_map, ast_alloc(a, (AST) { AST_INFIX, .AST_INFIX = {
+				.left = ast_alloc(a, (AST) { AST_INT, .AST_INT = {3} }),
+				.op = str("*"),
+				.right = ast_alloc(a, (AST) { AST_INT, .AST_INT = {5} })
+				}}));
+	AST	*expected_node = ast_alloc(a, (AST) { AST_MAP, .AST_MAP = expected_map });
+
+	AST *prog = parse_program(p);
+	if (TEST(p->errors && p->errors->len > 0))
+		return (parser_print_errors(p), fail(str("Parsing has errors")));
+	AST *ex = prog->AST_LIST->head->ast;
+	if (TEST(!ast_eq(expected_node, ex)))
+		return fail(str("Nodes are different"));
+	AST *empty = prog->AST_LIST->tail->ast;
+	if (TEST(empty->type != AST_MAP || empty->AST_MAP->len != 0))
+		return fail(str("Empty map mismatch"));
+	return pass();
+}
+
 TestResult index_expression_tests(Arena *a)
 {
 	Lexer *l= lexer(a, str("theList[1 + 1]"));
@@ -8,12 +8,10 @@ bool run_test(Arena *arena, Test test)
 		str_print(str(" KO\n"));
 		str_print(res.msg);
 		str_print(str("\n"));
-		return false;
-	} else {
+	} else
 		str_print(str(" OK\n"));
-		return true;
-	}
 	arena_reset(arena);
+	return res.passed;
 }
 
 TestResult fail(String msg)
@@ -61,6 +59,8 @@ bool ast_eq(AST *node1, AST *node2)
 		case AST_PROGRAM:
 		case AST_LIST:
 			return astlist_eq(node1->AST_LIST, node2->AST_LIST);
+		case AST_MAP:
+			return astlist_eq(node1->AST_MAP, node2->AST_MAP);
 		case AST_RETURN:
 			return ast_eq(node1->AST_RETURN.value, node2->AST_RETURN.value);
 		case AST_VAL: {
@@ -102,6 +102,8 @@ bool ast_eq(AST *node1, AST *node2)
 		} break;
 		case AST_WHILE: // TODO implement
 			return true;
+		case AST_INVARIANT:
+			return ast_eq(node1->AST_INVARIANT.value, node2->AST_INVARIANT.value);
 		case AST_CALL: {
 			if (!ast_eq(node1->AST_CALL.function, node2->AST_CALL.function))
 				return false;
@@ -1,53 +1,165 @@
 #include "base.h"
 #include "toyscript.h"
 #include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+
+#define SERVE_HEADER_MAX KB(4)
+#define SERVE_SOURCE_MAX MB(64)
+#define SERVE_ARGS_MAX 64
+#define SERVE_CACHE 1024 // Scripts kept compiled, a power of two
+#define SERVE_TIMEOUT_MS 5000 // For a client to send its whole request, and for each write back
+#define SERVE_RUN_SECONDS 30 // A script still running by then is interrupted
+#define RECORDS_BUFFER KB(64)
+
+priv int repl(Interp *it);
+priv int serve(Interp *it, char *path);
+priv int run_workers(Interp *it, char *filename, u32 workers, char **inputs, u32 len);
+priv int run_records(Interp *it, String body, char **files, u32 len);
+priv int exec_source(Interp *it, String src);
+priv int exec_file(Interp *it, char *filename);
+priv int transpile_file(char *filename);
+priv int dump_ast(char *filename);
+
+global bool optimize = true;
 
-priv int repl();
-priv int exec_file(char *filename);
 int main(int ac, char **av)
 {
-	if (ac < 2)
-		return repl();
-	return exec_file(av[1]);
+	char *filename = NULL;
+	char *socket_path = NULL;
+	char *source = NULL;
+	char **inputs = (ac > 1) ? &av[1] : av; // Positional arguments, in place
+	u32 inputs_len = 0;
+	u32 workers = 0;
+	bool records = false;
+	bool emit = false;
+	bool dump = false;
+	Interp *it = interp();
+	it->out_fd = 1;
+	for (int i = 1; i < ac; i++) {
+		if (str_eq(cstr(av[i]), str("--max-depth")) && (i + 1) < ac) {
+			i++;
+			it->max_depth = (u32)str_atol(cstr(av[i]));
+		} else if (str_eq(cstr(av[i]), str("--threads")) && (i + 1) < ac) {
+			i++;
+			eval_threads((u32)str_atol(cstr(av[i])));
+		} else if (str_eq(cstr(av[i]), str("--serve")) && (i + 1) < ac) {
+			i++;
+			socket_path = av[i];
+		} else if (str_eq(cstr(av[i]), str("--workers")) && (i + 1) < ac) {
+			i++;
+			workers = (u32)str_atol(cstr(av[i]));
+		} else if (str_eq(cstr(av[i]), str("-e")) && (i + 1) < ac) {
+			i++;
+			source = av[i];
+		} else if (str_eq(cstr(av[i]), str("-n")))
+			records = true;
+		else if (str_eq(cstr(av[i]), str("--specialize")))
+			it->specialize = true;
+		else if (str_eq(cstr(av[i]), str("--jit")))
+			it->jit = true;
+		else if (str_eq(cstr(av[i]), str("--emit-c")))
+			emit = true;
+		else if (str_eq(cstr(av[i]), str("--dump-ast")))
+			dump = true;
+		else if (str_eq(cstr(av[i]), str("--no-optimize")))
+			optimize = it->optimize = false;
+		else if (str_eq(cstr(av[i]), str("--no-inline")))
+			optimize_inline(false), it->inlining = false;
+		else
+			inputs[inputs_len++] = av[i];
+	}
+	if (!source && inputs_len) // The script, then its inputs
+		filename = *inputs++, inputs_len--;
+	if (socket_path && filename) // Scripts come with the requests
+		return dprintf(2, "Unexpected argument: %s\n", filename), 1;
+	if (inputs_len && !records && !(workers && filename)) // Nothing else reads inputs
+		return dprintf(2, "Unexpected argument: %s\n", *inputs), 1;
+	if (socket_path)
+		return serve(it, socket_path);
+	if (records && (source || filename)) {
+		Arena *a = arena(MB(64));
+		return run_records(it, (source) ? cstr(source) : str_read_file(a, filename), inputs, inputs_len);
+	}
+	if (source)
+		return exec_source(it, cstr(source));
+	if (!filename)
+		return repl(it);
+	if (emit)
+		return transpile_file(filename);
+	if (dump)
+		return dump_ast(filename);
+	if (workers)
+		return run_workers(it, filename, workers, inputs, inputs_len);
+	return exec_file(it, filename);
 }
 
-priv int exec_file(char *filename)
+priv int transpile_file(char *filename)
 {
-	Arena *stdin_arena = arena(MB(1));
-	String file = str_read_file(stdin_arena, filename);
-	Lexer  *l = lexer(stdin_arena, file);
-
 	Arena *program_arena = arena(GB(1));
-	Parser *p = parser(program_arena, l);
+	String file = str_read_file(program_arena, filename);
+	Parser *p = parser(program_arena, lexer(program_arena, file));
 	AST *program = parse_program(p);
-	arena_free(&stdin_arena);
+	if (p->errors || !program) {
+		parser_print_errors(p);
+		return 1;
+	}
+	if (optimize)
+		program = ast_optimize(program_arena, program);
+	str_print(emit_c(program_arena, program, cstr(filename)));
+	return 0;
+}
 
-	Arena *bindings_arena = arena(MB(1));
-	Namespace *bindings = ns_create(bindings_arena, 16);
-	Element exit_elem = eval(program_arena, bindings, program);
-	if (p->errors) {
+priv int dump_ast(char *filename)
+{
+	Arena *program_arena = arena(GB(1));
+	String file = str_read_file(program_arena, filename);
+	Parser *p = parser(program_arena, lexer(program_arena, file));
+	AST *program = parse_program(p);
+	if (p->errors || !program) {
 		parser_print_errors(p);
 		return 1;
 	}
+	if (optimize)
+		program = ast_optimize(program_arena, program);
+	str_print(ast_str(program_arena, program)), str_print(str("\n"));
+	OptimizeStats stats = optimize_stats();
+	str_print(str_fmt(program_arena, "folded: %u, inlined: %u, hoisted: %u\n",
+				stats.folded, stats.inlined, stats.hoisted));
+	return 0;
+}
+
+priv int exec_file(Interp *it, char *filename)
+{
+	Arena *stdin_arena = arena(MB(1));
+	String file = str_read_file(stdin_arena, filename);
+	int status = exec_source(it, file);
+	arena_free(&stdin_arena);
+	return status;
+}
+
+priv int exec_source(Interp *it, String src)
+{
+	Element exit_elem = interp_eval(it, src);
 	if (exit_elem.type == ERR) {
-		str_print(exit_elem.ERR), str_print(str("\n"));
+		str_print(elem_str(exit_elem)), str_print(str("\n"));
 		return 1;
 	}
 	return (exit_elem.type == INT) ? (i32)exit_elem.INT : 0;
 }
 
 priv String read_stdin(Arena *a);
-priv int repl()
+priv int repl(Interp *it)
 {
 	String input = {0};
-	Lexer	*l;
-	Parser	*p;
-	AST		*program;
-
 	Arena	*stdin_arena = arena(MB(4));
-	Arena	*program_arena = arena(GB(4));
-	Arena	*namespace_arena = arena(GB(4));
-	Namespace *ns = ns_create(namespace_arena, 16);
 
 	str_print(str("-TOYSCRIPT REPL-\n"));
 
@@ -56,21 +168,14 @@ priv int repl()
 		str_print(str("~ "));
 		input = read_stdin(stdin_arena);
 		if (str_eq(input, str("exit"))) break;
-		l = lexer(stdin_arena, input);
-		p = parser(program_arena, l);
-		program = parse_program(p);
-		Element result = eval(program_arena, ns, program);
-		if (p->errors) 
-			parser_print_errors(p);
-		else {
-			if (result.type == STR) {
-				str_print(str_fmt(stdin_arena, "\"%.*s\"",
-							fmt(to_string(stdin_arena, result)))); 
-			} else {
-				str_print(to_string(stdin_arena, result)); 
-			}
-			str_print(str("\n"));
+		Element result = interp_eval(it, input);
+		if (result.type == STR) {
+			str_print(str_fmt(stdin_arena, "\"%.*s\"",
+						fmt(to_string(stdin_arena, result)))); 
+		} else {
+			str_print(to_string(stdin_arena, result)); 
 		}
+		str_print(str("\n"));
 		arena_reset(stdin_arena);
 	}
 	return 0;
@@ -84,3 +189,413 @@ priv String read_stdin(Arena *a)
 	input = cstr(stdin_buf);
 	return input;
 }
+
+// ~SERVE
+// toyscript --serve path.sock keeps one interpreter warm and answers one request per
+// connection on a Unix socket. A request is a header line, then the source for eval:
+//     run <script path> [args...]\n
+//     eval <source length> [args...]\n<source>
+// Args are bound to the script as an ARRAY of STR named args. What the script prints is
+// written to the connection as it runs, followed by the error if it fails. A script that
+// runs for longer than SERVE_RUN_SECONDS is interrupted and fails, so requests can't
+// keep the server from answering the next ones for good.
+typedef struct CachedScript {
+	u64		hash;
+	String	source;
+	Script	*script;
+} CachedScript;
+
+typedef struct Server {
+	Interp	*it;
+	Arena	*request;
+	u32		cached;
+	CachedScript cache[SERVE_CACHE];
+} Server;
+
+global Interp *volatile serving = NULL; // Running a request, for the alarm to interrupt
+
+priv void serve_alarm(int sig)
+{
+	if (serving)
+		interp_interrupt(serving);
+}
+
+priv u64 hash64(String s) // FNV-1a
+{
+	u64 hash = 14695981039346656037UL;
+	for (u64 i = 0; i < s.len; i++)
+		hash = (hash ^ (u8)s.buf[i]) * 1099511628211UL;
+	return hash;
+}
+
+priv void send_str(int fd, String s)
+{
+	for (u64 done = 0; done < s.len; ) {
+		i64 n = write(fd, s.buf + done, s.len - done);
+		if (n <= 0)
+			return ;
+		done += n;
+	}
+}
+
+priv i64 now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reads what's there once some is, -1 when nothing comes before the deadline (0 for none)
+priv i64 recv_some(int fd, char *buf, u64 len, i64 deadline)
+{
+	if (deadline) {
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		i64 left = deadline - now_ms();
+		if (left <= 0 || poll(&p, 1, left) <= 0)
+			return -1;
+	}
+	return read(fd, buf, len);
+}
+
+// Reads until len bytes are in buf, false when the peer stops or stalls before
+priv bool recv_all(int fd, char *buf, u64 len, i64 deadline)
+{
+	for (u64 done = 0; done < len; ) {
+		i64 n = recv_some(fd, buf + done, len - done, deadline);
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+priv String read_file(Arena *a, String path)
+{
+	int fd = open(str_dupc(a, path), O_RDONLY);
+	if (fd < 0)
+		return (String) { NULL, 0 };
+	off_t len = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	String res = { NULL, 0 };
+	if (len >= 0 && len <= SERVE_SOURCE_MAX) {
+		res = (String) { arena_alloc(a, len + 1), len };
+		if (!recv_all(fd, res.buf, len, 0))
+			res = (String) { NULL, 0 };
+	}
+	close(fd);
+	return res;
+}
+
+// A fresh interpreter with the settings of the old one, whose scripts are all dropped
+priv Interp *serve_renew(Server *s)
+{
+	Interp *old = s->it;
+	Interp *it = interp();
+	it->max_depth = old->max_depth, it->optimize = old->optimize, it->inlining = old->inlining;
+	it->specialize = old->specialize, it->jit = old->jit;
+	interp_free(&old);
+	memset(s->cache, 0, sizeof(s->cache));
+	s->cached = 0;
+	return it;
+}
+
+// Compiles source once per content, the hash only picks where to look
+priv Script *serve_script(Server *s, String source)
+{
+	u64 key_hash = hash64(source);
+	u32 i = key_hash & (SERVE_CACHE - 1);
+	for (; s->cache[i].script; i = (i + 1) & (SERVE_CACHE - 1))
+		if (s->cache[i].hash == key_hash && str_eq(s->cache[i].source, source))
+			return s->cache[i].script;
+	if (s->cached == SERVE_CACHE / 2) {
+		s->it = serve_renew(s);
+		i = key_hash & (SERVE_CACHE - 1);
+	}
+	String kept = str_dup(s->it->arena, source);
+	s->cache[i] = (CachedScript) { key_hash, kept, interp_compile(s->it, kept) };
+	s->cached++;
+	return s->cache[i].script;
+}
+
+priv void serve_request(Server *s, int client)
+{
+	Arena *a = s->request;
+	char *buf = arena_alloc(a, SERVE_HEADER_MAX);
+	u64 len = 0;
+	char *eol = NULL;
+	i64 deadline = now_ms() + SERVE_TIMEOUT_MS; // A client stalling is dropped, others wait on it
+	while (!eol && len < SERVE_HEADER_MAX) {
+		i64 n = recv_some(client, buf + len, SERVE_HEADER_MAX - len, deadline);
+		if (n <= 0)
+			return ;
+		eol = memchr(buf + len, '\n', n);
+		len += n;
+	}
+	if (!eol)
+		return send_str(client, str("Request header too long\n"));
+	String words[SERVE_ARGS_MAX + 2];
+	u32 count = 0;
+	for (char *cursor = buf; cursor < eol && count < arrlen(words); ) {
+		while (cursor < eol && *cursor == ' ') cursor++;
+		char *end = cursor;
+		while (end < eol && *end != ' ') end++;
+		if (end > cursor)
+			words[count++] = (String) { cursor, end - cursor };
+		cursor = end;
+	}
+	if (count < 2 || !(str_eq(words[0], str("run")) || str_eq(words[0], str("eval"))))
+		return send_str(client, str("Expected run <path> or eval <length>\n"));
+	String source;
+	if (str_eq(words[0], str("run"))) {
+		source = read_file(a, words[1]);
+		if (!source.buf)
+			return send_str(client, str_fmt(a, "Can't read %.*s\n", fmt(words[1])));
+	} else {
+		i64 source_len = str_atol(words[1]);
+		if (source_len < 0 || source_len > SERVE_SOURCE_MAX)
+			return send_str(client, str("Wrong source length\n"));
+		u64 received = MIN(len - (eol + 1 - buf), (u64)source_len);
+		source = (String) { arena_alloc(a, source_len + 1), source_len };
+		memcpy(source.buf, eol + 1, received);
+		if (!recv_all(client, source.buf + received, source_len - received, deadline))
+			return ;
+	}
+	Script *script = serve_script(s, source);
+	ElemArray *args = elemarray(a, count - 2);
+	for (u32 i = 2; i < count; i++)
+		args->items[i - 2] = elem_from_str(STR, words[i]);
+	ScriptArg bound[] = { { str("args"), (Element) { ARRAY, .ARRAY = args } } };
+	s->it->out_fd = client;
+	serving = s->it;
+	alarm(SERVE_RUN_SECONDS);
+	Element res = interp_run(s->it, script, bound, arrlen(bound));
+	alarm(0);
+	serving = NULL;
+	if (res.type == ERR)
+		send_str(client, elem_str(res)), send_str(client, str("\n"));
+	interp_reset(s->it);
+}
+
+priv int serve(Interp *it, char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return dprintf(2, "Socket path too long: %s\n", path), 1;
+	memcpy(addr.sun_path, path, strlen(path));
+	struct stat st;
+	bool exists = (lstat(path, &st) == 0);
+	if (exists && !S_ISSOCK(st.st_mode)) // Only a socket left by a previous server is replaced
+		return dprintf(2, "Can't listen on %s: not a socket\n", path), 1;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock >= 0 && exists)
+		unlink(path);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0)
+		return dprintf(2, "Can't listen on %s\n", path), 1;
+	signal(SIGPIPE, SIG_IGN); // A client leaving early only ends its own request
+	struct sigaction alarm_action = { .sa_handler = serve_alarm, .sa_flags = SA_RESTART };
+	sigaction(SIGALRM, &alarm_action, NULL);
+	Arena *server_arena = arena(sizeof(Server) + KB(4));
+	Server *s = arena_alloc_zero(server_arena, sizeof(Server));
+	*s = (Server) { .it = it, .request = arena(SERVE_SOURCE_MAX * 2) };
+	while (1) {
+		int client = accept(sock, NULL, NULL);
+		if (client < 0)
+			continue;
+		struct timeval timeout = { SERVE_TIMEOUT_MS / 1000, SERVE_TIMEOUT_MS % 1000 * 1000 };
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // Output nobody reads
+		serve_request(s, client);
+		close(client);
+		arena_reset(s->request);
+	}
+	return 0;
+}
+
+// ~WORKERS
+// toyscript --workers N file.toy [inputs...] evaluates the script once, then forks N
+// processes that share what it defined copy-on-write. Each calls main(input) for its
+// share of the inputs: the arguments after the script, or the lines of stdin without
+// any. The output of one input is written at once, in no particular order.
+priv int worker(Interp *it, Script *call, String *inputs, u32 len)
+{
+	it->out_fd = -1;
+	int status = 0;
+	for (u32 i = 0; i < len; i++) {
+		ScriptArg args[] = { { str("input"), elem_from_str(STR, inputs[i]) } };
+		Element res = interp_run(it, call, args, arrlen(args));
+		String out = interp_output(it);
+		if (res.type == ERR)
+			out = str_fmt(it->run, "%.*s%.*s\n", fmt(out), fmt(elem_str(res))), status = 1;
+		send_str(1, out);
+		interp_reset(it);
+	}
+	return status;
+}
+
+priv String *stdin_lines(Arena *a, u32 *len)
+{
+	u64 cap = KB(64);
+	String in = { arena_alloc(a, cap), 0 };
+	for (i64 n; (n = read(0, in.buf + in.len, cap - in.len)) > 0; ) {
+		in.len += n;
+		if (in.len == cap) {
+			char *grown = arena_alloc(a, cap * 2);
+			memcpy(grown, in.buf, in.len);
+			in.buf = grown, cap *= 2;
+		}
+	}
+	*len = 0;
+	for (u64 i = 0; i < in.len; i++)
+		*len += (in.buf[i] == '\n' || i + 1 == in.len);
+	String *lines = arena_alloc(a, *len * sizeof(String));
+	u32 count = 0;
+	for (u64 begin = 0, i = 0; i < in.len; i++)
+		if (in.buf[i] == '\n' || i + 1 == in.len) {
+			lines[count++] = (String) { in.buf + begin, i - begin + (in.buf[i] != '\n') };
+			begin = i + 1;
+		}
+	return lines;
+}
+
+// 1 when one of the workers failed
+priv int run_workers_wait(u32 started)
+{
+	int failed = 0;
+	for (int status = 0; started; started--)
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+	return failed;
+}
+
+priv int run_workers(Interp *it, char *filename, u32 workers, char **inputs, u32 len)
+{
+	Arena *a = arena(GB(4));
+	Element res = interp_eval(it, str_read_file(a, filename));
+	if (res.type == ERR)
+		return str_print(elem_str(res)), str_print(str("\n")), 1;
+	if (interp_eval(it, str("main;")).type != FUNCTION)
+		return str_print(str("--workers needs the script to define main(input)\n")), 1;
+	Script *call = interp_compile(it, str("main(input);"));
+	String *items = arena_alloc(a, len * sizeof(String));
+	for (u32 i = 0; i < len; i++)
+		items[i] = cstr(inputs[i]);
+	if (!len)
+		items = stdin_lines(a, &len);
+	u32 started = 0;
+	for (u32 k = 0; k < workers; k++) {
+		u32 begin = (u64)len * k / workers, end = (u64)len * (k + 1) / workers;
+		if (begin == end)
+			continue;
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(worker(it, call, items + begin, end - begin));
+		if (pid < 0) // Without another process, the rest runs here
+			return worker(it, call, items + begin, len - begin) | run_workers_wait(started);
+		started++;
+	}
+	return run_workers_wait(started);
+}
+
+// ~RECORDS
+// toyscript -n -e 'body' [files...] compiles body once and evaluates it for every line
+// of the files, or of stdin without any, with line bound to it (newline excluded) and
+// nr to its number. Everything a record allocates goes when it's done, so memory
+// doesn't grow with the input. -n script.toy [files...] takes the body from a file.
+typedef struct LineReader {
+	Arena	*a;
+	int		fd;
+	char	*buf;
+	u64		cap;
+	u64		begin; // Of the next line
+	u64		end;   // Of what was read
+	bool	done;
+} LineReader;
+
+// The next line, valid until the next call, with a NULL buf at the end of the input
+priv String next_line(LineReader *r)
+{
+	while (1) {
+		char *nl = memchr(r->buf + r->begin, '\n', r->end - r->begin);
+		if (nl) {
+			String line = { r->buf + r->begin, nl - (r->buf + r->begin) };
+			r->begin = nl + 1 - r->buf;
+			return line;
+		}
+		if (r->done)
+			return (String) { NULL, 0 };
+		u64 left = r->end - r->begin;
+		memmove(r->buf, r->buf + r->begin, left);
+		r->begin = 0, r->end = left;
+		if (r->end == r->cap) { // Longer than the buffer
+			char *grown = arena_alloc(r->a, r->cap * 2);
+			memcpy(grown, r->buf, r->end);
+			r->buf = grown, r->cap *= 2;
+		}
+		i64 n = read(r->fd, r->buf + r->end, r->cap - r->end);
+		if (n > 0) {
+			r->end += n;
+			continue;
+		}
+		r->done = true;
+		if (r->end) { // Last line without a newline
+			r->begin = r->end;
+			return (String) { r->buf, r->end };
+		}
+	}
+}
+
+// Output of the records, written once the buffer is full
+typedef struct OutBuffer {
+	char	buf[RECORDS_BUFFER];
+	u64		len;
+} OutBuffer;
+
+priv void out_flush(OutBuffer *out)
+{
+	send_str(1, (String) { out->buf, out->len });
+	out->len = 0;
+}
+
+priv void out_push(OutBuffer *out, String s)
+{
+	if (out->len + s.len > RECORDS_BUFFER)
+		out_flush(out);
+	if (s.len > RECORDS_BUFFER)
+		return send_str(1, s);
+	memcpy(out->buf + out->len, s.buf, s.len);
+	out->len += s.len;
+}
+
+priv int run_records(Interp *it, String body, char **files, u32 len)
+{
+	Script *script = interp_compile(it, body);
+	if (script->error.type == ERR)
+		return str_print(elem_str(script->error)), str_print(str("\n")), 1;
+	it->out_fd = -1;
+	Arena *a = arena(GB(4));
+	OutBuffer *out = arena_alloc_zero(a, sizeof(OutBuffer));
+	LineReader r = { .a = a, .cap = RECORDS_BUFFER };
+	r.buf = arena_alloc(a, r.cap);
+	i64 nr = 0;
+	int status = 0;
+	for (u32 f = 0; f < len || (f == 0 && len == 0); f++) {
+		r.fd = (len) ? open(files[f], O_RDONLY) : 0;
+		if (r.fd < 0) {
+			out_push(out, str_fmt(it->run, "Can't read %s\n", files[f])), status = 1;
+			continue;
+		}
+		r.begin = r.end = 0, r.done = false;
+		for (String line; (line = next_line(&r)).buf; interp_reset(it)) {
+			ScriptArg args[] = { { str("line"), elem_from_str(STR, line) }, { str("nr"), (Element) { INT, .INT = ++nr } } };
+			Element res = interp_run(it, script, args, arrlen(args));
+			out_push(out, interp_output(it));
+			if (res.type == ERR) {
+				out_push(out, str_fmt(it->run, "%.*s\n", fmt(elem_str(res))));
+				out_flush(out);
+				return 1;
+			}
+		}
+		if (len)
+			close(r.fd);
+	}
+	out_flush(out);
+	return status;
+}
@@ -3,7 +3,7 @@
 
 // ~LEXER
 typedef enum TokenType { 
-	TK_END, TK_ILLEGAL, TK_SEMICOLON, TK_COMMA, TK_BANG, TK_STAR, 
+	TK_END, TK_ILLEGAL, TK_SEMICOLON, TK_COMMA, TK_COLON, TK_BANG, TK_STAR, 
 	TK_SLASH, TK_MOD, TK_GT, TK_LT, TK_LPAREN, TK_RPAREN, TK_LBRACE, 
 	TK_RBRACE, TK_LBRACKET, TK_RBRACKET, TK_PLUS, TK_MINUS, TK_ASSIGN, 
 	TK_EQ, TK_NOT_EQ, TK_INT, TK_STRING, TK_IDENT, TK_VAL, TK_VAR, TK_FN, 
@@ -22,16 +22,61 @@ typedef struct Lexer {
 	char	ch;
 }	Lexer;
 
+typedef struct Element Element;
+typedef struct Namespace Namespace;
+typedef struct ElemList	ElemList;
+typedef struct ElemArray ElemArray;
+typedef struct ElemMap ElemMap;
+typedef struct ElemVector ElemVector;
+typedef struct Bind Bind;
+typedef struct JitFunction JitFunction;
+typedef Element (*BuiltinFunction)(Arena *a, Namespace *ns, ElemArray *args);
+typedef Element (*NativeBlock)(Arena *a, Namespace *ns); // Code emitted by emit_c
+typedef Element (*NativeItems)(Arena *a, Namespace *ns, Element *items);
+
 // ~AST
 typedef struct AST AST;
 typedef struct ASTNode ASTNode;
 typedef enum ASTType { 
 	AST_VAL, AST_VAR, AST_RETURN, AST_ASSIGN, AST_WHILE, // STATEMENTS
-	AST_IDENT, AST_INT, AST_BOOL, AST_STR, AST_LIST, AST_FN, // VALUES
-	AST_PREFIX, AST_INFIX, AST_COND, AST_CALL, AST_INDEX, // EXPRESSIONS
+	AST_IDENT, AST_INT, AST_BOOL, AST_STR, AST_LIST, AST_MAP, AST_FN, // VALUES
+	AST_PREFIX, AST_INFIX, AST_COND, AST_CALL, AST_INDEX, AST_INVARIANT, // EXPRESSIONS
 	AST_NULL, AST_PROGRAM
 } ASTType;
 
+// Operand types observed by a node, used to rewrite it into a fast path
+typedef enum NodeSpec { SPEC_NONE, SPEC_GENERIC, SPEC_INT, SPEC_ARRAY, SPEC_FUNCTION, SPEC_BUILTIN } NodeSpec;
+typedef enum InfixOp { OP_NONE, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_EQ, OP_NOT_EQ, OP_GT, OP_LT } InfixOp;
+
+// A function of the host scripts call by name. The evaluator checks the number of
+// arguments unless arity is -1, and passes them as they are.
+typedef struct Native {
+	String	name;
+	BuiltinFunction fn;
+	i32		arity;
+} Native;
+
+typedef struct BuiltinSlot {
+	u32		hash;
+	Native	*native;
+} BuiltinSlot;
+
+// Open addressed on the hash of the names
+typedef struct BuiltinTable {
+	u32		cap; // A power of two
+	BuiltinSlot *slots;
+} BuiltinTable;
+
+// Inline cache of an identifier's resolution, checked against the namespaces it's read in
+typedef struct IdentCache {
+	u32		hash;
+	bool	hashed;
+	Namespace *owner;
+	u64		serial;
+	Bind	*bind;
+	Native	*builtin;
+} IdentCache;
+
 struct ASTNode {
 	AST		*ast;
 	ASTNode *next;
@@ -51,21 +96,32 @@ struct AST {
 		struct AST_INT { long value; } AST_INT;
 		struct AST_BOOL { bool value; } AST_BOOL;
 		String AST_STR;
+		struct AST_IDENT { String name; IdentCache cache; } AST_IDENT;
 		struct AST_RETURN { AST *value; } AST_RETURN;
 		struct AST_VAL { String name; AST *value; } AST_VAL;
 		struct AST_VAR { String name; AST *value; } AST_VAR;
 		ASTList *AST_LIST;
+		ASTList *AST_MAP; // Keys and values, alternating
 		struct AST_FN { ASTList *params; ASTList *body; } AST_FN;
 		struct AST_PREFIX { String op; AST *right; } AST_PREFIX;
-		struct AST_INFIX { AST *left; String op; AST *right; } AST_INFIX;
+		struct AST_INFIX { AST *left; String op; AST *right; NodeSpec spec; InfixOp opcode; } AST_INFIX;
 		struct AST_COND { AST *condition; ASTList *consequence; ASTList *alternative; } AST_COND;
-		struct AST_CALL { AST *function; ASTList *args; } AST_CALL;
-		struct AST_INDEX { AST *left; AST *index; } AST_INDEX;
+		struct AST_CALL { AST *function; ASTList *args; NodeSpec spec; } AST_CALL;
+		struct AST_INDEX { AST *left; AST *index; NodeSpec spec; } AST_INDEX;
 		struct AST_ASSIGN { AST *left; AST *right; } AST_ASSIGN;
-		struct AST_WHILE { AST *condition; ASTList *body; } AST_WHILE;
+		struct AST_WHILE { AST *condition; ASTList *body; u64 run; } AST_WHILE;
+		// Loop invariant expression, evaluated once per run of its loop when INT or BOOL
+		struct AST_INVARIANT { AST *value; AST *loop; u64 run; bool is_int; long cached; } AST_INVARIANT;
 	};
 };
 
+// What the last ast_optimize call rewrote
+typedef struct OptimizeStats {
+	u32 folded;
+	u32 inlined;
+	u32 hoisted;
+} OptimizeStats;
+
 typedef struct Parser {
 	Arena	*arena;
 	Lexer	*lexer;
@@ -75,63 +131,199 @@ typedef struct Parser {
 } Parser;
 
 // ~EVAL
-typedef struct Element Element;
-typedef struct Namespace Namespace;
-typedef struct ElemList	ElemList;
-typedef struct ElemArray ElemArray;
-
-typedef enum ElementType { NIL, ERR, INT, BOOL, STR, LIST, ARRAY, RETURN, FUNCTION, BUILTIN, TYPE } ElementType;
-typedef Element (*BuiltinFunction)(Arena *a, Namespace *ns, ElemArray *args);
+typedef enum ElementType { NIL, ERR, INT, BOOL, STR, LIST, ARRAY, MAP, VECTOR, RETURN, FUNCTION, BUILTIN, TYPE } ElementType;
+typedef struct Function {
+	ASTList		*params;
+	ASTList		*body;
+	Namespace	*namespace;
+	NativeBlock	native;
+	u32			calls;
+	JitFunction	*jit;
+} Function;
+// Tagged value: immediates live in the payload, everything else behind a pointer,
+// and STR/ERR keep their length next to the tag so values fit in two registers.
 struct Element {
 	ElementType type;
+	u32			len;
 	union {
 		struct		NIL {} NIL;
-		String 		ERR;
+		char		*ERR;
 		long 		INT;
 		bool 		BOOL;
-		String		STR;
+		char		*STR;
 		ElemList	*LIST;
 		ElemArray	*ARRAY;
+		ElemMap		*MAP;
+		ElemVector	*VECTOR;
 		struct RETURN { Element *value; } RETURN; 
-		struct FUNCTION { ASTList *params; ASTList *body; Namespace *namespace; } FUNCTION;
+		Function	*FUNCTION;
 		BuiltinFunction BUILTIN;
 		ElementType	TYPE;
 	};
 };
+_Static_assert(sizeof(Element) == 16, "Element should stay two words wide");
+
+static inline Element elem_from_str(ElementType type, String s)
+{
+	return (Element) { type, .len = s.len, .STR = s.buf };
+}
+
+static inline String elem_str(Element e)
+{
+	return (String) { e.STR, e.len };
+}
 
 // ~ LISTS
+// Lists are unrolled: each node holds a block of up to cap elements. A list is the len
+// elements starting at head->items[start], so cdr shares the nodes of its argument.
+// Nodes other than the tail never change length.
 typedef struct ElemNode {
-	Element	element;
 	struct ElemNode *next;
+	u32	len;
+	u32	cap;
+	Element	items[];
 } ElemNode;
 struct ElemList {
 	Arena	*arena;
 	ElemNode *head;
 	ElemNode *tail;
 	u32 len;
+	u32 start;	// Index of the first element in head
+	u32 tail_end;	// Index past the last element in tail
+	ElemNode *cursor;	// Node the last index landed in
+	u32 cursor_pos;	// Position of cursor->items[0], counted from head->items[0]
 };
 
+// Arrays grow geometrically into their arena. An array owned by a binding is referenced
+// by nothing else, so `x = push(x, v)` and `x = pop(x)` can update it in place.
+// Slices are views into another array's items; both sides copy them before writing.
 struct ElemArray {
 	Element *items;
 	u32	len;
+	u32	cap;
+	Arena	*arena;
+	Bind	*owner;
+	bool	shared;	// Items are also seen through a slice
+	u32	lent;	// Calls running with it as an argument, its owner copies it meanwhile
+};
+
+// ~ MAPS
+// Entries are kept in insertion order and indexed by an open addressing table of
+// stored hashes, grown at 3/4 load. Deleted entries stay behind until the next grow.
+typedef struct MapEntry {
+	Element key;
+	Element value;
+	u32	hash;
+	bool live;
+} MapEntry;
+
+struct ElemMap {
+	Arena	*arena;
+	MapEntry *entries;
+	u32	*slots;	// Entry index + 1, 0 when free
+	u32	len;	// Live entries
+	u32	used;	// Entries, deleted ones included
+	u32	cap;	// Table slots, a power of two
+};
+
+// ~ VECTORS
+// Persistent vectors: a 32-way trie of full leaves, plus a tail leaf with the last 1 to
+// 32 items. Updates copy the path to the leaf they change and share the rest, and nodes
+// are never written below their len, so all versions live in one arena for the whole run.
+#define VEC_BITS 5
+#define VEC_WIDTH (1 << VEC_BITS)
+typedef struct VecNode {
+	u32	len;	// Items written to a leaf: a version ending there appends in place
+	union {
+		struct VecNode *kids[VEC_WIDTH];
+		Element items[VEC_WIDTH];
+	};
+} VecNode;
+
+struct ElemVector {
+	VecNode	*root;
+	VecNode	*tail;
+	u32	len;
+	u32	shift;	// Bits of the index below the root's
 };
 // ~NAMESPACE
-typedef struct Bind Bind;
+// Bindings fill an inline array first; past NS_INLINE they are indexed by an open
+// addressing table of stored hashes, grown at 3/4 load. Binds never move once created.
+#define NS_INLINE 8
+#define NS_NAME_BIT(hash) ((u64)1 << ((hash) >> 26))
 struct Bind {
 	String key;
 	Element element;
+	u32 hash;
 	bool	mutable;
-	Bind *next;
+	bool	reusable;	// element's STR buffer is the binding's own and nothing else has read it
 };
 
+typedef struct NsSlot {
+	u32 hash;
+	Bind *bind;
+} NsSlot;
+
 struct Namespace {
 	Arena *arena;
+	u64 serial;
+	u64 names;	// Bit NS_NAME_BIT of the hash of each key bound here
 	u32 len;
-	u32 cap;
-	Bind **values;
+	u32 cap;	// Table slots (a power of two), 0 while the inline array is enough
+	NsSlot *slots;
 	Namespace *parent;
+	Bind binds[NS_INLINE];
 };
 
+// ~INTERP
+// Shared with code compiled for one interpreter: remaining call budget and the bail-out
+// flag that unwinds every native frame when it runs out
+typedef struct JitState {
+	i64		budget;
+	u8		bail;
+	Arena	*arena;
+	JitFunction *compiled;   // Latest first
+	JitFunction *checkpoint; // Latest when interp_reset last kept code
+	u64		checkpoint_used;
+} JitState;
+
+// A program compiled once by an interpreter, to run any number of times
+typedef struct Script {
+	AST		*program;
+	Element	error; // Parser errors, NIL when it compiled
+} Script;
+
+// Bound as a val for one run of a script
+typedef struct ScriptArg {
+	String	name;
+	Element	value;
+} ScriptArg;
+
+// Everything the scripts an interpreter evaluates allocate, and how it evaluates them.
+// An interpreter is used by one thread at a time, separate ones can run on separate
+// threads: they share nothing but the pool pmap runs on.
+typedef struct Interp {
+	Arena	*arena;    // Programs and what they evaluate to
+	Arena	*bindings; // Global namespace, arrays grow in place in it
+	Namespace *ns;
+	Arena	*vectors;  // Nodes of every vector version
+	Arena	*run;      // What runs of scripts allocate, up to the next interp_reset
+	bool	in_run;
+	BuiltinTable natives; // Looked up before the core builtins
+	Arena	*output;
+	StrList	*printed;  // By the last interp_eval when out_fd is -1, else written to out_fd
+	int		out_fd;
+	u32		max_depth;
+	bool	optimize;
+	bool	inlining;
+	bool	specialize;
+	bool	jit;
+	JitState jit_state;
+	u64		ns_serial; // Last one given to a namespace created while it runs
+	u64		loop_runs; // Last run id given to a loop it evaluates
+	volatile bool interrupted; // By interp_interrupt, until the next evaluation starts
+} Interp;
+
 // API
 Lexer 	*lexer(Arena *a, String input);
 Token 	lexer_token(Lexer *l);
@@ -140,6 +332,10 @@ String	token_str(TokenType type);
 void 	ast_aprint(Arena *a, AST *node);
 String	asttype_str(ASTType type);
 String 	ast_str(Arena *a, AST *node);
+bool	ast_self_call(struct AST_ASSIGN *node);
+AST		*ast_optimize(Arena *a, AST *program);
+OptimizeStats optimize_stats(void);
+bool	optimize_inline(bool enabled);
 
 Parser	*parser(Arena *a, Lexer *l);
 AST		*parse_program(Parser *p);
@@ -148,7 +344,51 @@ void	parser_print_errors(Parser *p);
 Element	eval(Arena *a, Namespace *ns, AST *node);
 String	to_string(Arena *a, Element e);
 String	type_str(ElementType type);
+void	eval_max_depth(u32 depth);
+void	eval_specialize(bool enabled);
+void	eval_jit(bool enabled);
+void	eval_threads(u32 threads);
+
+Interp	*interp(void);
+Interp	*interp_with(Native *natives, u32 len);
+void	interp_free(Interp **it);
+Element	interp_eval(Interp *it, String src);
+String	interp_output(Interp *it);
+Script	*interp_compile(Interp *it, String src);
+Element	interp_run(Interp *it, Script *script, ScriptArg *args, u32 len);
+void	interp_reset(Interp *it);
+void	interp_interrupt(Interp *it);
+
+JitFunction	*jit_compile(JitState *js, Function *fn);
+bool		jit_call(JitFunction *jit, ElemArray *args, i64 budget, Element *res);
+void		jit_free(JitState *js);
+void		jit_checkpoint(JitState *js);
+void		jit_rewind(JitState *js);
 
 Namespace *ns_create(Arena *a, u32 cap);
+ElemArray *elemarray(Arena *a, u32 len);
+
+String	emit_c(Arena *a, AST *program, String filename);
+
+// RUNTIME of programs translated by emit_c
+Element	rt_ident(Arena *a, Namespace *ns, struct AST_IDENT *ident);
+Element	rt_val(Arena *a, Namespace *ns, String name, Element value);
+Element	rt_var(Arena *a, Namespace *ns, String name, Element value);
+Element	rt_return(Arena *a, Element value);
+Element	rt_assign(Arena *a, Namespace *ns, String name, NativeBlock right);
+Element	rt_assign_call(Arena *a, Namespace *ns, String name, struct AST_IDENT *callee, u32 argc, NativeItems args, NativeBlock right);
+Element	rt_assign_index(Arena *a, bool bound, Element left, Element index, Element value);
+Element	rt_error(String msg);
+Element	rt_array(Arena *a, Namespace *ns, u32 len, NativeItems items);
+Element	rt_list(Arena *a, Namespace *ns, u32 len, NativeItems items);
+Element	rt_map(Arena *a, Namespace *ns, u32 len, NativeItems items);
+Element	rt_fn(Arena *a, Namespace *ns, ASTList *params, NativeBlock body);
+Element	rt_index(Arena *a, Namespace *ns, Element left, Element index);
+Element	rt_prefix(Arena *a, String op, Element right);
+Element	rt_infix(Arena *a, Element left, String op, Element right);
+bool	rt_truthy(Element e);
+Element	rt_call(Arena *a, Namespace *ns, Element fn, u32 argc, NativeItems args);
+Element	rt_while(Arena *a, Namespace *ns, NativeBlock condition, NativeBlock body);
+int		rt_main(NativeBlock program);
 
 #endif 
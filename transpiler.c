@@ -0,0 +1,297 @@
+#include "base.h"
+#include "toyscript.h"
+
+// Ahead-of-time translation of a parsed program to C. Blocks, and expressions whose
+// errors don't propagate to their parent (conditions, assignment values, call
+// arguments), become C functions shaped like eval so an ERR can bail out with a
+// plain return. Values go through the rt_ entry points of evaluator.c, which keeps
+// the semantics of the interpreter.
+typedef struct Transpiler {
+	Arena	*arena;
+	StrList	*decls;
+	StrList	*defs;
+	u32		ids;
+} Transpiler;
+
+typedef struct CFunction {
+	StrList	*body;
+	u32		temps;
+} CFunction;
+
+#define out(t, f, ...) strpush((f)->body, str_fmt((t)->arena, __VA_ARGS__))
+#define decl(t, ...) strpush((t)->decls, str_fmt((t)->arena, __VA_ARGS__))
+
+priv u32 emit_expr(Transpiler *t, CFunction *f, AST *node);
+
+priv String c_string(Arena *a, String s)
+{
+	char *buf = arena_alloc(a, s.len * 4 + 2);
+	u32 len = 0;
+	buf[len++] = '"';
+	for (u32 i = 0; i < s.len; i++) {
+		u8 c = (u8)s.buf[i];
+		if (c == '"' || c == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = c;
+		} else if (c < ' ' || c > '~') {
+			buf[len++] = '\\';
+			buf[len++] = '0' + ((c >> 6) & 7);
+			buf[len++] = '0' + ((c >> 3) & 7);
+			buf[len++] = '0' + (c & 7);
+		} else
+			buf[len++] = c;
+	}
+	buf[len++] = '"';
+	return (String) { buf, len };
+}
+
+priv String c_str(Transpiler *t, String s)
+{
+	return str_fmt(t->arena, "(String) { %.*s, %u }", fmt(c_string(t->arena, s)), s.len);
+}
+
+// Same, as a brace initializer for static data
+priv String c_init(Transpiler *t, String s)
+{
+	return str_fmt(t->arena, "{ %.*s, %u }", fmt(c_string(t->arena, s)), s.len);
+}
+
+priv CFunction *cfunction(Transpiler *t)
+{
+	CFunction *f = arena_alloc_zero(t->arena, sizeof(CFunction));
+	f->body = strlist(t->arena);
+	return f;
+}
+
+priv void cfunction_end(Transpiler *t, CFunction *f, String signature)
+{
+	decl(t, "static %.*s;\n", fmt(signature));
+	strpush(t->defs, str_fmt(t->arena, "\n%.*s\n{\n", fmt(signature)));
+	for (StrNode *tmp = f->body->head; tmp; tmp = tmp->next)
+		strpush(t->defs, tmp->string);
+	strpush(t->defs, str("}\n"));
+}
+
+priv u32 temp(Transpiler *t, CFunction *f, String value, bool check)
+{
+	u32 id = f->temps++;
+	out(t, f, "\tElement t%u = %.*s;\n", id, fmt(value));
+	if (check)
+		out(t, f, "\tif (t%u.type == ERR) return t%u;\n", id, id);
+	return id;
+}
+
+// Block of statements, returning like eval_block or, for the program, eval_program
+priv u32 emit_block(Transpiler *t, ASTList *block, bool program)
+{
+	u32 id = t->ids++;
+	CFunction *f = cfunction(t);
+	u32 res = 0;
+	for (ASTNode *tmp = block->head; tmp; tmp = tmp->next) {
+		res = emit_expr(t, f, tmp->ast);
+		if (program)
+			out(t, f, "\tif (t%u.type == RETURN) return *t%u.RETURN.value;\n", res, res);
+		else if (tmp->next)
+			out(t, f, "\tif (t%u.type == RETURN) return t%u;\n", res, res);
+	}
+	if (block->len)
+		out(t, f, "\treturn t%u;\n", res);
+	else
+		out(t, f, "\treturn (Element) { NIL };\n");
+	cfunction_end(t, f, str_fmt(t->arena, "Element block_%u(Arena *a, Namespace *ns)", id));
+	return id;
+}
+
+// Single expression evaluated where its errors are values, not early exits
+priv u32 emit_thunk(Transpiler *t, AST *node)
+{
+	u32 id = t->ids++;
+	CFunction *f = cfunction(t);
+	out(t, f, "\treturn t%u;\n", emit_expr(t, f, node));
+	cfunction_end(t, f, str_fmt(t->arena, "Element expr_%u(Arena *a, Namespace *ns)", id));
+	return id;
+}
+
+// Evaluates a list of expressions into items, stopping at the first error
+priv u32 emit_items(Transpiler *t, ASTList *list)
+{
+	u32 id = t->ids++;
+	CFunction *f = cfunction(t);
+	u32 i = 0;
+	for (ASTNode *tmp = list->head; tmp; tmp = tmp->next, i++)
+		out(t, f, "\titems[%u] = t%u;\n", i, emit_expr(t, f, tmp->ast));
+	out(t, f, "\treturn (Element) { NIL };\n");
+	cfunction_end(t, f, str_fmt(t->arena, "Element items_%u(Arena *a, Namespace *ns, Element *items)", id));
+	return id;
+}
+
+priv u32 emit_ident(Transpiler *t, String name)
+{
+	u32 id = t->ids++;
+	decl(t, "static struct AST_IDENT ident_%u = { .name = %.*s };\n", id, fmt(c_init(t, name)));
+	return id;
+}
+
+priv u32 emit_params(Transpiler *t, ASTList *params)
+{
+	u32 id = t->ids++;
+	u32 i = 0;
+	for (ASTNode *tmp = params->head; tmp; tmp = tmp->next, i++)
+		decl(t, "static AST param_%u_%u = { AST_IDENT, .AST_IDENT = { .name = %.*s } };\n",
+				id, i, fmt(c_init(t, tmp->ast->AST_STR)));
+	for (i = params->len; i > 0; i--) {
+		if (i == params->len)
+			decl(t, "static ASTNode node_%u_%u = { &param_%u_%u, NULL };\n", id, i - 1, id, i - 1);
+		else
+			decl(t, "static ASTNode node_%u_%u = { &param_%u_%u, &node_%u_%u };\n", id, i - 1, id, i - 1, id, i);
+	}
+	if (params->len)
+		decl(t, "static ASTList params_%u = { NULL, &node_%u_0, &node_%u_%u, %u };\n",
+				id, id, id, params->len - 1, params->len);
+	else
+		decl(t, "static ASTList params_%u = { NULL, NULL, NULL, 0 };\n", id);
+	return id;
+}
+
+priv u32 emit_assign(Transpiler *t, CFunction *f, struct AST_ASSIGN assign)
+{
+	AST *left = assign.left;
+	if (ast_self_call(&assign)) {
+		struct AST_CALL *call = &assign.right->AST_CALL;
+		u32 right = emit_thunk(t, assign.right);
+		u32 callee = emit_ident(t, call->function->AST_STR);
+		return temp(t, f, str_fmt(t->arena, "rt_assign_call(a, ns, %.*s, &ident_%u, %u, items_%u, expr_%u)",
+					fmt(c_str(t, left->AST_STR)), callee, call->args->len, emit_items(t, call->args), right), true);
+	}
+	if (left->type == AST_IDENT) {
+		u32 right = emit_thunk(t, assign.right);
+		return temp(t, f, str_fmt(t->arena, "rt_assign(a, ns, %.*s, expr_%u)",
+					fmt(c_str(t, left->AST_STR)), right), true);
+	}
+	if (left->type == AST_INDEX) {
+		u32 value = emit_expr(t, f, assign.right);
+		u32 index = temp(t, f, str_fmt(t->arena, "expr_%u(a, ns)", emit_thunk(t, left->AST_INDEX.index)), false);
+		if (left->AST_INDEX.left->type != AST_IDENT)
+			return temp(t, f, str_fmt(t->arena, "rt_assign_index(a, false, (Element) { NIL }, t%u, t%u)",
+						index, value), true);
+		u32 target = temp(t, f, str_fmt(t->arena, "rt_ident(a, ns, &ident_%u)",
+					emit_ident(t, left->AST_INDEX.left->AST_STR)), false);
+		return temp(t, f, str_fmt(t->arena, "rt_assign_index(a, true, t%u, t%u, t%u)", target, index, value), true);
+	}
+	return temp(t, f, str_fmt(t->arena, "rt_error(%.*s)",
+				fmt(c_str(t, str_fmt(t->arena, "Can't assign to type %.*s", fmt(asttype_str(left->type)))))), true);
+}
+
+priv u32 emit_expr(Transpiler *t, CFunction *f, AST *node)
+{
+	Arena *a = t->arena;
+	switch (node->type) {
+		case AST_VAL: {
+			u32 value = emit_expr(t, f, node->AST_VAL.value);
+			return temp(t, f, str_fmt(a, "rt_val(a, ns, %.*s, t%u)", fmt(c_str(t, node->AST_VAL.name)), value), true);
+		}
+		case AST_VAR: {
+			AST *value_node = node->AST_VAR.value;
+			u32 value = (value_node->type == AST_LIST)
+				? temp(t, f, str_fmt(a, "rt_list(a, ns, %u, items_%u)",
+							value_node->AST_LIST->len, emit_items(t, value_node->AST_LIST)), true)
+				: emit_expr(t, f, value_node);
+			return temp(t, f, str_fmt(a, "rt_var(a, ns, %.*s, t%u)", fmt(c_str(t, node->AST_VAR.name)), value), false);
+		}
+		case AST_RETURN:
+			return temp(t, f, str_fmt(a, "rt_return(a, t%u)", emit_expr(t, f, node->AST_RETURN.value)), false);
+		case AST_ASSIGN:
+			return emit_assign(t, f, node->AST_ASSIGN);
+		case AST_WHILE: {
+			u32 condition = emit_thunk(t, node->AST_WHILE.condition);
+			u32 body = emit_block(t, node->AST_WHILE.body, false);
+			return temp(t, f, str_fmt(a, "rt_while(a, ns, expr_%u, block_%u)", condition, body), true);
+		}
+		case AST_IDENT:
+			return temp(t, f, str_fmt(a, "rt_ident(a, ns, &ident_%u)", emit_ident(t, node->AST_STR)), true);
+		case AST_INT:
+			return temp(t, f, str_fmt(a, "(Element) { INT, .INT = %ldL }", node->AST_INT.value), false);
+		case AST_BOOL:
+			return temp(t, f, str_fmt(a, "(Element) { BOOL, .BOOL = %s }",
+						node->AST_BOOL.value ? "true" : "false"), false);
+		case AST_STR:
+			return temp(t, f, str_fmt(a, "elem_from_str(STR, %.*s)", fmt(c_str(t, node->AST_STR))), false);
+		case AST_NULL:
+			return temp(t, f, str("(Element) { NIL }"), false);
+		case AST_LIST: {
+			ASTList *items = node->AST_LIST;
+			return temp(t, f, str_fmt(a, "rt_array(a, ns, %u, items_%u)", items->len, emit_items(t, items)), true);
+		}
+		case AST_MAP: {
+			ASTList *items = node->AST_MAP;
+			return temp(t, f, str_fmt(a, "rt_map(a, ns, %u, items_%u)", items->len / 2, emit_items(t, items)), true);
+		}
+		case AST_FN: {
+			u32 params = emit_params(t, node->AST_FN.params);
+			u32 body = emit_block(t, node->AST_FN.body, false);
+			return temp(t, f, str_fmt(a, "rt_fn(a, ns, &params_%u, block_%u)", params, body), false);
+		}
+		case AST_PREFIX: {
+			u32 right = emit_expr(t, f, node->AST_PREFIX.right);
+			return temp(t, f, str_fmt(a, "rt_prefix(a, %.*s, t%u)", fmt(c_str(t, node->AST_PREFIX.op)), right), true);
+		}
+		case AST_INFIX: {
+			u32 left = emit_expr(t, f, node->AST_INFIX.left);
+			u32 right = emit_expr(t, f, node->AST_INFIX.right);
+			return temp(t, f, str_fmt(a, "rt_infix(a, t%u, %.*s, t%u)",
+						left, fmt(c_str(t, node->AST_INFIX.op)), right), true);
+		}
+		case AST_COND: {
+			u32 condition = emit_thunk(t, node->AST_COND.condition);
+			u32 consequence = emit_block(t, node->AST_COND.consequence, false);
+			String alternative = (node->AST_COND.alternative)
+				? str_fmt(a, "block_%u(a, ns)", emit_block(t, node->AST_COND.alternative, false))
+				: str("(Element) { NIL }");
+			return temp(t, f, str_fmt(a, "rt_truthy(expr_%u(a, ns)) ? block_%u(a, ns) : %.*s",
+						condition, consequence, fmt(alternative)), true);
+		}
+		case AST_INDEX: {
+			u32 left = emit_expr(t, f, node->AST_INDEX.left);
+			u32 index = emit_expr(t, f, node->AST_INDEX.index);
+			return temp(t, f, str_fmt(a, "rt_index(a, ns, t%u, t%u)", left, index), true);
+		}
+		case AST_INVARIANT: // C compilers do their own loop invariant code motion
+			return emit_expr(t, f, node->AST_INVARIANT.value);
+		case AST_CALL: {
+			u32 callee = emit_expr(t, f, node->AST_CALL.function);
+			ASTList *args = node->AST_CALL.args;
+			return temp(t, f, str_fmt(a, "rt_call(a, ns, t%u, %u, items_%u)",
+						callee, args->len, emit_items(t, args)), true);
+		}
+		case AST_PROGRAM:
+			break;
+	}
+	NEVER(true);
+	return temp(t, f, str("(Element) { NIL }"), false);
+}
+
+String emit_c(Arena *a, AST *program, String filename)
+{
+	Transpiler *t = &(Transpiler) { a, strlist(a), strlist(a), 0 };
+	u32 main = emit_block(t, program->AST_LIST, true);
+
+	StrList *res = strlist(a);
+	strpush(res, str_fmt(a, "// Generated by toyscript --emit-c from %.*s\n", fmt(filename)));
+	strpush(res, str("#include \"base.h\"\n#include \"toyscript.h\"\n\n"));
+	for (StrNode *tmp = t->decls->head; tmp; tmp = tmp->next)
+		strpush(res, tmp->string);
+	for (StrNode *tmp = t->defs->head; tmp; tmp = tmp->next)
+		strpush(res, tmp->string);
+	strpush(res, str_fmt(a, "\nint main(void)\n{\n\treturn rt_main(block_%u);\n}\n", main));
+
+	u64 len = 0;
+	for (StrNode *tmp = res->head; tmp; tmp = tmp->next)
+		len += tmp->string.len;
+	char *buf = arena_alloc(a, len);
+	len = 0;
+	for (StrNode *tmp = res->head; tmp; tmp = tmp->next) {
+		memcpy(buf + len, tmp->string.buf, tmp->string.len);
+		len += tmp->string.len;
+	}
+	return (String) { buf, (u32)len };
+}